@@ -0,0 +1,143 @@
+//! A small benchmark harness shared by the files in benches/, in the spirit of
+//! Criterion: every benchmark is warmed up, then timed in samples of enough
+//! iterations to be measurable, and the median and spread of the samples are
+//! reported with the throughput.
+
+#![allow(dead_code)]
+
+use std::env;
+use std::fs;
+use std::hint::black_box;
+use std::time::{Duration, Instant};
+
+/// How long each benchmark is run untimed before the samples.
+const WARMUP: Duration = Duration::from_millis(500);
+/// How long all samples of a benchmark should take together.
+const MEASUREMENT: Duration = Duration::from_secs(3);
+const SAMPLES: usize = 20;
+/// Fewer samples are taken of slow benchmarks, but not fewer than this.
+const MIN_SAMPLES: usize = 5;
+
+pub struct Bencher {
+    /* Only benchmarks whose name contains it are run. */
+    filter: Option<String>,
+}
+
+impl Bencher {
+    /// Takes the filter from the command line, as in `cargo bench --features
+    /// bench squeeze`. The flags cargo passes are ignored.
+    pub fn from_args() -> Bencher {
+        Bencher {
+            filter: env::args().skip(1).find(|arg| !arg.starts_with('-')),
+        }
+    }
+
+    /// Times `f`, which processes `bytes` bytes of input each time, and prints
+    /// the result. The throughput is left out if `bytes` is 0.
+    pub fn bench<T, F>(&mut self, name: &str, bytes: usize, mut f: F)
+        where F: FnMut() -> T
+    {
+        if self.filter.as_ref().map_or(false, |filter| !name.contains(&filter[..])) {
+            return;
+        }
+
+        // Also estimates how long one iteration takes
+        let start = Instant::now();
+        let mut iterations = 0u64;
+        while iterations == 0 || start.elapsed() < WARMUP {
+            black_box(f());
+            iterations += 1;
+        }
+        let per_iteration = (start.elapsed() / iterations as u32).as_nanos().max(1);
+        let per_sample = ((MEASUREMENT / SAMPLES as u32).as_nanos() / per_iteration).max(1) as u32;
+        let count = (MEASUREMENT.as_nanos() / per_iteration).max(MIN_SAMPLES as u128).min(SAMPLES as u128) as usize;
+
+        let mut samples = Vec::with_capacity(count);
+        for _ in 0..count {
+            let start = Instant::now();
+            for _ in 0..per_sample {
+                black_box(f());
+            }
+            samples.push(start.elapsed().as_secs_f64() / per_sample as f64);
+        }
+        samples.sort_by(|a, b| a.partial_cmp(b).unwrap());
+        let median = samples[count / 2];
+        // The middle 90%, leaving out outliers like Criterion's interval
+        let (low, high) = (samples[count / 20], samples[count - 1 - count / 20]);
+        let throughput = if bytes == 0 { String::new() } else { format!("  thrpt: {:.2} MB/s", bytes as f64 / 1e6 / median) };
+        println!("{:<40} time: [{} {} {}]{}", name, format_time(low), format_time(median), format_time(high), throughput);
+    }
+}
+
+fn format_time(seconds: f64) -> String {
+    if seconds < 1e-6 {
+        format!("{:.1} ns", seconds * 1e9)
+    } else if seconds < 1e-3 {
+        format!("{:.2} us", seconds * 1e6)
+    } else if seconds < 1.0 {
+        format!("{:.2} ms", seconds * 1e3)
+    } else {
+        format!("{:.3} s", seconds)
+    }
+}
+
+/// The files in test/data, by name.
+pub fn test_files() -> Vec<(String, Vec<u8>)> {
+    let dir = concat!(env!("CARGO_MANIFEST_DIR"), "/test/data");
+    let mut files: Vec<(String, Vec<u8>)> = fs::read_dir(dir)
+        .expect("couldn't read test/data")
+        .filter_map(|entry| entry.ok())
+        .map(|entry| {
+            let name = entry.file_name().to_string_lossy().into_owned();
+            let data = fs::read(entry.path()).expect("couldn't read a test file");
+            (name, data)
+        })
+        .collect();
+    files.sort();
+    files
+}
+
+/// `size` bytes of data with controlled entropy and repetitiveness. Literals are
+/// drawn uniformly from an alphabet of `2^alphabet_bits` bytes, and a fraction
+/// `repeats` of the data is copies of earlier data, 3 to 258 bytes long from up
+/// to 32KB back. The same arguments always give the same data.
+pub fn synthetic(size: usize, alphabet_bits: u32, repeats: f64, seed: u64) -> Vec<u8> {
+    let mut state = seed.wrapping_mul(0x9e3779b97f4a7c15) | 1;
+    let mut random = move || {
+        // xorshift64*
+        state ^= state >> 12;
+        state ^= state << 25;
+        state ^= state >> 27;
+        state.wrapping_mul(0x2545f4914f6cdd1d)
+    };
+    let mut data = Vec::with_capacity(size);
+    let mut copied = 0;
+    while data.len() < size {
+        let want_copy = (copied as f64) < repeats * data.len() as f64;
+        if want_copy && data.len() >= 3 {
+            let length = (3 + random() % 256) as usize;
+            let dist = 1 + (random() % data.len().min(32768) as u64) as usize;
+            let length = length.min(size - data.len());
+            let start = data.len() - dist;
+            for i in 0..length {
+                let byte = data[start + i];
+                data.push(byte);
+            }
+            copied += length;
+        } else {
+            data.push((random() >> (64 - alphabet_bits.max(1).min(8))) as u8);
+        }
+    }
+    data
+}
+
+/// Synthetic corpora from low to high entropy and repetitiveness, by name.
+pub fn synthetic_corpora(size: usize) -> Vec<(String, Vec<u8>)> {
+    let mut corpora = vec![];
+    for &bits in &[2, 5, 8] {
+        for &repeats in &[0.0, 0.5, 0.9] {
+            corpora.push((format!("synthetic-{}bit-{}rep", bits, (repeats * 100.0) as u32), synthetic(size, bits, repeats, bits as u64)));
+        }
+    }
+    corpora
+}
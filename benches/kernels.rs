@@ -0,0 +1,35 @@
+//! Micro-benchmarks of the hot kernels of the compressor. Run with
+//! `cargo bench --features bench --bench kernels [FILTER]`.
+
+extern crate zopfli;
+
+mod harness;
+
+use harness::{synthetic, Bencher};
+use zopfli::kernels;
+use zopfli::Options;
+
+fn main() {
+    let mut b = Bencher::from_args();
+    let options = Options::default();
+    let js = include_bytes!("../test/data/codetriage.js");
+
+    b.bench("hash_update/codetriage.js", js.len(), || kernels::hash_update(js));
+    b.bench("find_longest_match/codetriage.js", js.len(), || kernels::find_longest_match(&options, js));
+    b.bench("get_best_lengths/codetriage.js", js.len(), || kernels::get_best_lengths(&options, js));
+
+    // Symbol frequencies falling off like those of text
+    let frequencies: Vec<usize> = (0..288).map(|i| if i == 256 { 1 } else { 100000 / (i % 97 + 1) }).collect();
+    b.bench("length_limited_code_lengths/288", 0, || kernels::length_limited_code_lengths(&frequencies, 15));
+    let ll_lengths = kernels::length_limited_code_lengths(&frequencies, 15);
+    let d_lengths = kernels::length_limited_code_lengths(&frequencies[..32], 15);
+    b.bench("calculate_tree_size/288", 0, || kernels::calculate_tree_size(&ll_lengths, &d_lengths));
+
+    let lz77 = kernels::greedy(&options, js);
+    b.bench("get_histogram/64", 0, || kernels::get_histogram(&lz77, 64));
+    b.bench("get_histogram/8192", 0, || kernels::get_histogram(&lz77, 8192));
+
+    let noise = synthetic(200000, 8, 0.0, 1);
+    let symbols: Vec<(u32, u32)> = noise.chunks(2).map(|pair| (pair[0] as u32 | (pair[1] as u32) << 8, 1 + pair[1] as u32 % 15)).collect();
+    b.bench("bitwise_writer/100000", 0, || kernels::bitwise_writer(&symbols).unwrap());
+}
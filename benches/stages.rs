@@ -0,0 +1,33 @@
+//! Macro-benchmarks of each stage of compressing a master block: the greedy
+//! LZ77, the squeeze, the block split search and writing the blocks. They run
+//! on the files in test/data and on synthetic data of different entropy and
+//! repetitiveness. Run with `cargo bench --features bench --bench stages
+//! [FILTER]`.
+
+extern crate zopfli;
+
+mod harness;
+
+use harness::{synthetic_corpora, test_files, Bencher};
+use zopfli::kernels;
+use zopfli::Options;
+
+/// Bytes of each synthetic corpus.
+const SYNTHETIC_SIZE: usize = 256 * 1024;
+
+fn main() {
+    let mut b = Bencher::from_args();
+    let mut options = Options::default();
+    // One iteration is the unit of work of the squeeze, the rest repeat it
+    options.numiterations = 1;
+
+    for (name, data) in test_files().into_iter().chain(synthetic_corpora(SYNTHETIC_SIZE)) {
+        let size = data.len().min(1000000);
+        b.bench(&format!("greedy/{}", name), size, || kernels::greedy(&options, &data));
+        b.bench(&format!("squeeze/{}", name), size, || kernels::squeeze(&options, &data));
+        let lz77 = kernels::greedy(&options, &data);
+        b.bench(&format!("blocksplit/{}", name), size, || kernels::blocksplit(&options, &lz77));
+        let splitpoints = kernels::blocksplit(&options, &lz77);
+        b.bench(&format!("emit/{}", name), size, || kernels::emit(&options, &data, &lz77, &splitpoints).unwrap());
+    }
+}
@@ -0,0 +1,155 @@
+/*
+C interface of the Zopfli shared library, libzopfli.so, which `make libzopfli`
+builds. Functions that return int return ZOPFLI_OK or one of the negative
+ZOPFLI_ERROR_ codes.
+*/
+
+#ifndef ZOPFLI_ZOPFLI_H_
+#define ZOPFLI_ZOPFLI_H_
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+Version of this interface. It changes with every change that isn't backwards
+compatible; compare it with ZopfliAbiVersion() to check that the library that
+was loaded matches this header.
+*/
+#define ZOPFLI_ABI_VERSION 1
+
+#define ZOPFLI_OK 0
+#define ZOPFLI_ERROR_ARGUMENT -1
+/* The write function or the output failed. */
+#define ZOPFLI_ERROR_WRITE -2
+#define ZOPFLI_ERROR_BUFFER_TOO_SMALL -3
+#define ZOPFLI_ERROR_NOMEM -4
+/* A bug in the library. */
+#define ZOPFLI_ERROR_INTERNAL -5
+
+typedef enum {
+  ZOPFLI_FORMAT_GZIP,
+  ZOPFLI_FORMAT_ZLIB,
+  ZOPFLI_FORMAT_DEFLATE
+} ZopfliFormat;
+
+typedef enum {
+  /* A single iteration: much faster, still smaller than zlib. */
+  ZOPFLI_PRESET_FAST,
+  /* 15 iterations, like the zopfli command. */
+  ZOPFLI_PRESET_DEFAULT,
+  /* 100 iterations, for output that is compressed once and served often. */
+  ZOPFLI_PRESET_BEST
+} ZopfliPreset;
+
+/*
+Options for a compression. A negative numiterations or blocksplittingmax makes
+the functions that take them fail with ZOPFLI_ERROR_ARGUMENT, or return NULL.
+*/
+typedef struct ZopfliOptions {
+  /* Whether to print output */
+  int verbose;
+  /* Whether to print more detailed output */
+  int verbose_more;
+  /*
+  Maximum amount of times to rerun forward and backward pass to optimize LZ77
+  compression cost. Good values: 10, 15 for small files, 5 for files over
+  several MB in size or it will be too slow. 0 keeps the fast greedy LZ77.
+  */
+  int numiterations;
+  /*
+  Maximum amount of blocks to split into (0 for unlimited, but this can give
+  extreme results that hurt compression on some files). Default value: 15.
+  */
+  int blocksplittingmax;
+  /* Threads to compress with. 0 or 1 compresses on the calling thread. */
+  int numthreads;
+} ZopfliOptions;
+
+/*
+Grows the buffers the compressed data is appended to. Called like realloc, with
+the opaque pointer of the allocator first.
+*/
+typedef struct ZopfliAllocator {
+  void* (*realloc)(void* opaque, void* ptr, size_t size);
+  void* opaque;
+} ZopfliAllocator;
+
+/*
+Receives the output of a ZopfliEncoder as it is produced. Returns 0 on
+success, anything else makes the encoder fail with ZOPFLI_ERROR_WRITE.
+*/
+typedef int (*ZopfliWriteFunc)(void* opaque, const unsigned char* data,
+                               size_t size);
+
+typedef struct ZopfliEncoder ZopfliEncoder;
+
+unsigned ZopfliAbiVersion(void);
+
+/* Initializes options with the default values. */
+void ZopfliInitOptions(ZopfliOptions* options);
+
+/* Initializes options with the values of a preset. */
+int ZopfliPresetOptions(ZopfliOptions* options, ZopfliPreset preset);
+
+/*
+Compresses according to the given output format and appends the result to the
+output.
+
+options: may be NULL for the default options
+output_type: the output format to use
+out: pointer to the dynamic output array to which the result is appended. Must
+  be freed after use with free().
+outsize: pointer to the dynamic output array size
+*/
+void ZopfliCompress(const ZopfliOptions* options, ZopfliFormat output_type,
+                    const unsigned char* in, size_t insize,
+                    unsigned char** out, size_t* outsize);
+
+/*
+Like ZopfliCompress, but grows *out with allocator, or with realloc if it is
+NULL.
+*/
+int ZopfliCompressAlloc(const ZopfliOptions* options, ZopfliFormat output_type,
+                        const unsigned char* in, size_t insize,
+                        unsigned char** out, size_t* outsize,
+                        const ZopfliAllocator* allocator);
+
+/*
+Compresses into the caller's buffer out of outcapacity bytes, without
+allocating output. *outsize is set to the compressed size, also when it didn't
+fit and ZOPFLI_ERROR_BUFFER_TOO_SMALL is returned, so the call can be repeated
+with a large enough buffer.
+*/
+int ZopfliCompressToBuffer(const ZopfliOptions* options,
+                           ZopfliFormat output_type,
+                           const unsigned char* in, size_t insize,
+                           unsigned char* out, size_t outcapacity,
+                           size_t* outsize);
+
+/*
+Starts a stream that is compressed as input is written to it, and hands the
+output to write. Only a master block of 1MB of input is kept in memory, and the
+output is the same as that of ZopfliCompress on all the input at once. Returns
+NULL on invalid arguments.
+*/
+ZopfliEncoder* ZopfliEncoderCreate(const ZopfliOptions* options,
+                                   ZopfliFormat output_type,
+                                   ZopfliWriteFunc write, void* opaque);
+
+int ZopfliEncoderWrite(ZopfliEncoder* encoder, const unsigned char* data,
+                       size_t size);
+
+/* Ends the stream and frees the encoder, also if that fails. */
+int ZopfliEncoderFinish(ZopfliEncoder* encoder);
+
+/* Frees the encoder without ending the stream. */
+void ZopfliEncoderDestroy(ZopfliEncoder* encoder);
+
+#ifdef __cplusplus
+}  /* extern "C" */
+#endif
+
+#endif  /* ZOPFLI_ZOPFLI_H_ */
@@ -0,0 +1,502 @@
+//! Reads the inputs and writes the outputs of the command on a thread of its
+//! own, so compression never waits on the disk: the next files are read while
+//! the current one is compressed, and compressed files are written in the
+//! background. On Linux the reads and writes go through io_uring, many at a
+//! time; where that isn't available they are plain blocking calls on the same
+//! thread.
+
+use std::collections::{HashMap, VecDeque};
+use std::fs::{self, File};
+use std::io::{self, Read, Write};
+use std::mem;
+use std::sync::mpsc::{self, Receiver, Sender, TryRecvError};
+use std::thread::{self, JoinHandle};
+use std::vec;
+
+use mmap::Mmap;
+#[cfg(target_os = "linux")]
+use uring::Ring;
+
+/* Files larger than this are memory mapped instead of read ahead. */
+const MAP_THRESHOLD: u64 = 16 * 1024 * 1024;
+/* How far reading may get ahead of compression. */
+const READ_AHEAD_FILES: usize = 16;
+const READ_AHEAD_BYTES: usize = 32 * 1024 * 1024;
+#[cfg(target_os = "linux")]
+const RING_ENTRIES: u32 = 64;
+/* Set in the user data of writes, reads have the index of their input. */
+const WRITE: u64 = 1 << 63;
+
+pub enum Input {
+    Data(Vec<u8>),
+    Mapped(Mmap),
+    /* Not a regular file, like a pipe, which has to be streamed. */
+    Stream(File),
+}
+
+enum Msg {
+    /* An input was taken, with the size it had in memory. */
+    Consumed(usize),
+    Write(String, Vec<u8>),
+}
+
+pub struct BatchIo {
+    inputs: Receiver<io::Result<Input>>,
+    messages: Option<Sender<Msg>>,
+    thread: Option<JoinHandle<io::Result<()>>>,
+}
+
+impl BatchIo {
+    /// Starts reading `filenames` in the background.
+    pub fn start(filenames: Vec<String>) -> BatchIo {
+        BatchIo::with_backend(filenames, true)
+    }
+
+    fn with_backend(filenames: Vec<String>, uring: bool) -> BatchIo {
+        let (inputs_tx, inputs) = mpsc::channel();
+        let (messages, messages_rx) = mpsc::channel();
+        let thread = thread::spawn(move || {
+            IoThread {
+                backend: Backend::new(uring),
+                filenames: filenames.into_iter(),
+                inputs: inputs_tx,
+                messages: messages_rx,
+                closed: false,
+                pending: VecDeque::new(),
+                first: 0,
+                unconsumed: 0,
+                buffered: 0,
+                queued_writes: VecDeque::new(),
+                writes: HashMap::new(),
+                next_write: 0,
+                error: None,
+            }.run()
+        });
+        BatchIo {
+            inputs: inputs,
+            messages: Some(messages),
+            thread: Some(thread),
+        }
+    }
+
+    /// The next input, in the order of the filenames.
+    pub fn next_input(&self) -> io::Result<Input> {
+        let input = match self.inputs.recv() {
+            Ok(input) => input,
+            Err(_) => return Err(io::Error::new(io::ErrorKind::Other, "the I/O thread stopped")),
+        };
+        let size = match input {
+            Ok(Input::Data(ref data)) => data.len(),
+            _ => 0,
+        };
+        self.send(Msg::Consumed(size));
+        input
+    }
+
+    /// Writes `data` to a new file at `path` in the background.
+    pub fn write(&self, path: String, data: Vec<u8>) {
+        self.send(Msg::Write(path, data));
+    }
+
+    fn send(&self, msg: Msg) {
+        if let Some(ref messages) = self.messages {
+            /* When the thread stopped, `finish` reports why. */
+            let _ = messages.send(msg);
+        }
+    }
+
+    /// Waits until everything is written. Outputs that failed to be written are
+    /// removed, and the first of their errors is returned.
+    pub fn finish(mut self) -> io::Result<()> {
+        self.join()
+    }
+
+    fn join(&mut self) -> io::Result<()> {
+        self.messages = None;
+        match self.thread.take() {
+            Some(thread) => match thread.join() {
+                Ok(result) => result,
+                Err(_) => Err(io::Error::new(io::ErrorKind::Other, "the I/O thread panicked")),
+            },
+            None => Ok(()),
+        }
+    }
+}
+
+impl Drop for BatchIo {
+    fn drop(&mut self) {
+        let _ = self.join();
+    }
+}
+
+struct Reading {
+    file: File,
+    buf: Vec<u8>,
+    filled: usize,
+}
+
+enum Slot {
+    Reading(Reading),
+    Ready(io::Result<Input>),
+}
+
+struct Writing {
+    path: String,
+    file: File,
+    data: Vec<u8>,
+    written: usize,
+}
+
+struct IoThread {
+    backend: Backend,
+    filenames: vec::IntoIter<String>,
+    inputs: Sender<io::Result<Input>>,
+    messages: Receiver<Msg>,
+    /* No more messages will come. */
+    closed: bool,
+    /* Inputs being read or waiting for the ones before them, in order. The
+       first is input number `first`. */
+    pending: VecDeque<Slot>,
+    first: u64,
+    /* Inputs sent that weren't consumed yet. */
+    unconsumed: usize,
+    /* Bytes of inputs that are being read or weren't consumed yet. */
+    buffered: usize,
+    queued_writes: VecDeque<(String, Vec<u8>)>,
+    writes: HashMap<u64, Writing>,
+    next_write: u64,
+    error: Option<io::Error>,
+}
+
+impl IoThread {
+    fn run(mut self) -> io::Result<()> {
+        loop {
+            self.receive();
+            while self.can_read() && self.backend.has_room() {
+                self.start_read();
+            }
+            while !self.queued_writes.is_empty() && self.backend.has_room() {
+                let (path, data) = self.queued_writes.pop_front().unwrap();
+                self.start_write(path, data);
+            }
+
+            if self.backend.in_flight() > 0 {
+                let completions = match self.backend.submit_and_wait() {
+                    Ok(completions) => completions,
+                    Err(err) => {
+                        /* The kernel may still use the buffers, so they can't be freed. */
+                        mem::forget(mem::replace(&mut self.pending, VecDeque::new()));
+                        mem::forget(mem::replace(&mut self.writes, HashMap::new()));
+                        return Err(err);
+                    }
+                };
+                for (user_data, result) in completions {
+                    if user_data & WRITE != 0 {
+                        self.complete_write(user_data, result);
+                    } else {
+                        self.complete_read(user_data, result);
+                    }
+                }
+            }
+
+            while let Some(&Slot::Ready(_)) = self.pending.front() {
+                if let Some(Slot::Ready(input)) = self.pending.pop_front() {
+                    /* Unless compression stopped. */
+                    let _ = self.inputs.send(input);
+                }
+                self.first += 1;
+                self.unconsumed += 1;
+            }
+
+            if self.closed && self.backend.in_flight() == 0 && self.queued_writes.is_empty() {
+                break;
+            }
+        }
+        match self.error.take() {
+            Some(err) => Err(err),
+            None => Ok(()),
+        }
+    }
+
+    /// Handles the messages that came in. Only waits for one when there is
+    /// nothing else to do.
+    fn receive(&mut self) {
+        while !self.closed {
+            let idle = self.backend.in_flight() == 0 && self.queued_writes.is_empty() && !self.can_read();
+            let msg = if idle {
+                self.messages.recv().ok()
+            } else {
+                match self.messages.try_recv() {
+                    Ok(msg) => Some(msg),
+                    Err(TryRecvError::Empty) => return,
+                    Err(TryRecvError::Disconnected) => None,
+                }
+            };
+            match msg {
+                Some(Msg::Consumed(size)) => {
+                    self.unconsumed -= 1;
+                    self.buffered -= size;
+                }
+                Some(Msg::Write(path, data)) => self.queued_writes.push_back((path, data)),
+                None => self.closed = true,
+            }
+        }
+    }
+
+    fn can_read(&self) -> bool {
+        !self.closed && self.filenames.len() > 0 && self.pending.len() + self.unconsumed < READ_AHEAD_FILES && self.buffered < READ_AHEAD_BYTES
+    }
+
+    fn start_read(&mut self) {
+        let filename = self.filenames.next().unwrap();
+        let index = self.first + self.pending.len() as u64;
+        let slot = match open(&filename) {
+            Ok(slot) => slot,
+            Err(err) => Slot::Ready(Err(err)),
+        };
+        self.pending.push_back(slot);
+        if let Some(&mut Slot::Reading(ref mut reading)) = self.pending.back_mut() {
+            self.buffered += reading.buf.len();
+            unsafe { self.backend.read(&reading.file, &mut reading.buf, 0, index) };
+        }
+    }
+
+    fn complete_read(&mut self, index: u64, result: io::Result<usize>) {
+        let slot = &mut self.pending[(index - self.first) as usize];
+        let result = match *slot {
+            Slot::Reading(ref mut reading) => {
+                let len = reading.buf.len();
+                match result {
+                    /* The file shrank since it was opened. */
+                    Ok(0) => {
+                        self.buffered -= len - reading.filled;
+                        reading.buf.truncate(reading.filled);
+                        Ok(())
+                    }
+                    Ok(size) if reading.filled + size < len => {
+                        reading.filled += size;
+                        let filled = reading.filled;
+                        unsafe { self.backend.read(&reading.file, &mut reading.buf[filled..], filled as u64, index) };
+                        return;
+                    }
+                    Ok(_) => Ok(()),
+                    Err(ref err) if err.kind() == io::ErrorKind::Interrupted => {
+                        let filled = reading.filled;
+                        unsafe { self.backend.read(&reading.file, &mut reading.buf[filled..], filled as u64, index) };
+                        return;
+                    }
+                    Err(err) => {
+                        self.buffered -= len;
+                        Err(err)
+                    }
+                }
+            }
+            Slot::Ready(_) => unreachable!(),
+        };
+        if let Slot::Reading(reading) = mem::replace(slot, Slot::Ready(Ok(Input::Data(vec![])))) {
+            *slot = Slot::Ready(result.map(|_| Input::Data(reading.buf)));
+        }
+    }
+
+    fn start_write(&mut self, path: String, data: Vec<u8>) {
+        let file = match File::create(&path) {
+            Ok(file) => file,
+            Err(err) => return self.fail_write(path, err),
+        };
+        if data.is_empty() {
+            return;
+        }
+        let user_data = WRITE | self.next_write;
+        self.next_write += 1;
+        let writing = self.writes.entry(user_data).or_insert(Writing {
+            path: path,
+            file: file,
+            data: data,
+            written: 0,
+        });
+        unsafe { self.backend.write(&writing.file, &writing.data, 0, user_data) };
+    }
+
+    fn complete_write(&mut self, user_data: u64, result: io::Result<usize>) {
+        let result = {
+            let writing = self.writes.get_mut(&user_data).unwrap();
+            match result {
+                Ok(0) => Err(io::Error::new(io::ErrorKind::WriteZero, "failed to write whole buffer")),
+                Ok(size) if writing.written + size < writing.data.len() => {
+                    writing.written += size;
+                    let written = writing.written;
+                    unsafe { self.backend.write(&writing.file, &writing.data[written..], written as u64, user_data) };
+                    return;
+                }
+                Ok(_) => Ok(()),
+                Err(ref err) if err.kind() == io::ErrorKind::Interrupted => {
+                    let written = writing.written;
+                    unsafe { self.backend.write(&writing.file, &writing.data[written..], written as u64, user_data) };
+                    return;
+                }
+                Err(err) => Err(err),
+            }
+        };
+        let writing = self.writes.remove(&user_data).unwrap();
+        if let Err(err) = result {
+            drop(writing.file);
+            self.fail_write(writing.path, err);
+        }
+    }
+
+    /// Removes the incomplete output and keeps the first error.
+    fn fail_write(&mut self, path: String, err: io::Error) {
+        let _ = fs::remove_file(&path);
+        if self.error.is_none() {
+            self.error = Some(io::Error::new(err.kind(), format!("couldn't write {}: {}", path, err)));
+        }
+    }
+}
+
+/// Opens a file to be read, or to be mapped or streamed instead when it is
+/// large or not a regular file.
+fn open(filename: &str) -> io::Result<Slot> {
+    let file = try!(File::open(filename));
+    let metadata = try!(file.metadata());
+    if !metadata.is_file() {
+        return Ok(Slot::Ready(Ok(Input::Stream(file))));
+    }
+    if metadata.len() > MAP_THRESHOLD {
+        if let Some(mapped) = Mmap::open(&file) {
+            return Ok(Slot::Ready(Ok(Input::Mapped(mapped))));
+        }
+    }
+    if metadata.len() == 0 {
+        return Ok(Slot::Ready(Ok(Input::Data(vec![]))));
+    }
+    Ok(Slot::Reading(Reading {
+        file: file,
+        buf: vec![0; metadata.len() as usize],
+        filled: 0,
+    }))
+}
+
+enum Backend {
+    #[cfg(target_os = "linux")]
+    Ring(Ring),
+    /* Reads and writes right away, keeping the results for `submit_and_wait`. */
+    Blocking(Vec<(u64, io::Result<usize>)>),
+}
+
+impl Backend {
+    #[cfg(target_os = "linux")]
+    fn new(uring: bool) -> Backend {
+        if uring {
+            if let Ok(ring) = Ring::new(RING_ENTRIES) {
+                return Backend::Ring(ring);
+            }
+        }
+        Backend::Blocking(vec![])
+    }
+
+    #[cfg(not(target_os = "linux"))]
+    fn new(_uring: bool) -> Backend {
+        Backend::Blocking(vec![])
+    }
+
+    fn has_room(&self) -> bool {
+        match *self {
+            #[cfg(target_os = "linux")]
+            Backend::Ring(ref ring) => ring.has_room(),
+            Backend::Blocking(_) => true,
+        }
+    }
+
+    fn in_flight(&self) -> usize {
+        match *self {
+            #[cfg(target_os = "linux")]
+            Backend::Ring(ref ring) => ring.in_flight(),
+            Backend::Blocking(ref completed) => completed.len(),
+        }
+    }
+
+    /// Reads the part of `file` at `offset` into `buf`. Reads of a file follow
+    /// each other, so the blocking backend continues where the previous one
+    /// stopped. The file and the buffer must stay where they are until the read
+    /// completes.
+    #[cfg_attr(not(target_os = "linux"), allow(unused_variables))]
+    unsafe fn read(&mut self, file: &File, buf: &mut [u8], offset: u64, user_data: u64) {
+        match *self {
+            #[cfg(target_os = "linux")]
+            Backend::Ring(ref mut ring) => {
+                use std::os::unix::io::AsRawFd;
+                ring.read(file.as_raw_fd(), buf.as_mut_ptr(), buf.len(), offset, user_data);
+            }
+            Backend::Blocking(ref mut completed) => {
+                let mut file = file;
+                completed.push((user_data, file.read(buf)));
+            }
+        }
+    }
+
+    /// Writes the next part of `file` from `buf`, like `read`.
+    #[cfg_attr(not(target_os = "linux"), allow(unused_variables))]
+    unsafe fn write(&mut self, file: &File, buf: &[u8], offset: u64, user_data: u64) {
+        match *self {
+            #[cfg(target_os = "linux")]
+            Backend::Ring(ref mut ring) => {
+                use std::os::unix::io::AsRawFd;
+                ring.write(file.as_raw_fd(), buf.as_ptr(), buf.len(), offset, user_data);
+            }
+            Backend::Blocking(ref mut completed) => {
+                let mut file = file;
+                completed.push((user_data, file.write(buf)));
+            }
+        }
+    }
+
+    fn submit_and_wait(&mut self) -> io::Result<Vec<(u64, io::Result<usize>)>> {
+        match *self {
+            #[cfg(target_os = "linux")]
+            Backend::Ring(ref mut ring) => ring.submit_and_wait(),
+            Backend::Blocking(ref mut completed) => Ok(mem::replace(completed, vec![])),
+        }
+    }
+}
+
+#[cfg(test)]
+mod test {
+    use std::env;
+    use std::fs::{self, File};
+    use std::io::Write;
+    use std::process;
+
+    use super::*;
+
+    #[test]
+    fn reads_in_order_and_writes_every_output() {
+        let dir = env::temp_dir().join(format!("zopfli-batch-{}", process::id()));
+        fs::create_dir_all(&dir).unwrap();
+        let contents: Vec<Vec<u8>> = (0..40).map(|i| (0..i * 997).map(|j| (i + j) as u8).collect()).collect();
+        let filenames: Vec<String> = (0..contents.len()).map(|i| dir.join(format!("{}", i)).to_str().unwrap().to_string()).collect();
+        for (filename, data) in filenames.iter().zip(&contents) {
+            File::create(filename).unwrap().write_all(data).unwrap();
+        }
+
+        for &uring in &[true, false] {
+            let batch = BatchIo::with_backend(filenames.clone(), uring);
+            for (filename, data) in filenames.iter().zip(&contents) {
+                match batch.next_input().unwrap() {
+                    Input::Data(input) => assert_eq!(&input, data),
+                    _ => panic!("{} wasn't read", filename),
+                }
+                let mut output = data.clone();
+                output.reverse();
+                batch.write(format!("{}.out", filename), output);
+            }
+            batch.finish().unwrap();
+
+            for (filename, data) in filenames.iter().zip(&contents) {
+                let mut output = fs::read(format!("{}.out", filename)).unwrap();
+                output.reverse();
+                assert_eq!(&output, data);
+            }
+        }
+        fs::remove_dir_all(&dir).unwrap();
+    }
+}
@@ -0,0 +1,597 @@
+//! `zopfli bench`: compresses files at a few presets and thread counts and
+//! reports how fast, how small and at what cost, compared to what zlib at level
+//! 9 would give. The results can be saved as a JSON baseline, and a later build
+//! compared against it to catch speed, memory and ratio regressions.
+
+use std::collections::HashMap;
+use std::fmt;
+use std::fs;
+use std::io;
+use std::path::{Path, PathBuf};
+use std::process;
+use std::sync::Arc;
+use std::time::Instant;
+
+use zopfli;
+
+/// Iterations of the presets, as in the C interface.
+const PRESETS: &'static [(&'static str, i32)] = &[("fast", 1), ("default", 15), ("best", 100)];
+/// Slowdown always tolerated by `--compare`, as a fraction.
+const TIME_THRESHOLD: f64 = 0.05;
+/// Growth of the peak RSS tolerated by `--compare`, as a fraction.
+const RSS_THRESHOLD: f64 = 0.1;
+/// A slowdown only counts when it is this many times the combined relative
+/// median absolute deviations of the runs of both sides.
+const NOISE_FACTOR: f64 = 3.0;
+
+struct Config {
+    presets: Vec<(String, i32)>,
+    threads: Vec<usize>,
+    runs: usize,
+    warmup: usize,
+    json: bool,
+    save: Option<String>,
+    compare: Option<String>,
+    threshold: f64,
+    paths: Vec<String>,
+}
+
+/// What one file at one preset and thread count measured, over all runs.
+struct Measurement {
+    file: String,
+    preset: String,
+    threads: usize,
+    input_size: usize,
+    output_size: usize,
+    /* Medians over the runs, in seconds, and their median absolute deviations. */
+    seconds: f64,
+    cpu_seconds: f64,
+    seconds_mad: f64,
+    cpu_seconds_mad: f64,
+    /* Bytes, when known. */
+    peak_rss: Option<u64>,
+    /* What zlib -9 would give, estimated from a greedy LZ77 pass, not measured. */
+    zlib9_estimate: usize,
+}
+
+impl Measurement {
+    fn megabytes_per_second(&self) -> f64 {
+        self.input_size as f64 / 1e6 / self.seconds
+    }
+
+    fn ratio(&self) -> f64 {
+        self.output_size as f64 / self.input_size.max(1) as f64
+    }
+
+    fn saved_per_cpu_second(&self) -> f64 {
+        (self.input_size as f64 - self.output_size as f64) / self.cpu_seconds.max(1e-9)
+    }
+
+    /// How much smaller than the estimate of zlib -9 the output is, as a
+    /// fraction.
+    fn gain_over_zlib9_estimate(&self) -> f64 {
+        1.0 - self.output_size as f64 / self.zlib9_estimate.max(1) as f64
+    }
+}
+
+pub fn main<I: Iterator<Item = String>>(args: I) {
+    let mut config = Config {
+        presets: vec![("default".to_string(), 15)],
+        threads: vec![1],
+        runs: 3,
+        warmup: 1,
+        json: false,
+        save: None,
+        compare: None,
+        threshold: TIME_THRESHOLD,
+        paths: vec![],
+    };
+    for arg in args {
+        match &arg[..] {
+            "--json" => config.json = true,
+            "-h" => {
+                usage();
+                return;
+            }
+            _ if arg.starts_with("--presets=") => {
+                config.presets = arg["--presets=".len()..].split(',').map(|name| {
+                    match PRESETS.iter().find(|&&(preset, _)| preset == name) {
+                        Some(&(preset, iterations)) => (preset.to_string(), iterations),
+                        None => match name.parse() {
+                            Ok(iterations) => (format!("i{}", iterations), iterations),
+                            Err(_) => fail(&format!("unknown preset {}", name)),
+                        },
+                    }
+                }).collect();
+            }
+            _ if arg.starts_with("--threads=") => {
+                config.threads = arg["--threads=".len()..].split(',').map(|n| number(&arg, n).max(1)).collect();
+            }
+            _ if arg.starts_with("--runs=") => config.runs = number(&arg, &arg["--runs=".len()..]).max(1),
+            _ if arg.starts_with("--warmup=") => config.warmup = number(&arg, &arg["--warmup=".len()..]),
+            _ if arg.starts_with("--save=") => config.save = Some(arg["--save=".len()..].to_string()),
+            _ if arg.starts_with("--compare=") => config.compare = Some(arg["--compare=".len()..].to_string()),
+            _ if arg.starts_with("--threshold=") => {
+                config.threshold = number(&arg, &arg["--threshold=".len()..]) as f64 / 100.0;
+            }
+            _ if arg.starts_with('-') => fail(&format!("unknown option {}", arg)),
+            _ => config.paths.push(arg),
+        }
+    }
+    if config.paths.is_empty() {
+        usage();
+        process::exit(1);
+    }
+
+    let mut files = vec![];
+    for path in &config.paths {
+        collect_files(Path::new(path), &mut files);
+    }
+    let mut results = vec![];
+    for file in &files {
+        let data = fs::read(file).unwrap_or_else(|why| panic!("couldn't read {}: {}", file.display(), why));
+        // Estimated from the greedy LZ77, like zlib's, and its block flushes
+        let zlib9_estimate = zopfli::predict(&zopfli::Options::default(), &data, None).zlib9_size;
+        for &(ref preset, iterations) in &config.presets {
+            for &threads in &config.threads {
+                let result = bench_one(&config, file, &data, preset, iterations, threads, zlib9_estimate);
+                if !config.json {
+                    print_result(&result);
+                }
+                results.push(result);
+            }
+        }
+    }
+    if config.json {
+        print!("{}", to_json(&results));
+    }
+    if let Some(ref path) = config.save {
+        fs::write(path, to_json(&results))
+            .unwrap_or_else(|why| panic!("couldn't write the baseline {}: {}", path, why));
+    }
+    if let Some(ref path) = config.compare {
+        let baseline = fs::read_to_string(path)
+            .and_then(|json| parse_json(&json))
+            .unwrap_or_else(|why| panic!("couldn't read the baseline {}: {}", path, why));
+        let mut regressed = false;
+        for result in &results {
+            let comparison = compare(&baseline, result, config.threshold);
+            regressed |= !comparison.regressions.is_empty();
+            println!("{}", comparison);
+        }
+        if regressed {
+            process::exit(1);
+        }
+    }
+}
+
+fn usage() {
+    eprintln!("Usage: zopfli bench [OPTION]... PATH...");
+    eprintln!("Compresses each file, or the files in each directory, and reports throughput,");
+    eprintln!("ratio, bytes saved per CPU second, peak RSS and the gain over an estimate of");
+    eprintln!("zlib -9.");
+    eprintln!("  --presets=P,...  fast, default, best or a number of iterations (default)");
+    eprintln!("  --threads=N,...  thread counts to run each preset with (1)");
+    eprintln!("  --runs=N         timed runs, of which the median is reported (3)");
+    eprintln!("  --warmup=N       untimed runs before them (1)");
+    eprintln!("  --json           print the results as JSON");
+    eprintln!("  --save=FILE      save the results as a JSON baseline");
+    eprintln!("  --compare=FILE   compare the results with a baseline, and exit with status 1");
+    eprintln!("                   if anything is slower, uses more memory or compresses worse");
+    eprintln!("  --threshold=PCT  slowdown in percent to always tolerate (5), on top of the");
+    eprintln!("                   noise of the runs");
+}
+
+fn fail(msg: &str) -> ! {
+    eprintln!("{}", msg);
+    usage();
+    process::exit(1);
+}
+
+fn number(arg: &str, value: &str) -> usize {
+    value.parse().unwrap_or_else(|_| fail(&format!("invalid number in {}", arg)))
+}
+
+/// The files of `path`, those in directories below it in name order.
+fn collect_files(path: &Path, files: &mut Vec<PathBuf>) {
+    if !path.is_dir() {
+        files.push(path.to_path_buf());
+        return;
+    }
+    let mut entries: Vec<PathBuf> = fs::read_dir(path)
+        .unwrap_or_else(|why| panic!("couldn't read {}: {}", path.display(), why))
+        .filter_map(|entry| entry.ok().map(|entry| entry.path()))
+        .collect();
+    entries.sort();
+    for entry in entries {
+        collect_files(&entry, files);
+    }
+}
+
+fn bench_one(config: &Config, file: &Path, data: &[u8], preset: &str, iterations: i32, threads: usize, zlib9_estimate: usize) -> Measurement {
+    let mut options = zopfli::Options::default();
+    options.numiterations = iterations;
+    if threads > 1 {
+        options.executor = Some(Arc::new(zopfli::ThreadExecutor::with_threads(threads)));
+    }
+
+    let mut output_size = None;
+    let mut seconds = vec![];
+    let mut cpu_seconds = vec![];
+    reset_peak_rss();
+    for run in 0..config.warmup + config.runs {
+        let start = Instant::now();
+        let cpu_start = cpu_time();
+        let mut out = Vec::with_capacity(data.len() / 2);
+        // Raw deflate, to compare with the zlib estimate without containers
+        zopfli::compress(&options, &zopfli::Format::Deflate, data, &mut out)
+            .unwrap_or_else(|why| panic!("couldn't compress {}: {}", file.display(), why));
+        let elapsed = start.elapsed().as_secs_f64();
+        let cpu_elapsed = cpu_time() - cpu_start;
+        // Every run must give the same output, or the timings compare different work
+        if *output_size.get_or_insert(out.len()) != out.len() {
+            panic!("the output of {} changed between runs", file.display());
+        }
+        if run >= config.warmup {
+            seconds.push(elapsed);
+            cpu_seconds.push(cpu_elapsed);
+        }
+    }
+    Measurement {
+        file: file.display().to_string(),
+        preset: preset.to_string(),
+        threads: threads,
+        input_size: data.len(),
+        output_size: output_size.unwrap_or(0),
+        seconds_mad: median_absolute_deviation(&seconds),
+        cpu_seconds_mad: median_absolute_deviation(&cpu_seconds),
+        seconds: median(seconds),
+        cpu_seconds: median(cpu_seconds),
+        peak_rss: peak_rss(),
+        zlib9_estimate: zlib9_estimate,
+    }
+}
+
+fn median(mut values: Vec<f64>) -> f64 {
+    values.sort_by(|a, b| a.partial_cmp(b).unwrap());
+    values[values.len() / 2]
+}
+
+fn median_absolute_deviation(values: &[f64]) -> f64 {
+    let center = median(values.to_vec());
+    median(values.iter().map(|value| (value - center).abs()).collect())
+}
+
+fn print_result(r: &Measurement) {
+    let rss = r.peak_rss.map_or("-".to_string(), |rss| format!("{:.1}MB", rss as f64 / 1e6));
+    println!("{} {} x{}: {} -> {} bytes, ratio {:.4}, {:.3} MB/s, {:.0} bytes saved per CPU second, peak RSS {}, {:+.2}% vs zlib -9 as estimated ({} bytes)",
+             r.file, r.preset, r.threads, r.input_size, r.output_size, r.ratio(), r.megabytes_per_second(), r.saved_per_cpu_second(), rss, 100.0 * r.gain_over_zlib9_estimate(), r.zlib9_estimate);
+}
+
+fn to_json(results: &[Measurement]) -> String {
+    let mut json = String::from("[\n");
+    for (i, r) in results.iter().enumerate() {
+        let rss = r.peak_rss.map_or("null".to_string(), |rss| rss.to_string());
+        json.push_str(&format!("  {{\"file\": {}, \"preset\": {}, \"threads\": {}, \"input_size\": {}, \"output_size\": {}, \"seconds\": {:.6}, \"cpu_seconds\": {:.6}, \"seconds_mad\": {:.6}, \"cpu_seconds_mad\": {:.6}, \"megabytes_per_second\": {:.6}, \"ratio\": {:.6}, \"saved_per_cpu_second\": {:.3}, \"peak_rss\": {}, \"zlib9_estimate\": {}, \"gain_over_zlib9_estimate\": {:.6}}}{}\n",
+                               json_string(&r.file), json_string(&r.preset), r.threads, r.input_size, r.output_size, r.seconds, r.cpu_seconds, r.seconds_mad, r.cpu_seconds_mad, r.megabytes_per_second(), r.ratio(), r.saved_per_cpu_second(), rss, r.zlib9_estimate, r.gain_over_zlib9_estimate(),
+                               if i + 1 < results.len() { "," } else { "" }));
+    }
+    json.push_str("]\n");
+    json
+}
+
+fn json_string(s: &str) -> String {
+    let mut json = String::from("\"");
+    for c in s.chars() {
+        match c {
+            '"' => json.push_str("\\\""),
+            '\\' => json.push_str("\\\\"),
+            c if (c as u32) < 32 => json.push_str(&format!("\\u{:04x}", c as u32)),
+            c => json.push(c),
+        }
+    }
+    json.push('"');
+    json
+}
+
+/// A value in the JSON that `to_json` writes.
+#[derive(Clone, Debug, PartialEq)]
+enum Json {
+    Str(String),
+    Num(f64),
+    Null,
+}
+
+/// Reads back what `to_json` wrote: an array of flat objects of strings, numbers
+/// and nulls.
+fn parse_json(json: &str) -> io::Result<Vec<Measurement>> {
+    let mut parser = Parser {
+        chars: json.chars().collect(),
+        pos: 0,
+    };
+    let mut results = vec![];
+    try!(parser.expect('['));
+    while parser.peek() == Some('{') {
+        try!(parser.expect('{'));
+        let mut fields = HashMap::new();
+        while parser.peek() == Some('"') {
+            let key = try!(parser.string());
+            try!(parser.expect(':'));
+            fields.insert(key, try!(parser.value()));
+            if parser.peek() == Some(',') {
+                try!(parser.expect(','));
+            }
+        }
+        try!(parser.expect('}'));
+        results.push(try!(measurement(&fields)));
+        if parser.peek() == Some(',') {
+            try!(parser.expect(','));
+        }
+    }
+    try!(parser.expect(']'));
+    Ok(results)
+}
+
+fn measurement(fields: &HashMap<String, Json>) -> io::Result<Measurement> {
+    let string = |key: &str| match fields.get(key) {
+        Some(&Json::Str(ref value)) => Ok(value.clone()),
+        _ => Err(invalid(&format!("missing {}", key))),
+    };
+    let number = |key: &str| match fields.get(key) {
+        Some(&Json::Num(value)) => Ok(value),
+        _ => Err(invalid(&format!("missing {}", key))),
+    };
+    Ok(Measurement {
+        file: try!(string("file")),
+        preset: try!(string("preset")),
+        threads: try!(number("threads")) as usize,
+        input_size: try!(number("input_size")) as usize,
+        output_size: try!(number("output_size")) as usize,
+        seconds: try!(number("seconds")),
+        cpu_seconds: try!(number("cpu_seconds")),
+        seconds_mad: number("seconds_mad").unwrap_or(0.0),
+        cpu_seconds_mad: number("cpu_seconds_mad").unwrap_or(0.0),
+        peak_rss: number("peak_rss").ok().map(|rss| rss as u64),
+        zlib9_estimate: try!(number("zlib9_estimate")) as usize,
+    })
+}
+
+struct Parser {
+    chars: Vec<char>,
+    pos: usize,
+}
+
+impl Parser {
+    fn peek(&mut self) -> Option<char> {
+        while self.pos < self.chars.len() && self.chars[self.pos].is_whitespace() {
+            self.pos += 1;
+        }
+        self.chars.get(self.pos).cloned()
+    }
+
+    fn expect(&mut self, c: char) -> io::Result<()> {
+        if self.peek() != Some(c) {
+            return Err(invalid(&format!("expected {} at {}", c, self.pos)));
+        }
+        self.pos += 1;
+        Ok(())
+    }
+
+    fn string(&mut self) -> io::Result<String> {
+        try!(self.expect('"'));
+        let mut string = String::new();
+        loop {
+            let c = match self.chars.get(self.pos) {
+                Some(&c) => c,
+                None => return Err(invalid("unterminated string")),
+            };
+            self.pos += 1;
+            match c {
+                '"' => return Ok(string),
+                '\\' => {
+                    let escaped = self.chars.get(self.pos).cloned();
+                    self.pos += 1;
+                    match escaped {
+                        Some('u') => {
+                            let hex: String = self.chars.iter().skip(self.pos).take(4).collect();
+                            self.pos += 4;
+                            let code = try!(u32::from_str_radix(&hex, 16).map_err(|_| invalid("invalid escape")));
+                            string.push(try!(::std::char::from_u32(code).ok_or_else(|| invalid("invalid escape"))));
+                        }
+                        Some('n') => string.push('\n'),
+                        Some('t') => string.push('\t'),
+                        Some(c) => string.push(c),
+                        None => return Err(invalid("unterminated string")),
+                    }
+                }
+                c => string.push(c),
+            }
+        }
+    }
+
+    fn value(&mut self) -> io::Result<Json> {
+        match self.peek() {
+            Some('"') => self.string().map(Json::Str),
+            Some('n') => {
+                self.pos += 4;
+                Ok(Json::Null)
+            }
+            _ => {
+                let start = self.pos;
+                while self.pos < self.chars.len() && "+-.0123456789eE".contains(self.chars[self.pos]) {
+                    self.pos += 1;
+                }
+                let number: String = self.chars[start..self.pos].iter().collect();
+                number.parse().map(Json::Num).map_err(|_| invalid(&format!("invalid number at {}", start)))
+            }
+        }
+    }
+}
+
+fn invalid(msg: &str) -> io::Error {
+    io::Error::new(io::ErrorKind::InvalidData, msg)
+}
+
+/// How a result compares to the same file, preset and thread count in a
+/// baseline.
+struct Comparison {
+    name: String,
+    /* Relative changes of the medians, none if not in the baseline. */
+    seconds: Option<f64>,
+    cpu_seconds: Option<f64>,
+    peak_rss: Option<f64>,
+    output_size: Option<i64>,
+    /* The slowdown tolerated, from the threshold and the noise. */
+    tolerance: f64,
+    regressions: Vec<String>,
+}
+
+impl fmt::Display for Comparison {
+    fn fmt(&self, f: &mut fmt::Formatter) -> fmt::Result {
+        let (seconds, cpu_seconds, output_size) = match (self.seconds, self.cpu_seconds, self.output_size) {
+            (Some(seconds), Some(cpu_seconds), Some(output_size)) => (seconds, cpu_seconds, output_size),
+            _ => return write!(f, "{}: not in the baseline", self.name),
+        };
+        try!(write!(f, "{}: time {:+.1}%, CPU {:+.1}% (tolerance {:.1}%), ", self.name, 100.0 * seconds, 100.0 * cpu_seconds, 100.0 * self.tolerance));
+        if let Some(peak_rss) = self.peak_rss {
+            try!(write!(f, "peak RSS {:+.1}%, ", 100.0 * peak_rss));
+        }
+        try!(write!(f, "size {:+} bytes", output_size));
+        if self.regressions.is_empty() {
+            write!(f, ", ok")
+        } else {
+            write!(f, ", REGRESSED: {}", self.regressions.join(", "))
+        }
+    }
+}
+
+/// Compares `result` to its entry in `baseline`. Output sizes are deterministic,
+/// so any growth is a regression. Times are noisy, so a slowdown has to be
+/// beyond `threshold` and beyond `NOISE_FACTOR` times the relative deviations
+/// of both measurements.
+fn compare(baseline: &[Measurement], result: &Measurement, threshold: f64) -> Comparison {
+    let mut comparison = Comparison {
+        name: format!("{} {} x{}", result.file, result.preset, result.threads),
+        seconds: None,
+        cpu_seconds: None,
+        peak_rss: None,
+        output_size: None,
+        tolerance: threshold,
+        regressions: vec![],
+    };
+    let old = match baseline.iter().find(|old| old.file == result.file && old.preset == result.preset && old.threads == result.threads) {
+        Some(old) => old,
+        None => return comparison,
+    };
+    let change = |old: f64, new: f64| new / old.max(1e-9) - 1.0;
+    let noise = |old_median: f64, old_mad: f64, new_median: f64, new_mad: f64| {
+        NOISE_FACTOR * (old_mad / old_median.max(1e-9) + new_mad / new_median.max(1e-9))
+    };
+    let seconds = change(old.seconds, result.seconds);
+    let cpu_seconds = change(old.cpu_seconds, result.cpu_seconds);
+    let time_tolerance = threshold.max(noise(old.seconds, old.seconds_mad, result.seconds, result.seconds_mad));
+    let cpu_tolerance = threshold.max(noise(old.cpu_seconds, old.cpu_seconds_mad, result.cpu_seconds, result.cpu_seconds_mad));
+    comparison.tolerance = time_tolerance.max(cpu_tolerance);
+    if seconds > time_tolerance {
+        comparison.regressions.push("time".to_string());
+    }
+    if cpu_seconds > cpu_tolerance {
+        comparison.regressions.push("CPU time".to_string());
+    }
+    if let (Some(old_rss), Some(new_rss)) = (old.peak_rss, result.peak_rss) {
+        let peak_rss = change(old_rss as f64, new_rss as f64);
+        if peak_rss > RSS_THRESHOLD {
+            comparison.regressions.push("peak RSS".to_string());
+        }
+        comparison.peak_rss = Some(peak_rss);
+    }
+    let output_size = result.output_size as i64 - old.output_size as i64;
+    if output_size > 0 {
+        comparison.regressions.push("size".to_string());
+    }
+    comparison.seconds = Some(seconds);
+    comparison.cpu_seconds = Some(cpu_seconds);
+    comparison.output_size = Some(output_size);
+    comparison
+}
+
+/// CPU time of the whole process, all threads, in seconds.
+#[cfg(all(target_os = "linux", target_pointer_width = "64"))]
+fn cpu_time() -> f64 {
+    #[repr(C)]
+    struct Timespec {
+        tv_sec: i64,
+        tv_nsec: i64,
+    }
+    extern "C" {
+        fn clock_gettime(clock: i32, time: *mut Timespec) -> i32;
+    }
+    const CLOCK_PROCESS_CPUTIME_ID: i32 = 2;
+
+    let mut time = Timespec { tv_sec: 0, tv_nsec: 0 };
+    unsafe { clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &mut time) };
+    time.tv_sec as f64 + time.tv_nsec as f64 / 1e9
+}
+
+/// Without a CPU clock, the wall time since the first call, which is the CPU
+/// time of one busy thread.
+#[cfg(not(all(target_os = "linux", target_pointer_width = "64")))]
+fn cpu_time() -> f64 {
+    use std::sync::OnceLock;
+    static START: OnceLock<Instant> = OnceLock::new();
+    START.get_or_init(Instant::now).elapsed().as_secs_f64()
+}
+
+/// Starts measuring the peak RSS from the current RSS, where the kernel allows.
+fn reset_peak_rss() {
+    /* Linux resets VmHWM on writing 5, failing only means a higher peak. */
+    let _ = fs::write("/proc/self/clear_refs", "5");
+}
+
+/// The peak resident set size since `reset_peak_rss`, or since the start.
+pub fn peak_rss() -> Option<u64> {
+    let status = match fs::read_to_string("/proc/self/status") {
+        Ok(status) => status,
+        Err(_) => return None,
+    };
+    status.lines()
+        .find(|line| line.starts_with("VmHWM:"))
+        .and_then(|line| line.split_whitespace().nth(1))
+        .and_then(|kb| kb.parse::<u64>().ok())
+        .map(|kb| kb * 1024)
+}
+
+#[cfg(test)]
+mod test {
+    use super::*;
+
+    #[test]
+    fn escapes_json_strings() {
+        assert_eq!(json_string("a \"b\"\\c\n"), "\"a \\\"b\\\"\\\\c\\u000a\"");
+    }
+
+    #[test]
+    fn compares_with_a_saved_baseline() {
+        let measurement = |seconds: f64, output_size: usize| Measurement {
+            file: "dir/\"quoted\".txt".to_string(),
+            preset: "default".to_string(),
+            threads: 1,
+            input_size: 1000,
+            output_size: output_size,
+            seconds: seconds,
+            cpu_seconds: seconds,
+            seconds_mad: 0.01,
+            cpu_seconds_mad: 0.01,
+            peak_rss: Some(1 << 20),
+            zlib9_estimate: 500,
+        };
+        let baseline = parse_json(&to_json(&[measurement(1.0, 400)])).unwrap();
+        assert_eq!(baseline[0].file, "dir/\"quoted\".txt");
+        assert_eq!(baseline[0].peak_rss, Some(1 << 20));
+
+        // Within the 3% noise and the 5% threshold
+        assert!(compare(&baseline, &measurement(1.04, 400), 0.05).regressions.is_empty());
+        assert_eq!(compare(&baseline, &measurement(1.2, 400), 0.05).regressions, vec!["time", "CPU time"]);
+        assert_eq!(compare(&baseline, &measurement(0.9, 401), 0.05).regressions, vec!["size"]);
+    }
+}
@@ -0,0 +1,112 @@
+//! Submits files to a daemon started with `zopfli --daemon=SOCKET`.
+
+extern crate zopfli;
+
+#[cfg(unix)]
+fn main() {
+    use std::env;
+    use std::fs::{self, File};
+    use std::io::{self, BufWriter};
+    use std::path::PathBuf;
+    use std::process;
+
+    use zopfli::{DaemonClient, Format, Job, JobInput};
+
+    let mut socket = None;
+    let mut to_stdout = false;
+    let mut stats = false;
+    let mut inline = false;
+    let mut numiterations = 15;
+    let mut priority = 0;
+    let mut filenames = vec![];
+    for arg in env::args().skip(1) {
+        match &arg[..] {
+            "-c" => to_stdout = true,
+            "--stats" => stats = true,
+            "--inline" => inline = true,
+            "-h" => {
+                usage();
+                return;
+            }
+            _ if arg.starts_with("--socket=") => socket = Some(arg["--socket=".len()..].to_string()),
+            _ if arg.starts_with("--i") => numiterations = number(&arg, &arg["--i".len()..]),
+            _ if arg.starts_with("--priority=") => priority = number(&arg, &arg["--priority=".len()..]),
+            _ if arg.starts_with('-') => {
+                eprintln!("unknown option {}", arg);
+                usage();
+                process::exit(1);
+            }
+            _ => filenames.push(arg),
+        }
+    }
+    let socket = socket.unwrap_or_else(|| {
+        usage();
+        process::exit(1);
+    });
+    let mut client = DaemonClient::connect(&socket)
+        .unwrap_or_else(|why| panic!("couldn't connect to {}: {}", socket, why));
+
+    for filename in filenames {
+        let input = if inline {
+            JobInput::Data(fs::read(&filename).unwrap_or_else(|why| panic!("couldn't read {}: {}", filename, why)))
+        } else {
+            // The daemon may run in another directory
+            JobInput::Path(fs::canonicalize(&filename).unwrap_or_else(|_| PathBuf::from(&filename)))
+        };
+        let job = Job {
+            input: input,
+            output_type: Format::Gzip,
+            numiterations: numiterations,
+            blocksplittingmax: 15,
+            priority: priority,
+        };
+
+        if to_stdout {
+            let stdout = io::stdout();
+            client.compress(&job, BufWriter::new(stdout.lock()))
+                .unwrap_or_else(|why| panic!("couldn't compress {}: {}", filename, why));
+            continue;
+        }
+
+        let out_filename = format!("{}.gz", filename);
+        let out_file = File::create(&out_filename)
+            .unwrap_or_else(|why| panic!("couldn't create output file {}: {}", out_filename, why));
+        client.compress(&job, BufWriter::new(out_file))
+            .unwrap_or_else(|why| {
+                let _ = fs::remove_file(&out_filename);
+                panic!("couldn't compress {} to {}: {}", filename, out_filename, why)
+            });
+    }
+
+    if stats {
+        let stats = client.stats().unwrap_or_else(|why| panic!("couldn't get statistics: {}", why));
+        eprintln!("queued: {}, running: {}, completed: {}, failed: {}", stats.queued, stats.running, stats.completed, stats.failed);
+        eprintln!("{} bytes in, {} bytes out, {:.0} bytes/s over {:.1}s", stats.bytes_in, stats.bytes_out, stats.bytes_in as f64 / stats.seconds, stats.seconds);
+    }
+}
+
+#[cfg(unix)]
+fn number(arg: &str, value: &str) -> i32 {
+    value.parse().unwrap_or_else(|_| {
+        eprintln!("invalid number in {}", arg);
+        std::process::exit(1);
+    })
+}
+
+#[cfg(unix)]
+fn usage() {
+    eprintln!("Usage: zopfli-client --socket=SOCKET [OPTION]... FILE...");
+    eprintln!("Has the daemon on SOCKET compress each FILE to FILE.gz.");
+    eprintln!("  -c             write the results to standard output instead of to files");
+    eprintln!("  --inline       send the contents of each FILE instead of its path");
+    eprintln!("  --iN           squeeze N iterations instead of 15");
+    eprintln!("  --priority=N   run before jobs of a lower priority");
+    eprintln!("  --stats        print the daemon's queue and throughput counters");
+    eprintln!("  -h             show this help");
+}
+
+#[cfg(not(unix))]
+fn main() {
+    eprintln!("zopfli-client needs Unix domain sockets");
+    std::process::exit(1);
+}
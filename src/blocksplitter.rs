@@ -6,8 +6,9 @@ use Options;
 
 /// Finds minimum of function `f(i)` where `i` is of type `usize`, `f(i)` is of type
 /// `f64`, `i` is in range `start-end` (excluding `end`).
-/// Returns the index to the minimum and the minimum value.
-fn find_minimum<F>(f: F, start: usize, end: usize) -> (usize, f64)
+/// Returns the index to the minimum and the minimum value. Returns the best
+/// point found so far if the compression is cancelled.
+fn find_minimum<F>(options: &Options, f: F, start: usize, end: usize) -> (usize, f64)
     where F: Fn(usize) -> f64
 {
     if end - start < 1024 {
@@ -31,7 +32,7 @@ fn find_minimum<F>(f: F, start: usize, end: usize) -> (usize, f64)
         let mut lastbest = f64::MAX;
         let mut pos = start;
 
-        while end - start > num {
+        while end - start > num && !options.is_cancelled() {
             let mut besti = 0;
             let mut best = f64::MAX;
             let multiplier = (end - start) / (num + 1);
@@ -124,7 +125,7 @@ fn print_block_split_points(lz77: &Lz77Store, lz77splitpoints: &[usize]) {
     }
     debug_assert_eq!(splitpoints.len(), nlz77points);
 
-    println!("block split points: {} (hex: {})", splitpoints.iter().map(|&sp| format!("{}", sp)).collect::<Vec<_>>().join(" "), splitpoints.iter().map(|&sp| format!("{:x}", sp)).collect::<Vec<_>>().join(" "));
+    eprintln!("block split points: {} (hex: {})", splitpoints.iter().map(|&sp| format!("{}", sp)).collect::<Vec<_>>().join(" "), splitpoints.iter().map(|&sp| format!("{:x}", sp)).collect::<Vec<_>>().join(" "));
 }
 
 /// Does blocksplitting on LZ77 data.
@@ -142,7 +143,8 @@ pub fn blocksplit_lz77(options: &Options, lz77: &Lz77Store, maxblocks: usize, sp
 
     while maxblocks != 0 && numblocks < maxblocks {
         debug_assert!(lstart < lend);
-        let find_minimum_result = find_minimum(|i|
+        let mut span = trace_span!("find_minimum", lstart = lstart, lend = lend);
+        let find_minimum_result = find_minimum(options, |i|
             estimate_cost(lz77, lstart, i) + estimate_cost(lz77, i, lend), lstart + 1, lend
         );
         let llpos = find_minimum_result.0;
@@ -156,6 +158,7 @@ pub fn blocksplit_lz77(options: &Options, lz77: &Lz77Store, maxblocks: usize, sp
         if splitcost > origcost || llpos == lstart + 1 || llpos == lend {
             done[lstart] = 1;
         } else {
+            span.arg("split", llpos as u64);
             splitpoints.push(llpos);
             splitpoints.sort();
             numblocks += 1;
@@ -163,6 +166,7 @@ pub fn blocksplit_lz77(options: &Options, lz77: &Lz77Store, maxblocks: usize, sp
 
         // If `find_largest_splittable_block` returns `None`, no further split will
         // likely reduce compression.
+        drop(span);
         let is_finished = find_largest_splittable_block(lz77.size(), &done, splitpoints)
             .map_or(true, |(start, end)| {
                 lstart = start;
@@ -170,7 +174,7 @@ pub fn blocksplit_lz77(options: &Options, lz77: &Lz77Store, maxblocks: usize, sp
                 lend - lstart < 10
             });
 
-        if is_finished { break }
+        if is_finished || options.is_cancelled() { break }
     }
 
     if options.verbose {
@@ -197,8 +201,10 @@ pub fn blocksplit(options: &Options, in_data: &[u8], instart: usize, inend: usiz
     /* Unintuitively, Using a simple LZ77 method here instead of lz77_optimal
     results in better blocks. */
     {
+        let mut span = trace_span!("blocksplit_greedy", instart = instart, inend = inend);
         let mut state = ZopfliBlockState::new_without_cache(options, instart, inend);
         store.greedy(&mut state, in_data, instart, inend);
+        span.arg("symbols", store.size() as u64);
     }
 
     let mut lz77splitpoints = Vec::with_capacity(maxblocks);
@@ -1,7 +1,7 @@
 use std::cmp;
 
 use lz77::LongestMatch;
-use util::{ZOPFLI_CACHE_LENGTH, ZOPFLI_MAX_MATCH, ZOPFLI_MIN_MATCH};
+use util::{ZOPFLI_MAX_MATCH, ZOPFLI_MIN_MATCH};
 
 // Cache used by ZopfliFindLongestMatch to remember previously found length/dist
 // values.
@@ -13,17 +13,21 @@ pub struct ZopfliLongestMatchCache {
     length: Vec<u16>,
     dist: Vec<u16>,
     sublen: Vec<u8>,
+    /* Entries of sublen per position. */
+    cache_length: usize,
 }
 
 impl ZopfliLongestMatchCache {
-    pub fn new(blocksize: usize) -> ZopfliLongestMatchCache {
+    pub fn new(blocksize: usize, cache_length: usize) -> ZopfliLongestMatchCache {
+        let cache_length = cache_length.max(1).min(256);
         ZopfliLongestMatchCache {
             /* length > 0 and dist 0 is invalid combination, which indicates on purpose
             that this cache value is not filled in yet. */
             length: vec![1; blocksize],
             dist: vec![0; blocksize],
             /* Rather large amount of memory. */
-            sublen: vec![0; ZOPFLI_CACHE_LENGTH * blocksize * 3],
+            sublen: vec![0; cache_length * blocksize * 3],
+            cache_length: cache_length,
         }
     }
 
@@ -45,11 +49,11 @@ impl ZopfliLongestMatchCache {
 
     /// Returns the length up to which could be stored in the cache.
     fn max_sublen(&self, pos: usize) -> u32 {
-        let start = ZOPFLI_CACHE_LENGTH * pos * 3;
+        let start = self.cache_length * pos * 3;
         if self.sublen[start + 1] == 0 && self.sublen[start + 2] == 0 {
             return 0;  // No sublen cached.
         }
-        self.sublen[start + ((ZOPFLI_CACHE_LENGTH - 1) * 3)] as u32 + 3
+        self.sublen[start + ((self.cache_length - 1) * 3)] as u32 + 3
     }
 
     /// Stores sublen array in the cache.
@@ -58,7 +62,7 @@ impl ZopfliLongestMatchCache {
             return;
         }
 
-        let start = ZOPFLI_CACHE_LENGTH * pos * 3;
+        let start = self.cache_length * pos * 3;
         let mut i = 3;
         let mut j = 0;
         let mut bestlength = 0;
@@ -69,16 +73,16 @@ impl ZopfliLongestMatchCache {
                 self.sublen[start + (j * 3 + 2)] = (sublen[i] >> 8).wrapping_rem(256) as u8;
                 bestlength = i as u32;
                 j += 1;
-                if j >= ZOPFLI_CACHE_LENGTH {
+                if j >= self.cache_length {
                     break;
                 }
             }
             i += 1;
         }
 
-        if j < ZOPFLI_CACHE_LENGTH {
+        if j < self.cache_length {
             debug_assert_eq!(bestlength, length as u32);
-            self.sublen[start + ((ZOPFLI_CACHE_LENGTH - 1) * 3)] = (bestlength - 3) as u8;
+            self.sublen[start + ((self.cache_length - 1) * 3)] = (bestlength - 3) as u8;
         } else {
             debug_assert!(bestlength <= length as u32);
         }
@@ -91,11 +95,11 @@ impl ZopfliLongestMatchCache {
             return;
         }
 
-        let start = ZOPFLI_CACHE_LENGTH * pos * 3;
+        let start = self.cache_length * pos * 3;
         let maxlength = self.max_sublen(pos) as usize;
         let mut prevlength = 0;
 
-        for j in 0..ZOPFLI_CACHE_LENGTH {
+        for j in 0..self.cache_length {
             let length = self.sublen[start + (j * 3)] as usize + 3;
             let dist = self.sublen[start + (j * 3 + 1)] as u16 + 256 * self.sublen[start + (j * 3 + 2)] as u16;
 
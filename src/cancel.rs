@@ -0,0 +1,196 @@
+//! Stopping a compression that is already running, and limiting what it may
+//! use. The compressor checks for cancellation before every squeeze iteration,
+//! every round of the block split search and every master block. Memory is
+//! limited by choosing how much to compress at once, see `memory_plan`.
+
+use std::cmp;
+use std::error::Error;
+use std::fmt;
+use std::io;
+use std::sync::Arc;
+use std::sync::atomic::{AtomicBool, AtomicUsize, Ordering};
+
+use executor::parallelism;
+use util::{ZOPFLI_CACHE_LENGTH, ZOPFLI_MASTER_BLOCK_SIZE};
+use Options;
+
+/// Shared between a compression and whoever may want to stop it. Clones refer
+/// to the same token.
+#[derive(Clone, Debug, Default)]
+pub struct CancelToken {
+    cancelled: Arc<AtomicBool>,
+    iterations: Arc<AtomicUsize>,
+}
+
+impl CancelToken {
+    pub fn new() -> CancelToken {
+        CancelToken::default()
+    }
+
+    /// Makes the compressions using this token return an error soon. It can be
+    /// called from any thread.
+    pub fn cancel(&self) {
+        self.cancelled.store(true, Ordering::Relaxed);
+    }
+
+    pub fn is_cancelled(&self) -> bool {
+        self.cancelled.load(Ordering::Relaxed)
+    }
+
+    /// Squeeze iterations run so far by the compressions using this token.
+    pub fn iterations(&self) -> usize {
+        self.iterations.load(Ordering::Relaxed)
+    }
+
+    /// Counts one more squeeze iteration, unless that would make more than
+    /// `max_iterations`.
+    pub fn take_iteration(&self, max_iterations: Option<usize>) -> bool {
+        let taken = self.iterations.fetch_add(1, Ordering::Relaxed);
+        match max_iterations {
+            Some(max_iterations) if taken >= max_iterations => {
+                self.iterations.fetch_sub(1, Ordering::Relaxed);
+                false
+            },
+            _ => true,
+        }
+    }
+}
+
+/// The error inside the `io::Error` a cancelled compression returns.
+#[derive(Debug)]
+pub struct Cancelled;
+
+impl fmt::Display for Cancelled {
+    fn fmt(&self, f: &mut fmt::Formatter) -> fmt::Result {
+        f.write_str("compression cancelled")
+    }
+}
+
+impl Error for Cancelled {}
+
+pub fn cancelled_error() -> io::Error {
+    io::Error::new(io::ErrorKind::Other, Cancelled)
+}
+
+/// Whether `err` is the error of a cancelled compression. Whatever was written
+/// to the output before that is not a complete stream and should be discarded.
+pub fn is_cancelled(err: &io::Error) -> bool {
+    err.get_ref().map_or(false, |inner| inner.is::<Cancelled>())
+}
+
+/// Bytes of working memory per byte of a master block: the longest match cache,
+/// a few copies of the LZ77 data with its histograms, and the cost arrays of the
+/// squeeze.
+const MEMORY_PER_BYTE: usize = 146;
+/// Working memory of a squeeze that doesn't depend on the block size, mostly the
+/// hash chains.
+const MEMORY_FIXED: usize = 1 << 20;
+/// Master blocks aren't made smaller than this to fit a memory budget. Each one
+/// starts with new statistics, so small ones compress noticeably worse.
+const MIN_MASTER_BLOCK_SIZE: usize = 1 << 16;
+
+/// Estimates the working memory needed to compress a master block of `blocksize`
+/// bytes with a longest match cache of `cache_length`.
+pub fn working_memory(blocksize: usize, cache_length: usize) -> usize {
+    blocksize * (MEMORY_PER_BYTE - 3 * ZOPFLI_CACHE_LENGTH + 3 * cache_length) + MEMORY_FIXED
+}
+
+/// How a compression is laid out to stay within `Options::max_memory`.
+#[derive(Copy, Clone, Debug, PartialEq)]
+pub struct MemoryPlan {
+    /// Bytes of input in each master block.
+    pub master_block_size: usize,
+    /// The longest match cache length used, see `Options::cache_length`.
+    pub cache_length: usize,
+    /// Master blocks compressed at once.
+    pub concurrency: usize,
+    /// Working memory estimated for all of them together.
+    pub estimated_peak: usize,
+}
+
+/// Chooses the master block size, cache length and concurrency for compressing
+/// `insize` bytes with `options`. Without `max_memory` these are the defaults,
+/// the cache length of the options and one master block per thread of the
+/// executor. With it, what doesn't fit is given up in the order that costs the
+/// least: first concurrency, then cache length, which only cost time, and last
+/// the master block size, which costs some compression. A budget too small even
+/// for the smallest of those gets the smallest, rather than an error.
+pub fn memory_plan(options: &Options, insize: usize) -> MemoryPlan {
+    let threads = parallelism(options.executor.as_ref());
+    let mut blocksize = cmp::min(insize, ZOPFLI_MASTER_BLOCK_SIZE);
+    let mut cache_length = options.cache_length.max(1).min(256);
+    loop {
+        let needed = working_memory(blocksize, cache_length);
+        let fits = options.max_memory.map_or(threads, |max_memory| max_memory / needed);
+        if fits >= 1 || (cache_length == 1 && blocksize <= MIN_MASTER_BLOCK_SIZE) {
+            let blocks = if blocksize == 0 { 1 } else { (insize + blocksize - 1) / blocksize };
+            let concurrency = fits.max(1).min(threads).min(blocks.max(1));
+            return MemoryPlan {
+                master_block_size: blocksize,
+                cache_length: cache_length,
+                concurrency: concurrency,
+                estimated_peak: needed * concurrency,
+            };
+        }
+        if cache_length > 1 {
+            cache_length /= 2;
+        } else {
+            blocksize = cmp::max(blocksize / 2, MIN_MASTER_BLOCK_SIZE);
+        }
+    }
+}
+
+#[cfg(test)]
+mod test {
+    use super::*;
+    use {compress, Format, Options};
+
+    #[test]
+    fn cancelled_compression_returns_the_cancel_error() {
+        let data = include_bytes!("../test/data/codetriage.js");
+        let mut options = Options::default();
+        let token = CancelToken::new();
+        token.cancel();
+        options.cancel = Some(token);
+        let err = compress(&options, &Format::Gzip, data, vec![]).unwrap_err();
+        assert!(is_cancelled(&err));
+    }
+
+    #[test]
+    fn memory_budget_shrinks_the_cache_then_the_blocks() {
+        let mut options = Options::default();
+        options.executor = Some(::std::sync::Arc::new(::ThreadExecutor::with_threads(4)));
+        let full = memory_plan(&options, 3 * ZOPFLI_MASTER_BLOCK_SIZE);
+        assert_eq!((full.master_block_size, full.cache_length, full.concurrency), (ZOPFLI_MASTER_BLOCK_SIZE, ZOPFLI_CACHE_LENGTH, 3));
+
+        options.max_memory = Some(2 * working_memory(ZOPFLI_MASTER_BLOCK_SIZE, ZOPFLI_CACHE_LENGTH));
+        assert_eq!(memory_plan(&options, 3 * ZOPFLI_MASTER_BLOCK_SIZE).concurrency, 2);
+
+        options.max_memory = Some(working_memory(ZOPFLI_MASTER_BLOCK_SIZE, 1));
+        let plan = memory_plan(&options, 3 * ZOPFLI_MASTER_BLOCK_SIZE);
+        assert_eq!((plan.master_block_size, plan.cache_length, plan.concurrency), (ZOPFLI_MASTER_BLOCK_SIZE, 1, 1));
+
+        options.max_memory = Some(1 << 20);
+        let plan = memory_plan(&options, 3 * ZOPFLI_MASTER_BLOCK_SIZE);
+        assert_eq!((plan.master_block_size, plan.cache_length), (MIN_MASTER_BLOCK_SIZE, 1));
+
+        let data = include_bytes!("../test/data/codetriage.js");
+        options.numiterations = 1;
+        let mut out = vec![];
+        compress(&options, &Format::Gzip, data, &mut out).unwrap();
+        assert_eq!(&::inflate::decode(&out).unwrap().data[..], &data[..]);
+    }
+
+    #[test]
+    fn iteration_limit_gives_a_valid_stream() {
+        let data = include_bytes!("../test/data/codetriage.js");
+        let mut options = Options::default();
+        let token = CancelToken::new();
+        options.cancel = Some(token.clone());
+        options.max_iterations = Some(3);
+        let mut out = vec![];
+        compress(&options, &Format::Gzip, data, &mut out).unwrap();
+        assert_eq!(token.iterations(), 3);
+        assert_eq!(&::inflate::decode(&out).unwrap().data[..], &data[..]);
+    }
+}
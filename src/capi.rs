@@ -0,0 +1,379 @@
+//! The C interface of the shared library, declared in include/zopfli.h. Keep the
+//! two in sync, and bump ZOPFLI_ABI_VERSION there and here for any change that
+//! isn't backwards compatible.
+#![allow(non_snake_case, non_camel_case_types)]
+
+use std::io::{self, Write};
+use std::os::raw::{c_int, c_uint, c_void};
+use std::panic::{self, AssertUnwindSafe};
+use std::ptr;
+use std::slice;
+use std::sync::Arc;
+
+use executor::ThreadExecutor;
+use stream::Encoder;
+use {compress, Format, Options};
+
+pub const ZOPFLI_ABI_VERSION: c_uint = 1;
+
+pub const ZOPFLI_OK: c_int = 0;
+pub const ZOPFLI_ERROR_ARGUMENT: c_int = -1;
+pub const ZOPFLI_ERROR_WRITE: c_int = -2;
+pub const ZOPFLI_ERROR_BUFFER_TOO_SMALL: c_int = -3;
+pub const ZOPFLI_ERROR_NOMEM: c_int = -4;
+pub const ZOPFLI_ERROR_INTERNAL: c_int = -5;
+
+pub const ZOPFLI_FORMAT_GZIP: c_int = 0;
+pub const ZOPFLI_FORMAT_ZLIB: c_int = 1;
+pub const ZOPFLI_FORMAT_DEFLATE: c_int = 2;
+
+pub const ZOPFLI_PRESET_FAST: c_int = 0;
+pub const ZOPFLI_PRESET_DEFAULT: c_int = 1;
+pub const ZOPFLI_PRESET_BEST: c_int = 2;
+
+#[repr(C)]
+pub struct ZopfliOptions {
+    pub verbose: c_int,
+    pub verbose_more: c_int,
+    pub numiterations: c_int,
+    pub blocksplittingmax: c_int,
+    /* Threads to compress with. 0 or 1 compresses on the calling thread. */
+    pub numthreads: c_int,
+}
+
+#[repr(C)]
+pub struct ZopfliAllocator {
+    pub realloc: Option<unsafe extern "C" fn(opaque: *mut c_void, ptr: *mut c_void, size: usize) -> *mut c_void>,
+    pub opaque: *mut c_void,
+}
+
+pub type ZopfliWriteFunc = Option<unsafe extern "C" fn(opaque: *mut c_void, data: *const u8, size: usize) -> c_int>;
+
+pub struct ZopfliEncoder {
+    encoder: Encoder<CallbackWriter>,
+}
+
+extern "C" {
+    fn realloc(ptr: *mut c_void, size: usize) -> *mut c_void;
+}
+
+unsafe extern "C" fn libc_realloc(_opaque: *mut c_void, ptr: *mut c_void, size: usize) -> *mut c_void {
+    realloc(ptr, size)
+}
+
+/// Runs `f`, turning a panic into ZOPFLI_ERROR_INTERNAL. Unwinding into C is
+/// undefined behavior.
+fn guard<F>(f: F) -> c_int
+    where F: FnOnce() -> c_int
+{
+    panic::catch_unwind(AssertUnwindSafe(f)).unwrap_or(ZOPFLI_ERROR_INTERNAL)
+}
+
+fn format(output_type: c_int) -> Option<Format> {
+    match output_type {
+        ZOPFLI_FORMAT_GZIP => Some(Format::Gzip),
+        ZOPFLI_FORMAT_ZLIB => Some(Format::Zlib),
+        ZOPFLI_FORMAT_DEFLATE => Some(Format::Deflate),
+        _ => None,
+    }
+}
+
+/// The options for `options`, the defaults if it is NULL, or None if a number
+/// is out of range.
+unsafe fn rust_options(options: *const ZopfliOptions) -> Option<Options> {
+    let mut result = Options::default();
+    if let Some(options) = options.as_ref() {
+        if options.numiterations < 0 || options.blocksplittingmax < 0 {
+            return None;
+        }
+        result.verbose = options.verbose != 0;
+        result.verbose_more = options.verbose_more != 0;
+        result.numiterations = options.numiterations;
+        result.blocksplittingmax = options.blocksplittingmax;
+        if options.numthreads > 1 {
+            result.executor = Some(Arc::new(ThreadExecutor::with_threads(options.numthreads as usize)));
+        }
+    }
+    Some(result)
+}
+
+unsafe fn input<'a>(data: *const u8, size: usize) -> Option<&'a [u8]> {
+    if size == 0 {
+        Some(&[])
+    } else if data.is_null() {
+        None
+    } else {
+        Some(slice::from_raw_parts(data, size))
+    }
+}
+
+fn error_code(err: &io::Error) -> c_int {
+    match err.kind() {
+        io::ErrorKind::WriteZero => ZOPFLI_ERROR_BUFFER_TOO_SMALL,
+        io::ErrorKind::OutOfMemory => ZOPFLI_ERROR_NOMEM,
+        _ => ZOPFLI_ERROR_WRITE,
+    }
+}
+
+#[no_mangle]
+pub extern "C" fn ZopfliAbiVersion() -> c_uint {
+    ZOPFLI_ABI_VERSION
+}
+
+#[no_mangle]
+pub unsafe extern "C" fn ZopfliInitOptions(options: *mut ZopfliOptions) {
+    ZopfliPresetOptions(options, ZOPFLI_PRESET_DEFAULT);
+}
+
+/// Returns ZOPFLI_ERROR_ARGUMENT, leaving the options alone, for an unknown
+/// preset.
+#[no_mangle]
+pub unsafe extern "C" fn ZopfliPresetOptions(options: *mut ZopfliOptions, preset: c_int) -> c_int {
+    let numiterations = match preset {
+        ZOPFLI_PRESET_FAST => 1,
+        ZOPFLI_PRESET_DEFAULT => Options::default().numiterations,
+        ZOPFLI_PRESET_BEST => 100,
+        _ => return ZOPFLI_ERROR_ARGUMENT,
+    };
+    let options = match options.as_mut() {
+        Some(options) => options,
+        None => return ZOPFLI_ERROR_ARGUMENT,
+    };
+    let defaults = Options::default();
+    *options = ZopfliOptions {
+        verbose: defaults.verbose as c_int,
+        verbose_more: defaults.verbose_more as c_int,
+        numiterations: numiterations,
+        blocksplittingmax: defaults.blocksplittingmax,
+        numthreads: 1,
+    };
+    ZOPFLI_OK
+}
+
+/// Appends the compressed data to `*out`, which is `*outsize` bytes long and
+/// is grown with `allocator`, or with realloc if that is NULL.
+#[no_mangle]
+pub unsafe extern "C" fn ZopfliCompressAlloc(options: *const ZopfliOptions, output_type: c_int, in_data: *const u8, insize: usize, out: *mut *mut u8, outsize: *mut usize, allocator: *const ZopfliAllocator) -> c_int {
+    guard(|| {
+        let (options, output_type, in_data) = match (rust_options(options), format(output_type), input(in_data, insize)) {
+            (Some(options), Some(output_type), Some(in_data)) if !out.is_null() && !outsize.is_null() => (options, output_type, in_data),
+            _ => return ZOPFLI_ERROR_ARGUMENT,
+        };
+        let allocator = allocator.as_ref();
+        let mut writer = AllocWriter {
+            realloc: allocator.and_then(|a| a.realloc).unwrap_or(libc_realloc),
+            opaque: allocator.map_or(ptr::null_mut(), |a| a.opaque),
+            data: *out,
+            size: *outsize,
+            capacity: *outsize,
+        };
+        let result = compress(&options, &output_type, in_data, &mut writer);
+        *out = writer.data;
+        *outsize = writer.size;
+        match result {
+            Ok(()) => ZOPFLI_OK,
+            Err(err) => error_code(&err),
+        }
+    })
+}
+
+/// Like the function of the C Zopfli: appends the compressed data to `*out`,
+/// which has to be freed with free().
+#[no_mangle]
+pub unsafe extern "C" fn ZopfliCompress(options: *const ZopfliOptions, output_type: c_int, in_data: *const u8, insize: usize, out: *mut *mut u8, outsize: *mut usize) {
+    ZopfliCompressAlloc(options, output_type, in_data, insize, out, outsize, ptr::null());
+}
+
+/// Compresses into the caller's buffer `out` of `outcapacity` bytes. Sets
+/// `*outsize` to the compressed size, also when that doesn't fit and
+/// ZOPFLI_ERROR_BUFFER_TOO_SMALL is returned.
+#[no_mangle]
+pub unsafe extern "C" fn ZopfliCompressToBuffer(options: *const ZopfliOptions, output_type: c_int, in_data: *const u8, insize: usize, out: *mut u8, outcapacity: usize, outsize: *mut usize) -> c_int {
+    guard(|| {
+        let (options, output_type, in_data) = match (rust_options(options), format(output_type), input(in_data, insize)) {
+            (Some(options), Some(output_type), Some(in_data)) if (!out.is_null() || outcapacity == 0) && !outsize.is_null() => (options, output_type, in_data),
+            _ => return ZOPFLI_ERROR_ARGUMENT,
+        };
+        let mut writer = BufferWriter {
+            out: out,
+            capacity: outcapacity,
+            size: 0,
+        };
+        let result = compress(&options, &output_type, in_data, &mut writer);
+        *outsize = writer.size;
+        match result {
+            Ok(()) if writer.size > outcapacity => ZOPFLI_ERROR_BUFFER_TOO_SMALL,
+            Ok(()) => ZOPFLI_OK,
+            Err(err) => error_code(&err),
+        }
+    })
+}
+
+/// Starts a stream that hands its output to `write` as it is produced. Returns
+/// NULL for invalid arguments.
+#[no_mangle]
+pub unsafe extern "C" fn ZopfliEncoderCreate(options: *const ZopfliOptions, output_type: c_int, write: ZopfliWriteFunc, opaque: *mut c_void) -> *mut ZopfliEncoder {
+    let (options, output_type) = match (rust_options(options), format(output_type), write) {
+        (Some(options), Some(output_type), Some(_)) => (options, output_type),
+        _ => return ptr::null_mut(),
+    };
+    let encoder = panic::catch_unwind(AssertUnwindSafe(|| {
+        Encoder::new(&options, output_type, CallbackWriter {
+            write: write,
+            opaque: opaque,
+        })
+    }));
+    match encoder {
+        Ok(Ok(encoder)) => Box::into_raw(Box::new(ZopfliEncoder { encoder: encoder })),
+        _ => ptr::null_mut(),
+    }
+}
+
+#[no_mangle]
+pub unsafe extern "C" fn ZopfliEncoderWrite(encoder: *mut ZopfliEncoder, data: *const u8, size: usize) -> c_int {
+    guard(|| {
+        match (encoder.as_mut(), input(data, size)) {
+            (Some(encoder), Some(data)) => match encoder.encoder.write_all(data) {
+                Ok(()) => ZOPFLI_OK,
+                Err(err) => error_code(&err),
+            },
+            _ => ZOPFLI_ERROR_ARGUMENT,
+        }
+    })
+}
+
+/// Ends the stream and frees the encoder, also when that fails.
+#[no_mangle]
+pub unsafe extern "C" fn ZopfliEncoderFinish(encoder: *mut ZopfliEncoder) -> c_int {
+    if encoder.is_null() {
+        return ZOPFLI_ERROR_ARGUMENT;
+    }
+    let encoder = Box::from_raw(encoder);
+    guard(move || match encoder.encoder.finish() {
+        Ok(_) => ZOPFLI_OK,
+        Err(err) => error_code(&err),
+    })
+}
+
+/// Frees the encoder without ending the stream.
+#[no_mangle]
+pub unsafe extern "C" fn ZopfliEncoderDestroy(encoder: *mut ZopfliEncoder) {
+    if !encoder.is_null() {
+        drop(Box::from_raw(encoder));
+    }
+}
+
+/// Appends to a buffer grown with the caller's allocator.
+struct AllocWriter {
+    realloc: unsafe extern "C" fn(*mut c_void, *mut c_void, usize) -> *mut c_void,
+    opaque: *mut c_void,
+    data: *mut u8,
+    size: usize,
+    capacity: usize,
+}
+
+impl Write for AllocWriter {
+    fn write(&mut self, buf: &[u8]) -> io::Result<usize> {
+        if self.size + buf.len() > self.capacity {
+            /* Double the size like ZOPFLI_APPEND_DATA does. */
+            let capacity = (self.size + buf.len()).max(self.capacity * 2).max(64);
+            let data = unsafe { (self.realloc)(self.opaque, self.data as *mut c_void, capacity) } as *mut u8;
+            if data.is_null() {
+                return Err(io::Error::new(io::ErrorKind::OutOfMemory, "allocator returned NULL"));
+            }
+            self.data = data;
+            self.capacity = capacity;
+        }
+        unsafe { ptr::copy_nonoverlapping(buf.as_ptr(), self.data.add(self.size), buf.len()) };
+        self.size += buf.len();
+        Ok(buf.len())
+    }
+
+    fn flush(&mut self) -> io::Result<()> {
+        Ok(())
+    }
+}
+
+/// Writes into the caller's buffer, and keeps counting past its end so the
+/// needed size can be reported.
+struct BufferWriter {
+    out: *mut u8,
+    capacity: usize,
+    size: usize,
+}
+
+impl Write for BufferWriter {
+    fn write(&mut self, buf: &[u8]) -> io::Result<usize> {
+        if self.size < self.capacity {
+            let n = buf.len().min(self.capacity - self.size);
+            unsafe { ptr::copy_nonoverlapping(buf.as_ptr(), self.out.add(self.size), n) };
+        }
+        self.size += buf.len();
+        Ok(buf.len())
+    }
+
+    fn flush(&mut self) -> io::Result<()> {
+        Ok(())
+    }
+}
+
+/// Hands the output to the caller's write function.
+struct CallbackWriter {
+    write: ZopfliWriteFunc,
+    opaque: *mut c_void,
+}
+
+impl Write for CallbackWriter {
+    fn write(&mut self, buf: &[u8]) -> io::Result<usize> {
+        let write = self.write.expect("checked when the encoder was created");
+        if unsafe { write(self.opaque, buf.as_ptr(), buf.len()) } != 0 {
+            return Err(io::Error::new(io::ErrorKind::Other, "write function failed"));
+        }
+        Ok(buf.len())
+    }
+
+    fn flush(&mut self) -> io::Result<()> {
+        Ok(())
+    }
+}
+
+#[cfg(test)]
+mod test {
+    use super::*;
+
+    unsafe extern "C" fn append(opaque: *mut c_void, data: *const u8, size: usize) -> c_int {
+        let out = &mut *(opaque as *mut Vec<u8>);
+        out.extend_from_slice(slice::from_raw_parts(data, size));
+        0
+    }
+
+    #[test]
+    fn buffer_and_stream_give_the_same_output() {
+        let data = include_bytes!("../test/data/30-min.csv");
+        unsafe {
+            let mut options = ZopfliOptions { verbose: 0, verbose_more: 0, numiterations: 0, blocksplittingmax: 0, numthreads: 0 };
+            ZopfliPresetOptions(&mut options, ZOPFLI_PRESET_FAST);
+
+            let mut needed = 0;
+            assert_eq!(ZopfliCompressToBuffer(&options, ZOPFLI_FORMAT_GZIP, data.as_ptr(), data.len(), ptr::null_mut(), 0, &mut needed), ZOPFLI_ERROR_BUFFER_TOO_SMALL);
+            let mut buffer = vec![0; needed];
+            let mut size = 0;
+            assert_eq!(ZopfliCompressToBuffer(&options, ZOPFLI_FORMAT_GZIP, data.as_ptr(), data.len(), buffer.as_mut_ptr(), buffer.len(), &mut size), ZOPFLI_OK);
+            assert_eq!(size, needed);
+
+            let mut streamed: Vec<u8> = vec![];
+            let opaque: *mut Vec<u8> = &mut streamed;
+            let encoder = ZopfliEncoderCreate(&options, ZOPFLI_FORMAT_GZIP, Some(append), opaque as *mut c_void);
+            assert!(!encoder.is_null());
+            for chunk in data.chunks(100) {
+                assert_eq!(ZopfliEncoderWrite(encoder, chunk.as_ptr(), chunk.len()), ZOPFLI_OK);
+            }
+            assert_eq!(ZopfliEncoderFinish(encoder), ZOPFLI_OK);
+            assert_eq!(streamed, buffer);
+
+            options.blocksplittingmax = -1;
+            assert_eq!(ZopfliCompressToBuffer(&options, ZOPFLI_FORMAT_GZIP, data.as_ptr(), data.len(), buffer.as_mut_ptr(), buffer.len(), &mut size), ZOPFLI_ERROR_ARGUMENT);
+            assert!(ZopfliEncoderCreate(&options, ZOPFLI_FORMAT_GZIP, Some(append), opaque as *mut c_void).is_null());
+        }
+    }
+}
@@ -0,0 +1,440 @@
+//! Compression to a file that keeps the state of the compressor at the
+//! boundaries between master blocks, so that later runs can reuse the output up
+//! to one of them. Master blocks are compressed on their own with the window
+//! before them, so the output up to a boundary only depends on the input up to
+//! there, and continuing from it gives the same output as `compress`.
+//!
+//! A boundary holds how far the input got with a hash of it up to there, how
+//! much of the output is complete with a hash of that, the bits of the byte
+//! that isn't, and the running checksums. The output is synced before a
+//! boundary is written, and a boundary is only used when the input and output
+//! up to it are unchanged.
+
+use std::cmp;
+use std::fs::{self, File, OpenOptions};
+use std::io::{self, BufWriter, Read, Seek, SeekFrom, Write};
+use std::path::Path;
+
+use adler32::RollingAdler32;
+use cancel::memory_plan;
+use crc::{crc32, Hasher32};
+
+use deflate::{deflate_part, BitwiseWriter, BlockType};
+use gzip::{gzip_header, gzip_trailer};
+use sha256::Sha256;
+use util::ZOPFLI_MASTER_BLOCK_SIZE;
+use zlib::{zlib_header, zlib_trailer};
+use {resolve_options, CacheKey, Format, Options};
+
+/// Compresses `in_data` to `out_path` like `compress`, keeping a checkpoint in
+/// `checkpoint_path` while it runs: the last boundary reached. If there is a
+/// checkpoint of an earlier run that was interrupted, it continues from there.
+/// Otherwise it starts over. The checkpoint is removed when the output is
+/// complete.
+pub fn compress_resumable<P, Q>(options: &Options, output_type: Format, in_data: &[u8], out_path: P, checkpoint_path: Q) -> io::Result<()>
+    where P: AsRef<Path>,
+          Q: AsRef<Path>
+{
+    let checkpoint_path = checkpoint_path.as_ref();
+    try!(compress_from_boundary(options, output_type, in_data, out_path.as_ref(), checkpoint_path, false));
+    match fs::remove_file(checkpoint_path) {
+        Err(ref err) if err.kind() != io::ErrorKind::NotFound => Err(io::Error::new(err.kind(), format!("couldn't remove checkpoint: {}", err))),
+        _ => Ok(()),
+    }
+}
+
+/// Compresses `in_data` to `out_path` like `compress`, keeping every boundary in
+/// `index_path`. When `out_path` and the index are those of an earlier version
+/// of the input that `in_data` appends to, only the master blocks from the
+/// last unchanged boundary on are compressed again, starting with the one that
+/// was final before. Returns how many bytes of input were reused. Under
+/// `max_memory`, the master blocks are those of input longer than one, so that
+/// appending doesn't change them, and the output of input shorter than that
+/// can differ from that of `compress`.
+pub fn compress_incremental<P, Q>(options: &Options, output_type: Format, in_data: &[u8], out_path: P, index_path: Q) -> io::Result<usize>
+    where P: AsRef<Path>,
+          Q: AsRef<Path>
+{
+    compress_from_boundary(options, output_type, in_data, out_path.as_ref(), index_path.as_ref(), true)
+}
+
+/// Compresses from the last usable boundary in `path`, or from the start, and
+/// writes the boundaries reached to it: all of them if `keep_all`, otherwise
+/// just the last one. Returns where it started.
+fn compress_from_boundary(options: &Options, output_type: Format, in_data: &[u8], out_path: &Path, path: &Path, keep_all: bool) -> io::Result<usize> {
+    let mut options = resolve_options(options, in_data);
+    /* Under max_memory, the master blocks of input shorter than one depend on
+    its size. Incremental runs plan them as for longer input, so they don't
+    change as the input grows and the boundaries stay usable. */
+    let plan = memory_plan(&options, if keep_all { cmp::max(in_data.len(), ZOPFLI_MASTER_BLOCK_SIZE + 1) } else { in_data.len() });
+    let fingerprint = fingerprint(&options, &output_type, plan.master_block_size);
+    options.cache_length = plan.cache_length;
+    let start_iterations = options.cancel.as_ref().map_or(0, |cancel| cancel.iterations());
+
+    let resumed = match resume(path, &fingerprint, in_data, out_path) {
+        Ok(resumed) => resumed,
+        Err(why) => {
+            if options.verbose {
+                eprintln!("not continuing from {}: {}", path.display(), why);
+            }
+            None
+        }
+    };
+    let (mut boundaries, mut state, mut bitwise_writer) = match resumed {
+        Some((boundaries, state, output)) => {
+            let (bit, bp) = {
+                let last = boundaries.last().unwrap();
+                (last.bit, last.bp)
+            };
+            if let Some(ref cancel) = options.cancel {
+                for _ in 0..state.iterations {
+                    cancel.take_iteration(None);
+                }
+            }
+            (boundaries, state, BitwiseWriter::with_partial_bits(output, bit, bp))
+        }
+        None => {
+            let mut output = Output {
+                file: BufWriter::new(try!(File::create(out_path))),
+                len: 0,
+                sha: Sha256::new(),
+            };
+            match output_type {
+                Format::Gzip => try!(gzip_header(&mut output)),
+                Format::Zlib => try!(zlib_header(&mut output)),
+                Format::Deflate => {},
+            }
+            let state = State {
+                position: 0,
+                input_sha: Sha256::new(),
+                crc: 0,
+                adler: RollingAdler32::new(),
+                iterations: 0,
+            };
+            (vec![], state, BitwiseWriter::new(output))
+        }
+    };
+    let reused = state.position;
+    if keep_all {
+        /* The boundaries after it were of other input or output. */
+        try!(save(path, &fingerprint, &boundaries));
+    }
+
+    let mut crc = crc32::Digest::new_with_initial(crc32::IEEE, state.crc);
+    while state.position < in_data.len() {
+        try!(options.check_cancelled());
+        let (instart, inend) = (state.position, cmp::min(state.position + plan.master_block_size, in_data.len()));
+        try!(deflate_part(&options, BlockType::Dynamic, inend == in_data.len(), in_data, instart, inend, None, &mut bitwise_writer));
+        crc.write(&in_data[instart..inend]);
+        state.adler.update_buffer(&in_data[instart..inend]);
+        state.input_sha.update(&in_data[instart..inend]);
+        state.position = inend;
+
+        if inend < in_data.len() {
+            state.crc = crc.sum32();
+            state.iterations = options.cancel.as_ref().map_or(0, |cancel| cancel.iterations() - start_iterations);
+            let (bit, bp) = bitwise_writer.partial_bits();
+            let output = bitwise_writer.get_mut();
+            try!(output.file.flush());
+            try!(output.file.get_ref().sync_data());
+            if !keep_all {
+                boundaries.clear();
+            }
+            boundaries.push(Boundary {
+                position: state.position,
+                input_sha: hex(state.input_sha.clone().finish()),
+                output: output.len,
+                output_sha: hex(output.sha.clone().finish()),
+                bit: bit,
+                bp: bp,
+                crc: state.crc,
+                adler: state.adler.hash(),
+                iterations: state.iterations,
+            });
+            try!(save(path, &fingerprint, &boundaries));
+        }
+    }
+    try!(bitwise_writer.finish_partial_bits());
+
+    let mut output = bitwise_writer.into_inner();
+    match output_type {
+        Format::Gzip => try!(gzip_trailer(crc.sum32(), in_data.len() as u32, &mut output)),
+        Format::Zlib => try!(zlib_trailer(state.adler.hash(), &mut output)),
+        Format::Deflate => {},
+    }
+    try!(output.file.flush());
+    /* The earlier output may have been longer. */
+    let len = output.len;
+    try!(output.file.get_ref().set_len(len));
+    Ok(reused)
+}
+
+/// How far a compression got.
+struct State {
+    position: usize,
+    /* Of the input up to position. */
+    input_sha: Sha256,
+    crc: u32,
+    adler: RollingAdler32,
+    /* Squeeze iterations counted on the cancel token. */
+    iterations: usize,
+}
+
+/// The state at the end of a master block that isn't the last one.
+struct Boundary {
+    position: usize,
+    input_sha: String,
+    /* Bytes of complete output, and their hash. */
+    output: u64,
+    output_sha: String,
+    bit: u8,
+    bp: u8,
+    crc: u32,
+    adler: u32,
+    iterations: usize,
+}
+
+impl Boundary {
+    /// Reads a boundary line written by `save`.
+    fn parse(words: &[&str]) -> Option<Boundary> {
+        if words.len() != 10 || words[0] != "boundary" {
+            return None;
+        }
+        let number = |i: usize| words[i].parse::<u64>().ok();
+        match (number(1), number(3), number(5), number(6), number(7), number(8), number(9)) {
+            (Some(position), Some(output), Some(bit), Some(bp), Some(crc), Some(adler), Some(iterations))
+                if bit < 256 && bp < 8 && crc <= u32::max_value() as u64 && adler <= u32::max_value() as u64 => Some(Boundary {
+                position: position as usize,
+                input_sha: words[2].to_string(),
+                output: output,
+                output_sha: words[4].to_string(),
+                bit: bit as u8,
+                bp: bp as u8,
+                crc: crc as u32,
+                adler: adler as u32,
+                iterations: iterations as usize,
+            }),
+            _ => None,
+        }
+    }
+}
+
+/// The output file, with how much was written to it and a hash of that.
+struct Output {
+    file: BufWriter<File>,
+    len: u64,
+    sha: Sha256,
+}
+
+impl Write for Output {
+    fn write(&mut self, buf: &[u8]) -> io::Result<usize> {
+        let size = try!(self.file.write(buf));
+        self.sha.update(&buf[..size]);
+        self.len += size as u64;
+        Ok(size)
+    }
+
+    fn flush(&mut self) -> io::Result<()> {
+        self.file.flush()
+    }
+}
+
+/// What the output up to a boundary depends on besides the input: the options,
+/// the format, and where the master blocks end, which `max_memory` can change.
+fn fingerprint(options: &Options, output_type: &Format, master_block_size: usize) -> String {
+    format!("{}-{}", CacheKey::new(options, output_type, &[]), master_block_size)
+}
+
+/// Replaces the boundaries at `path` at once, so there always is a whole file.
+
+fn save(path: &Path, fingerprint: &str, boundaries: &[Boundary]) -> io::Result<()> {
+    let mut text = format!("zopfli-checkpoint 1\noptions {}\n", fingerprint);
+    for b in boundaries {
+        text.push_str(&format!("boundary {} {} {} {} {} {} {} {} {}\n",
+                               b.position, b.input_sha, b.output, b.output_sha, b.bit, b.bp, b.crc, b.adler, b.iterations));
+    }
+    let mut temp_path = path.as_os_str().to_owned();
+    temp_path.push(".tmp");
+    let mut temp = try!(File::create(&temp_path));
+    try!(temp.write_all(text.as_bytes()));
+    try!(temp.sync_data());
+    fs::rename(&temp_path, path)
+}
+
+/// Reads the boundaries at `path`, checks that they belong to these options,
+/// and finds the last one up to which `in_data` and the output are still what
+/// they were. Returns the boundaries up to that one and the state there, with
+/// the output opened to continue after it, or None if there is none.
+fn resume(path: &Path, fingerprint: &str, in_data: &[u8], out_path: &Path) -> io::Result<Option<(Vec<Boundary>, State, Output)>> {
+    let text = match fs::read_to_string(path) {
+        Ok(text) => text,
+        Err(ref err) if err.kind() == io::ErrorKind::NotFound => return Ok(None),
+        Err(err) => return Err(err),
+    };
+    let mut lines = text.lines().map(|line| line.split_whitespace().collect::<Vec<_>>());
+    if lines.next() != Some(vec!["zopfli-checkpoint", "1"]) {
+        return Err(invalid("not a checkpoint"));
+    }
+    if lines.next() != Some(vec!["options", fingerprint]) {
+        return Err(invalid("the options changed"));
+    }
+    let mut boundaries = vec![];
+    for words in lines {
+        match Boundary::parse(&words) {
+            Some(boundary) => boundaries.push(boundary),
+            None => return Err(invalid("invalid boundary")),
+        }
+    }
+    boundaries.sort_by_key(|boundary| boundary.position);
+
+    let mut file = match OpenOptions::new().read(true).write(true).open(out_path) {
+        Ok(file) => file,
+        Err(ref err) if err.kind() == io::ErrorKind::NotFound => return Ok(None),
+        Err(err) => return Err(err),
+    };
+    let (mut input_sha, mut output_sha) = (Sha256::new(), Sha256::new());
+    let (mut hashed_input, mut hashed_output) = (0, 0);
+    let mut buf = vec![0; 65536];
+    let mut usable = None;
+    for (i, boundary) in boundaries.iter().enumerate() {
+        if boundary.position >= in_data.len() || boundary.output < hashed_output {
+            break;
+        }
+        input_sha.update(&in_data[hashed_input..boundary.position]);
+        hashed_input = boundary.position;
+        if hex(input_sha.clone().finish()) != boundary.input_sha {
+            break;
+        }
+        while hashed_output < boundary.output {
+            let len = cmp::min(boundary.output - hashed_output, buf.len() as u64) as usize;
+            let size = try!((&file).read(&mut buf[..len]));
+            if size == 0 {
+                break;
+            }
+            output_sha.update(&buf[..size]);
+            hashed_output += size as u64;
+        }
+        if hashed_output < boundary.output || hex(output_sha.clone().finish()) != boundary.output_sha {
+            break;
+        }
+        usable = Some((i, input_sha.clone(), output_sha.clone()));
+    }
+    let (last, input_sha, output_sha) = match usable {
+        Some(usable) => usable,
+        None => return Ok(None),
+    };
+    boundaries.truncate(last + 1);
+
+    let state = {
+        let boundary = &boundaries[last];
+        /* Anything after it was written after the boundary. */
+        try!(file.set_len(boundary.output));
+        try!(file.seek(SeekFrom::Start(boundary.output)));
+        State {
+            position: boundary.position,
+            input_sha: input_sha,
+            crc: boundary.crc,
+            adler: RollingAdler32::from_value(boundary.adler),
+            iterations: boundary.iterations,
+        }
+    };
+    let output = Output {
+        file: BufWriter::new(file),
+        len: boundaries[last].output,
+        sha: output_sha,
+    };
+    Ok(Some((boundaries, state, output)))
+}
+
+fn hex(hash: [u8; 32]) -> String {
+    hash.iter().map(|byte| format!("{:02x}", byte)).collect()
+}
+
+fn invalid(msg: &str) -> io::Error {
+    io::Error::new(io::ErrorKind::InvalidData, msg)
+}
+
+#[cfg(test)]
+mod test {
+    use std::env;
+    use std::fs;
+    use std::process;
+
+    use super::*;
+    use {compress, CancelToken};
+
+    fn input(size: usize) -> Vec<u8> {
+        let js = include_bytes!("../test/data/codetriage.js");
+        js.iter().cycle().take(size).cloned().collect()
+    }
+
+    #[test]
+    fn resumes_after_being_interrupted() {
+        let in_data = input(2 * ZOPFLI_MASTER_BLOCK_SIZE + 12345);
+        let dir = env::temp_dir().join(format!("zopfli-checkpoint-{}", process::id()));
+        fs::create_dir_all(&dir).unwrap();
+        let (out_path, checkpoint_path) = (dir.join("out.gz"), dir.join("out.gz.checkpoint"));
+        let mut options = Options::default();
+        options.numiterations = 1;
+
+        let mut expected = vec![];
+        compress(&options, &Format::Gzip, &in_data, &mut expected).unwrap();
+
+        /* Cancelled as soon as the first checkpoint is there. */
+        let mut interrupted = options.clone();
+        let cancel = CancelToken::new();
+        interrupted.cancel = Some(cancel.clone());
+        let watched = checkpoint_path.clone();
+        let watcher = ::std::thread::spawn(move || {
+            while !watched.exists() {
+                ::std::thread::yield_now();
+            }
+            cancel.cancel();
+        });
+        assert!(compress_resumable(&interrupted, Format::Gzip, &in_data, &out_path, &checkpoint_path).is_err());
+        watcher.join().unwrap();
+        let fingerprint = fingerprint(&resolve_options(&options, &in_data), &Format::Gzip, ZOPFLI_MASTER_BLOCK_SIZE);
+        let resumed = resume(&checkpoint_path, &fingerprint, &in_data, &out_path).unwrap();
+        assert_eq!(resumed.map(|(_, state, _)| state.position), Some(ZOPFLI_MASTER_BLOCK_SIZE));
+
+        compress_resumable(&options, Format::Gzip, &in_data, &out_path, &checkpoint_path).unwrap();
+        assert_eq!(fs::read(&out_path).unwrap(), expected);
+        assert!(!checkpoint_path.exists());
+        fs::remove_dir_all(&dir).unwrap();
+    }
+
+    #[test]
+    fn recompresses_only_what_changed() {
+        let dir = env::temp_dir().join(format!("zopfli-incremental-{}", process::id()));
+        fs::create_dir_all(&dir).unwrap();
+        let (out_path, index_path) = (dir.join("out.zlib"), dir.join("out.zlib.index"));
+        let mut options = Options::default();
+        options.numiterations = 1;
+
+        let mut in_data = input(2 * ZOPFLI_MASTER_BLOCK_SIZE + 12345);
+        assert_eq!(compress_incremental(&options, Format::Zlib, &in_data, &out_path, &index_path).unwrap(), 0);
+
+        /* Appended to, the last block is compressed again as one that isn't final. */
+        in_data.extend_from_slice(&input(ZOPFLI_MASTER_BLOCK_SIZE / 2));
+        assert_eq!(compress_incremental(&options, Format::Zlib, &in_data, &out_path, &index_path).unwrap(), 2 * ZOPFLI_MASTER_BLOCK_SIZE);
+        let mut expected = vec![];
+        compress(&options, &Format::Zlib, &in_data, &mut expected).unwrap();
+        assert_eq!(fs::read(&out_path).unwrap(), expected);
+
+        /* Changed in the second block. */
+        in_data[ZOPFLI_MASTER_BLOCK_SIZE + 10] ^= 1;
+        assert_eq!(compress_incremental(&options, Format::Zlib, &in_data, &out_path, &index_path).unwrap(), ZOPFLI_MASTER_BLOCK_SIZE);
+        let mut expected = vec![];
+        compress(&options, &Format::Zlib, &in_data, &mut expected).unwrap();
+        assert_eq!(fs::read(&out_path).unwrap(), expected);
+
+        /* Under a memory budget, short input that grows keeps its blocks too. */
+        options.max_memory = Some(::cancel::working_memory(200000, 1));
+        let mut in_data = input(300000);
+        assert_eq!(compress_incremental(&options, Format::Zlib, &in_data, &out_path, &index_path).unwrap(), 0);
+        in_data.extend_from_slice(&input(100000));
+        assert!(compress_incremental(&options, Format::Zlib, &in_data, &out_path, &index_path).unwrap() > 0);
+        assert_eq!(&::inflate::decode(&fs::read(&out_path).unwrap()).unwrap().data[..], &in_data[..]);
+        fs::remove_dir_all(&dir).unwrap();
+    }
+}
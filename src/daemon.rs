@@ -0,0 +1,526 @@
+//! A compression server on a Unix domain socket, to compress many files without
+//! starting a process for each. Jobs from all connections go into one queue,
+//! highest priority first, and are run by a fixed pool of threads that live as
+//! long as the daemon, so their allocations stay warm. Each connection has one
+//! job at a time, whose output is streamed back while it is compressed.
+//!
+//! The protocol is a line per request or response, followed by the bytes it
+//! announces:
+//!
+//! - `compress <format> <numiterations> <blocksplittingmax> <priority> path <len>`
+//!   and a path of `len` bytes, or `... data <len>` and `len` bytes of input.
+//!   Answered by any number of `data <len>` and `len` bytes of output, then
+//!   `done <input size> <output size>` or `error <message>`. A request whose
+//!   length can't be read, or is over the limit, is answered with an error and
+//!   the connection is closed, as the bytes after it can't be told apart.
+//! - `stats`, answered by `stats <queued> <running> <completed> <failed>
+//!   <bytes in> <bytes out> <seconds up>`.
+
+use std::cmp::Ordering;
+use std::collections::BinaryHeap;
+use std::fs;
+use std::io::{self, BufRead, BufReader, Read, Write};
+use std::os::unix::net::{UnixListener, UnixStream};
+use std::panic::{self, AssertUnwindSafe};
+use std::path::{Path, PathBuf};
+use std::sync::{Arc, Condvar, Mutex};
+use std::sync::atomic::{AtomicUsize, Ordering as AtomicOrdering};
+use std::sync::mpsc;
+use std::thread;
+use std::time::Instant;
+
+use {compress, Format, Options};
+
+/// Output is sent back in pieces of at most this many bytes.
+const FRAME_SIZE: usize = 64 * 1024;
+/// Largest path or input of a request, unless changed with `set_max_payload`.
+pub const DEFAULT_MAX_PAYLOAD: usize = 256 * 1024 * 1024;
+
+pub enum JobInput {
+    /* A file the daemon reads itself. */
+    Path(PathBuf),
+    Data(Vec<u8>),
+}
+
+pub struct Job {
+    pub input: JobInput,
+    pub output_type: Format,
+    pub numiterations: i32,
+    pub blocksplittingmax: i32,
+    /* Higher runs first. */
+    pub priority: i32,
+}
+
+#[derive(Copy, Clone, Debug, Default, PartialEq)]
+pub struct DaemonStats {
+    /* Jobs waiting for a thread. */
+    pub queued: usize,
+    pub running: usize,
+    pub completed: usize,
+    pub failed: usize,
+    pub bytes_in: u64,
+    pub bytes_out: u64,
+    pub seconds: f64,
+}
+
+struct Queued {
+    priority: i32,
+    /* Jobs of the same priority run in the order they came in. */
+    seq: u64,
+    task: Box<dyn FnOnce() + Send>,
+}
+
+impl PartialEq for Queued {
+    fn eq(&self, other: &Queued) -> bool {
+        self.cmp(other) == Ordering::Equal
+    }
+}
+
+impl Eq for Queued {}
+
+impl PartialOrd for Queued {
+    fn partial_cmp(&self, other: &Queued) -> Option<Ordering> {
+        Some(self.cmp(other))
+    }
+}
+
+impl Ord for Queued {
+    fn cmp(&self, other: &Queued) -> Ordering {
+        self.priority.cmp(&other.priority).then(other.seq.cmp(&self.seq))
+    }
+}
+
+struct Shared {
+    options: Options,
+    queue: Mutex<(BinaryHeap<Queued>, u64)>,
+    available: Condvar,
+    stats: Mutex<DaemonStats>,
+    started: Instant,
+    max_payload: AtomicUsize,
+}
+
+/// Counts a job as running for as long as it lives.
+struct Running<'a>(&'a Mutex<DaemonStats>);
+
+impl<'a> Running<'a> {
+    fn new(stats: &'a Mutex<DaemonStats>) -> Running<'a> {
+        stats.lock().unwrap().running += 1;
+        Running(stats)
+    }
+}
+
+impl<'a> Drop for Running<'a> {
+    fn drop(&mut self) {
+        self.0.lock().unwrap().running -= 1;
+    }
+}
+
+pub struct Daemon {
+    listener: UnixListener,
+    shared: Arc<Shared>,
+}
+
+impl Daemon {
+    /// Listens on `path`, replacing a socket that is left there, and starts
+    /// `threads` threads that compress with `options`. The format and numbers in
+    /// jobs override those of `options`.
+    pub fn bind<P: AsRef<Path>>(path: P, options: &Options, threads: usize) -> io::Result<Daemon> {
+        let path = path.as_ref();
+        if let Ok(metadata) = fs::symlink_metadata(path) {
+            use std::os::unix::fs::FileTypeExt;
+            if metadata.file_type().is_socket() {
+                try!(fs::remove_file(path));
+            }
+        }
+        let listener = try!(UnixListener::bind(path));
+        let mut options = options.clone();
+        /* The pool is the parallelism. */
+        options.executor = None;
+        let shared = Arc::new(Shared {
+            options: options,
+            queue: Mutex::new((BinaryHeap::new(), 0)),
+            available: Condvar::new(),
+            stats: Mutex::new(DaemonStats::default()),
+            started: Instant::now(),
+            max_payload: AtomicUsize::new(DEFAULT_MAX_PAYLOAD),
+        });
+        for _ in 0..threads.max(1) {
+            let shared = shared.clone();
+            thread::spawn(move || shared.work());
+        }
+        Ok(Daemon {
+            listener: listener,
+            shared: shared,
+        })
+    }
+
+    /// Accepts connections until the listener fails.
+    pub fn run(&self) -> io::Result<()> {
+        for stream in self.listener.incoming() {
+            let stream = try!(stream);
+            let shared = self.shared.clone();
+            thread::spawn(move || {
+                /* A client that goes away only ends its connection. */
+                let _ = shared.serve(stream);
+            });
+        }
+        Ok(())
+    }
+
+    pub fn stats(&self) -> DaemonStats {
+        self.shared.stats()
+    }
+
+    /// Limits the path or input a request may send to `bytes`.
+    pub fn set_max_payload(&self, bytes: usize) {
+        self.shared.max_payload.store(bytes, AtomicOrdering::Relaxed);
+    }
+}
+
+impl Shared {
+    fn work(&self) {
+        loop {
+            let queued = {
+                let mut queue = self.queue.lock().unwrap();
+                loop {
+                    if let Some(queued) = queue.0.pop() {
+                        break queued;
+                    }
+                    queue = self.available.wait(queue).unwrap();
+                }
+            };
+            (queued.task)();
+        }
+    }
+
+    fn stats(&self) -> DaemonStats {
+        let mut stats = *self.stats.lock().unwrap();
+        stats.queued = self.queue.lock().unwrap().0.len();
+        stats.seconds = self.started.elapsed().as_secs_f64();
+        stats
+    }
+
+    fn serve(self: Arc<Self>, stream: UnixStream) -> io::Result<()> {
+        let mut reader = BufReader::new(try!(stream.try_clone()));
+        let mut writer = stream;
+        let mut line = String::new();
+        loop {
+            line.clear();
+            if try!(reader.read_line(&mut line)) == 0 {
+                return Ok(());
+            }
+            let words: Vec<&str> = line.split_whitespace().collect();
+            match words.as_slice() {
+                ["stats"] => {
+                    let s = self.stats();
+                    try!(write!(writer, "stats {} {} {} {} {} {} {}\n", s.queued, s.running, s.completed, s.failed, s.bytes_in, s.bytes_out, s.seconds));
+                }
+                ["compress", ..] => {
+                    let job = match parse_job(&words, &mut reader, self.max_payload.load(AtomicOrdering::Relaxed)) {
+                        Ok(Ok(job)) => job,
+                        Ok(Err(err)) => {
+                            try!(write!(writer, "error {}\n", err));
+                            continue;
+                        }
+                        Err(err) => return write!(writer, "error {}\n", err),
+                    };
+                    try!(self.clone().run_job(job, &writer));
+                }
+                _ => try!(write!(writer, "error unknown request\n")),
+            }
+        }
+    }
+
+    /// Queues `job` and waits until it was run, its output streamed to
+    /// `stream` and its result written.
+    fn run_job(self: Arc<Self>, job: Job, stream: &UnixStream) -> io::Result<()> {
+        let stream = try!(stream.try_clone());
+        let (done_tx, done) = mpsc::channel();
+        let shared = self.clone();
+        let priority = job.priority;
+        let task: Box<dyn FnOnce() + Send> = Box::new(move || {
+            let running = Running::new(&shared.stats);
+            let mut frames = Frames {
+                stream: stream,
+                buf: Vec::with_capacity(FRAME_SIZE),
+                written: 0,
+            };
+            /* A job that panics fails on its own, the thread goes on with the
+            next one. */
+            let result = match panic::catch_unwind(AssertUnwindSafe(|| shared.compress_job(job, &mut frames))) {
+                Ok(result) => result,
+                Err(_) => Err(io::Error::new(io::ErrorKind::Other, "the compression panicked")),
+            };
+            let result = match result {
+                Ok(size) => frames.flush().map(|_| (size, frames.written)),
+                Err(err) => Err(err),
+            };
+            drop(running);
+            {
+                let mut stats = shared.stats.lock().unwrap();
+                match result {
+                    Ok((size, written)) => {
+                        stats.completed += 1;
+                        stats.bytes_in += size as u64;
+                        stats.bytes_out += written;
+                    }
+                    Err(_) => stats.failed += 1,
+                }
+            }
+            let _ = done_tx.send((result, frames.stream));
+        });
+        {
+            let mut queue = self.queue.lock().unwrap();
+            let seq = queue.1;
+            queue.1 += 1;
+            queue.0.push(Queued {
+                priority: priority,
+                seq: seq,
+                task: task,
+            });
+        }
+        self.available.notify_one();
+
+        match done.recv() {
+            Ok((Ok((size, written)), mut stream)) => write!(stream, "done {} {}\n", size, written),
+            Ok((Err(err), mut stream)) => write!(stream, "error {}\n", err.to_string().replace('\n', " ")),
+            Err(_) => Err(io::Error::new(io::ErrorKind::Other, "the job was lost")),
+        }
+    }
+
+    /// Compresses the input of `job` to `out`, returning the input size.
+    fn compress_job<W: Write>(&self, job: Job, out: W) -> io::Result<usize> {
+        let mut options = self.options.clone();
+        options.numiterations = job.numiterations;
+        options.blocksplittingmax = job.blocksplittingmax;
+        let data = match job.input {
+            JobInput::Path(path) => try!(fs::read(path)),
+            JobInput::Data(data) => data,
+        };
+        try!(compress(&options, &job.output_type, &data, out));
+        Ok(data.len())
+    }
+}
+
+/// Reads a `compress` request and its payload of at most `max_payload` bytes.
+/// The outer error is for requests that can't be framed, after which the rest
+/// of the connection can't be read. The inner one only rejects this job.
+fn parse_job<R: Read>(words: &[&str], reader: &mut R, max_payload: usize) -> io::Result<io::Result<Job>> {
+    let (format, numiterations, blocksplittingmax, priority, kind, len) = match *words {
+        ["compress", format, numiterations, blocksplittingmax, priority, kind, len] => (format, numiterations, blocksplittingmax, priority, kind, len),
+        _ => return Err(invalid("expected compress <format> <numiterations> <blocksplittingmax> <priority> <path|data> <len>")),
+    };
+    let len = try!(len.parse::<usize>().map_err(|_| invalid("invalid length")));
+    if len > max_payload {
+        return Err(invalid(&format!("the payload is over {} bytes", max_payload)));
+    }
+    /* Only allocated as it arrives. */
+    let mut payload = vec![];
+    try!(reader.take(len as u64).read_to_end(&mut payload));
+    if payload.len() < len {
+        return Err(io::Error::new(io::ErrorKind::UnexpectedEof, "the payload ended early"));
+    }
+    Ok(job(format, numiterations, blocksplittingmax, priority, kind, payload))
+}
+
+fn job(format: &str, numiterations: &str, blocksplittingmax: &str, priority: &str, kind: &str, payload: Vec<u8>) -> io::Result<Job> {
+    let input = match kind {
+        "path" => JobInput::Path(PathBuf::from(try!(String::from_utf8(payload).map_err(|_| invalid("invalid path"))))),
+        "data" => JobInput::Data(payload),
+        _ => return Err(invalid("expected path or data")),
+    };
+    Ok(Job {
+        input: input,
+        output_type: try!(parse_format(format)),
+        numiterations: try!(numiterations.parse().ok().filter(|&n: &i32| n >= 0).ok_or_else(|| invalid("invalid numiterations"))),
+        blocksplittingmax: try!(blocksplittingmax.parse().ok().filter(|&n: &i32| n >= 0).ok_or_else(|| invalid("invalid blocksplittingmax"))),
+        priority: try!(priority.parse().map_err(|_| invalid("invalid priority"))),
+    })
+}
+
+fn parse_format(name: &str) -> io::Result<Format> {
+    match name {
+        "gzip" => Ok(Format::Gzip),
+        "zlib" => Ok(Format::Zlib),
+        "deflate" => Ok(Format::Deflate),
+        _ => Err(invalid("unknown format")),
+    }
+}
+
+fn format_name(format: Format) -> &'static str {
+    match format {
+        Format::Gzip => "gzip",
+        Format::Zlib => "zlib",
+        Format::Deflate => "deflate",
+    }
+}
+
+/// Sends what is written to it as `data` responses.
+struct Frames {
+    stream: UnixStream,
+    buf: Vec<u8>,
+    written: u64,
+}
+
+impl Write for Frames {
+    fn write(&mut self, buf: &[u8]) -> io::Result<usize> {
+        let size = buf.len().min(FRAME_SIZE - self.buf.len());
+        self.buf.extend_from_slice(&buf[..size]);
+        if self.buf.len() == FRAME_SIZE {
+            try!(self.flush());
+        }
+        Ok(size)
+    }
+
+    fn flush(&mut self) -> io::Result<()> {
+        if !self.buf.is_empty() {
+            try!(write!(self.stream, "data {}\n", self.buf.len()));
+            try!(self.stream.write_all(&self.buf));
+            self.written += self.buf.len() as u64;
+            self.buf.clear();
+        }
+        Ok(())
+    }
+}
+
+/// A connection to a daemon.
+pub struct DaemonClient {
+    reader: BufReader<UnixStream>,
+    writer: UnixStream,
+}
+
+impl DaemonClient {
+    pub fn connect<P: AsRef<Path>>(path: P) -> io::Result<DaemonClient> {
+        let stream = try!(UnixStream::connect(path));
+        Ok(DaemonClient {
+            reader: BufReader::new(try!(stream.try_clone())),
+            writer: stream,
+        })
+    }
+
+    /// Has the daemon run `job`, writing the output to `out` as it arrives.
+    /// Returns the input and output sizes.
+    pub fn compress<W: Write>(&mut self, job: &Job, mut out: W) -> io::Result<(u64, u64)> {
+        let (kind, payload) = match job.input {
+            JobInput::Path(ref path) => ("path", match path.to_str() {
+                Some(path) => path.as_bytes(),
+                None => return Err(invalid("the path isn't UTF-8")),
+            }),
+            JobInput::Data(ref data) => ("data", &data[..]),
+        };
+        try!(write!(self.writer, "compress {} {} {} {} {} {}\n", format_name(job.output_type), job.numiterations, job.blocksplittingmax, job.priority, kind, payload.len()));
+        try!(self.writer.write_all(payload));
+
+        let mut line = String::new();
+        let mut buf = vec![];
+        loop {
+            line.clear();
+            try!(self.reader.read_line(&mut line));
+            let words: Vec<&str> = line.split_whitespace().collect();
+            match words.as_slice() {
+                ["data", len] => {
+                    let len = try!(len.parse::<usize>().map_err(|_| invalid("invalid response")));
+                    buf.resize(len, 0);
+                    try!(self.reader.read_exact(&mut buf));
+                    try!(out.write_all(&buf));
+                }
+                ["done", size, written] => match (size.parse(), written.parse()) {
+                    (Ok(size), Ok(written)) => return Ok((size, written)),
+                    _ => return Err(invalid("invalid response")),
+                },
+                ["error", ..] => return Err(io::Error::new(io::ErrorKind::Other, line["error".len()..].trim().to_string())),
+                _ => return Err(invalid("invalid response")),
+            }
+        }
+    }
+
+    pub fn stats(&mut self) -> io::Result<DaemonStats> {
+        try!(self.writer.write_all(b"stats\n"));
+        let mut line = String::new();
+        try!(self.reader.read_line(&mut line));
+        let words: Vec<&str> = line.split_whitespace().collect();
+        let number = |i: usize| words.get(i).and_then(|word| word.parse::<u64>().ok());
+        match (words.first(), number(1), number(2), number(3), number(4), number(5), number(6), words.get(7).and_then(|word| word.parse::<f64>().ok())) {
+            (Some(&"stats"), Some(queued), Some(running), Some(completed), Some(failed), Some(bytes_in), Some(bytes_out), Some(seconds)) => Ok(DaemonStats {
+                queued: queued as usize,
+                running: running as usize,
+                completed: completed as usize,
+                failed: failed as usize,
+                bytes_in: bytes_in,
+                bytes_out: bytes_out,
+                seconds: seconds,
+            }),
+            _ => Err(invalid("invalid response")),
+        }
+    }
+}
+
+fn invalid(msg: &str) -> io::Error {
+    io::Error::new(io::ErrorKind::InvalidData, msg)
+}
+
+#[cfg(test)]
+mod test {
+    use std::env;
+    use std::process;
+
+    use super::*;
+
+    #[test]
+    fn compresses_for_clients() {
+        let dir = env::temp_dir().join(format!("zopfli-daemon-{}", process::id()));
+        fs::create_dir_all(&dir).unwrap();
+        let socket = dir.join("socket");
+        let data = include_bytes!("../test/data/30-min.csv");
+        let daemon = Daemon::bind(&socket, &Options::default(), 2).unwrap();
+        daemon.set_max_payload(data.len());
+        thread::spawn(move || daemon.run());
+
+        fs::write(dir.join("input"), &data[..]).unwrap();
+        let mut options = Options::default();
+        options.numiterations = 2;
+        let mut expected = vec![];
+        compress(&options, &Format::Zlib, data, &mut expected).unwrap();
+
+        let mut client = DaemonClient::connect(&socket).unwrap();
+        for input in vec![JobInput::Data(data.to_vec()), JobInput::Path(dir.join("input"))] {
+            let job = Job {
+                input: input,
+                output_type: Format::Zlib,
+                numiterations: 2,
+                blocksplittingmax: 15,
+                priority: 0,
+            };
+            let mut out = vec![];
+            assert_eq!(client.compress(&job, &mut out).unwrap(), (data.len() as u64, expected.len() as u64));
+            assert_eq!(out, expected);
+        }
+
+        let missing = Job {
+            input: JobInput::Path(dir.join("missing")),
+            output_type: Format::Gzip,
+            numiterations: 1,
+            blocksplittingmax: 15,
+            priority: 0,
+        };
+        assert!(client.compress(&missing, &mut vec![]).is_err());
+        let negative = Job {
+            input: JobInput::Data(data.to_vec()),
+            output_type: Format::Gzip,
+            numiterations: 1,
+            blocksplittingmax: -1,
+            priority: 0,
+        };
+        assert!(client.compress(&negative, &mut vec![]).is_err());
+        let stats = client.stats().unwrap();
+        assert_eq!((stats.running, stats.completed, stats.failed, stats.bytes_in), (0, 2, 1, 2 * data.len() as u64));
+
+        // Too large a payload ends the connection
+        let mut too_large = negative;
+        too_large.input = JobInput::Data(vec![0; data.len() + 1]);
+        too_large.blocksplittingmax = 15;
+        assert!(client.compress(&too_large, &mut vec![]).is_err());
+        assert!(client.stats().is_err());
+        fs::remove_dir_all(&dir).unwrap();
+    }
+}
@@ -2,12 +2,14 @@ use std::cmp;
 use std::io::{self, Write};
 
 use blocksplitter::{blocksplit, blocksplit_lz77};
+use cancel::memory_plan;
+use executor::run_jobs;
 use katajainen::length_limited_code_lengths;
 use lz77::{ZopfliBlockState, Lz77Store, LitLen};
 use squeeze::{lz77_optimal_fixed, lz77_optimal};
 use symbols::{get_length_symbol, get_dist_symbol, get_length_symbol_extra_bits, get_dist_symbol_extra_bits, get_length_extra_bits_value, get_length_extra_bits, get_dist_extra_bits_value, get_dist_extra_bits};
 use tree::{lengths_to_symbols};
-use util::{ZOPFLI_NUM_LL, ZOPFLI_NUM_D, ZOPFLI_MASTER_BLOCK_SIZE};
+use util::{ZOPFLI_NUM_LL, ZOPFLI_NUM_D};
 use Options;
 use iter::IsFinalIterator;
 
@@ -24,14 +26,90 @@ use iter::IsFinalIterator;
 ///   be freed after use.
 pub fn deflate<W>(options: &Options, btype: BlockType, in_data: &[u8], out: W) -> io::Result<()>
     where W: Write
+{
+    deflate_seeded(options, btype, in_data, None, out)
+}
+
+/// Like `deflate`, but with LZ77 data for the whole input that is already known,
+/// for example decoded from an earlier compression of it. It is used as the
+/// starting point of the squeeze of each block instead of a greedy run.
+pub fn deflate_seeded<W>(options: &Options, btype: BlockType, in_data: &[u8], seed: Option<&Lz77Store>, out: W) -> io::Result<()>
+    where W: Write
+{
+    let mut bitwise_writer = BitwiseWriter::new(out);
+    let mut i = 0;
+    let insize = in_data.len();
+    if insize == 0 {
+        /* A stream needs a final block even without data. */
+        try!(add_empty_final_block(&mut bitwise_writer));
+        return bitwise_writer.finish_partial_bits();
+    }
+    let plan = memory_plan(options, insize);
+    if options.verbose && options.max_memory.is_some() {
+        eprintln!("memory plan: {:?}", plan);
+    }
+    let mut planned = options.clone();
+    planned.cache_length = plan.cache_length;
+    let options = &planned;
+    let mut parts = vec![];
+    while i < insize {
+        let size = cmp::min(plan.master_block_size, insize - i);
+        parts.push((i, i + size));
+        i += size;
+    }
+
+    /* Master blocks only depend on the input, not on each other's output, so a
+    batch of them can be split and squeezed at once and then written in order.
+    The blocks within them are then squeezed one after another. */
+    let batch = if btype == BlockType::Dynamic { plan.concurrency } else { 1 };
+    for batch in parts.chunks(batch) {
+        try!(options.check_cancelled());
+        if batch.len() == 1 {
+            let (instart, inend) = batch[0];
+            try!(deflate_part(options, btype, inend == insize, in_data, instart, inend, seed, &mut bitwise_writer));
+            continue;
+        }
+
+        let mut inner = options.clone();
+        inner.executor = None;
+        let inner = &inner;
+        let jobs = batch.iter().map(|&(instart, inend)| {
+            move || blocksplit_attempt(inner, in_data, instart, inend, seed)
+        }).collect();
+        for (attempt, &(_, inend)) in run_jobs(options.executor.as_ref(), jobs).into_iter().zip(batch) {
+            let (lz77, splitpoints) = try!(attempt);
+            try!(add_all_blocks(&splitpoints, &lz77, options, inend == insize, in_data, &mut bitwise_writer));
+        }
+    }
+    bitwise_writer.finish_partial_bits()
+}
+
+/// Like `deflate`, but writes LZ77 data that is already known for the whole input
+/// instead of searching for matches. Only the block splitting, block type choice
+/// and Huffman tree optimization are done, which is much cheaper than a squeeze.
+pub fn deflate_lz77<W>(options: &Options, in_data: &[u8], lz77: &Lz77Store, out: W) -> io::Result<()>
+    where W: Write
 {
     let mut bitwise_writer = BitwiseWriter::new(out);
     let mut i = 0;
     let insize = in_data.len();
+    if insize == 0 {
+        try!(add_empty_final_block(&mut bitwise_writer));
+    }
+    /* The master blocks are cut like in deflate, so they fit max_memory. */
+    let plan = memory_plan(options, insize);
+    let mut planned = options.clone();
+    planned.cache_length = plan.cache_length;
+    let options = &planned;
     while i < insize {
-        let final_block = i + ZOPFLI_MASTER_BLOCK_SIZE >= insize;
-        let size = if final_block { insize - i } else { ZOPFLI_MASTER_BLOCK_SIZE };
-        try!(deflate_part(options, btype, final_block, in_data, i, i + size, &mut bitwise_writer));
+        let final_block = i + plan.master_block_size >= insize;
+        let size = if final_block { insize - i } else { plan.master_block_size };
+        try!(options.check_cancelled());
+        let store = lz77.slice_bytes(in_data, i, i + size);
+
+        let mut splitpoints = Vec::with_capacity(options.blocksplittingmax as usize);
+        blocksplit_lz77(options, &store, options.blocksplittingmax as usize, &mut splitpoints);
+        try!(add_all_blocks(&splitpoints, &store, options, final_block, in_data, &mut bitwise_writer));
         i += size;
     }
     bitwise_writer.finish_partial_bits()
@@ -47,7 +125,8 @@ pub fn deflate<W>(options: &Options, btype: BlockType, in_data: &[u8], out: W) -
 /// Like deflate, but allows to specify start and end byte with instart and
 /// inend. Only that part is compressed, but earlier bytes are still used for the
 /// back window.
-fn deflate_part<W>(options: &Options, btype: BlockType, final_block: bool, in_data: &[u8], instart: usize, inend: usize, bitwise_writer: &mut BitwiseWriter<W>) -> io::Result<()>
+/// If `seed` is given, it holds LZ77 data for the whole input, see `deflate_seeded`.
+pub fn deflate_part<W>(options: &Options, btype: BlockType, final_block: bool, in_data: &[u8], instart: usize, inend: usize, seed: Option<&Lz77Store>, bitwise_writer: &mut BitwiseWriter<W>) -> io::Result<()>
     where W: Write
 {
     /* If btype=Dynamic is specified, it tries all block types. If a lesser btype is
@@ -65,7 +144,8 @@ fn deflate_part<W>(options: &Options, btype: BlockType, final_block: bool, in_da
             add_lz77_block(options, btype, final_block, in_data, &store, 0, store.size(), 0, bitwise_writer)
         },
         BlockType::Dynamic => {
-            blocksplit_attempt(options, final_block, in_data, instart, inend, bitwise_writer)
+            let (lz77, splitpoints) = try!(blocksplit_attempt(options, in_data, instart, inend, seed));
+            add_all_blocks(&splitpoints, &lz77, options, final_block, in_data, bitwise_writer)
         },
     }
 }
@@ -393,7 +473,7 @@ static TRUTH_TABLE: [(bool, bool, bool); 8] = [
 ];
 
 /// Gives the exact size of the tree, in bits, as it will be encoded in DEFLATE.
-fn calculate_tree_size(ll_lengths: &[u32], d_lengths: &[u32]) -> usize {
+pub fn calculate_tree_size(ll_lengths: &[u32], d_lengths: &[u32]) -> usize {
     TRUTH_TABLE.iter().map(|&(use_16, use_17, use_18)| {
         encode_tree_no_output(ll_lengths, d_lengths, use_16, use_17, use_18)
     }).min().unwrap_or(0)
@@ -621,12 +701,15 @@ fn add_lz77_block<W>(options: &Options, btype: BlockType, final_block: bool, in_
         BlockType::Dynamic => {
             try!(bitwise_writer.add_bit(0));
             try!(bitwise_writer.add_bit(1));
+            let mut span = trace_span!("build_tree", lstart = lstart, lend = lend);
             let (_, ll_lengths, d_lengths) = get_dynamic_lengths(lz77, lstart, lend);
 
             let detect_tree_size = bitwise_writer.bytes_written();
             try!(add_dynamic_tree(&ll_lengths, &d_lengths, bitwise_writer));
+            span.arg("tree_bytes", (bitwise_writer.bytes_written() - detect_tree_size) as u64);
+            drop(span);
             if options.verbose {
-                println!("treesize: {}", bitwise_writer.bytes_written() - detect_tree_size);
+                eprintln!("treesize: {}", bitwise_writer.bytes_written() - detect_tree_size);
             }
             (ll_lengths, d_lengths)
         }
@@ -644,7 +727,7 @@ fn add_lz77_block<W>(options: &Options, btype: BlockType, final_block: bool, in_
     if options.verbose {
         let uncompressed_size = lz77.litlens[lstart..lend].iter().fold(0, |acc, &x| acc + x.size());
         let compressed_size = bitwise_writer.bytes_written() - detect_block_size;
-        println!("compressed block size: {} ({}k) (unc: {})", compressed_size, compressed_size / 1024, uncompressed_size);
+        eprintln!("compressed block size: {} ({}k) (unc: {})", compressed_size, compressed_size / 1024, uncompressed_size);
     }
     Ok(())
 }
@@ -817,9 +900,10 @@ pub fn calculate_block_size_auto_type(lz77: &Lz77Store, lstart: usize, lend: usi
     uncompressedcost.min(fixedcost).min(dyncost)
 }
 
-fn add_all_blocks<W>(splitpoints: &[usize], lz77: &Lz77Store, options: &Options, final_block: bool, in_data: &[u8], bitwise_writer: &mut BitwiseWriter<W>) -> io::Result<()>
+pub fn add_all_blocks<W>(splitpoints: &[usize], lz77: &Lz77Store, options: &Options, final_block: bool, in_data: &[u8], bitwise_writer: &mut BitwiseWriter<W>) -> io::Result<()>
     where W: Write
 {
+    let _span = trace_span!("add_all_blocks", blocks = splitpoints.len() + 1, symbols = lz77.size());
     let mut last = 0;
     for &item in splitpoints.iter() {
         try!(add_lz77_block_auto_type(options, false, in_data, lz77, last, item, 0, bitwise_writer));
@@ -828,9 +912,12 @@ fn add_all_blocks<W>(splitpoints: &[usize], lz77: &Lz77Store, options: &Options,
     add_lz77_block_auto_type(options, final_block, in_data, lz77, last, lz77.size(), 0, bitwise_writer)
 }
 
-fn blocksplit_attempt<W>(options: &Options, final_block: bool, in_data: &[u8], instart: usize, inend: usize, bitwise_writer: &mut BitwiseWriter<W>) -> io::Result<()>
-    where W: Write
-{
+/// Splits the part from `instart` to `inend` into blocks and squeezes each of
+/// them, then tries splitting again on the resulting LZ77 data. Returns the LZ77
+/// data of the part and the best split points found, as lz77 indices. The
+/// blocks are squeezed on `options.executor` if there is one.
+fn blocksplit_attempt(options: &Options, in_data: &[u8], instart: usize, inend: usize, seed: Option<&Lz77Store>) -> io::Result<(Lz77Store, Vec<usize>)> {
+    let _span = trace_span!("master_block", instart = instart, inend = inend);
     let mut totalcost = 0.0;
     let mut lz77 = Lz77Store::new();
 
@@ -841,11 +928,27 @@ fn blocksplit_attempt<W>(options: &Options, final_block: bool, in_data: &[u8], i
     let npoints = splitpoints_uncompressed.len();
     let mut splitpoints = Vec::with_capacity(npoints);
 
-    let mut last = instart;
-    for &item in &splitpoints_uncompressed {
-        let mut s = ZopfliBlockState::new(options, last, item);
+    let mut starts = Vec::with_capacity(npoints + 1);
+    starts.push(instart);
+    starts.extend_from_slice(&splitpoints_uncompressed);
+    let mut ends = splitpoints_uncompressed.clone();
+    ends.push(inend);
+
+    let jobs = starts.into_iter().zip(ends).map(|(start, end)| {
+        move || {
+            if options.is_cancelled() {
+                return Lz77Store::new();
+            }
+            let _span = trace_span!("lz77_optimal", instart = start, inend = end);
+            let mut s = ZopfliBlockState::new(options, start, end);
+            let block_seed = seed.map(|seed| seed.slice_bytes(in_data, start, end));
+            lz77_optimal(&mut s, in_data, start, end, options.numiterations, block_seed.as_ref())
+        }
+    }).collect();
+    let stores = run_jobs(options.executor.as_ref(), jobs);
+    try!(options.check_cancelled());
 
-        let store = lz77_optimal(&mut s, in_data, last, item, options.numiterations);
+    for store in stores {
         totalcost += calculate_block_size_auto_type(&store, 0, store.size());
 
         // ZopfliAppendLZ77Store(&store, &lz77);
@@ -855,23 +958,13 @@ fn blocksplit_attempt<W>(options: &Options, final_block: bool, in_data: &[u8], i
         }
 
         splitpoints.push(lz77.size());
-
-        last = item;
-    }
-
-    let mut s = ZopfliBlockState::new(options, last, inend);
-
-    let store = lz77_optimal(&mut s, in_data, last, inend, options.numiterations);
-    totalcost += calculate_block_size_auto_type(&store, 0, store.size());
-
-    // ZopfliAppendLZ77Store(&store, &lz77);
-    debug_assert!(store.size() > 0);
-    for (&litlens, &pos) in store.litlens.iter().zip(store.pos.iter()) {
-        lz77.append_store_item(litlens, pos);
     }
+    /* The last block ends the part, it isn't a split point. */
+    splitpoints.pop();
 
     /* Second block splitting attempt */
     if npoints > 1 {
+        let _span = trace_span!("blocksplit_lz77", instart = instart, inend = inend, symbols = lz77.size());
         let mut splitpoints2 = Vec::with_capacity(splitpoints_uncompressed.len());
         let mut totalcost2 = 0.0;
 
@@ -889,7 +982,7 @@ fn blocksplit_attempt<W>(options: &Options, final_block: bool, in_data: &[u8], i
         }
     }
 
-    add_all_blocks(&splitpoints, &lz77, options, final_block, in_data, bitwise_writer)
+    Ok((lz77, splitpoints))
 }
 
 /// Since an uncompressed block can be max 65535 in size, it actually adds
@@ -921,6 +1014,29 @@ fn add_non_compressed_block<W>(final_block: bool, in_data: &[u8], instart: usize
     Ok(())
 }
 
+/// Adds an empty non-final stored block, which ends the output at a byte
+/// boundary. This is the marker zlib writes for a sync flush.
+pub fn add_empty_stored_block<W>(bitwise_writer: &mut BitwiseWriter<W>) -> io::Result<()>
+    where W: Write
+{
+    /* BFINAL 0, BTYPE 00 */
+    try!(bitwise_writer.add_bits(0, 3));
+    try!(bitwise_writer.finish_partial_bits());
+    bitwise_writer.add_bytes(&[0, 0, 0xff, 0xff])
+}
+
+/// Adds an empty final block with the fixed tree, for ending a stream whose
+/// blocks so far weren't final.
+pub fn add_empty_final_block<W>(bitwise_writer: &mut BitwiseWriter<W>) -> io::Result<()>
+    where W: Write
+{
+    /* BFINAL 1, BTYPE 01 */
+    try!(bitwise_writer.add_bit(1));
+    try!(bitwise_writer.add_bits(1, 2));
+    /* End symbol 256, which has code 0000000 in the fixed tree. */
+    bitwise_writer.add_huffman_bits(0, 7)
+}
+
 pub struct BitwiseWriter<W> {
     bit: u8,
     bp: u8,
@@ -931,7 +1047,7 @@ pub struct BitwiseWriter<W> {
 impl<W> BitwiseWriter<W>
     where W: Write
 {
-    fn new(out: W) -> BitwiseWriter<W> {
+    pub fn new(out: W) -> BitwiseWriter<W> {
         BitwiseWriter {
             bit: 0,
             bp: 0,
@@ -940,6 +1056,48 @@ impl<W> BitwiseWriter<W>
         }
     }
 
+    /// Continues a stream that stopped in the middle of a byte, with `bp` bits of
+    /// `bit` already added, as returned by `partial_bits`.
+    pub fn with_partial_bits(out: W, bit: u8, bp: u8) -> BitwiseWriter<W> {
+        BitwiseWriter {
+            bit: bit,
+            bp: bp,
+            len: 0,
+            out: out,
+        }
+    }
+
+    /// The bits added after the last whole byte, and how many there are.
+    pub fn partial_bits(&self) -> (u8, u8) {
+        (self.bit, self.bp)
+    }
+
+    /// Adds the first `bits` bits of `bytes`, a stream that another writer
+    /// started at a byte boundary, as if they had been added here.
+    pub fn append_bits(&mut self, bytes: &[u8], bits: usize) -> io::Result<()> {
+        let whole = bits / 8;
+        if self.bp == 0 {
+            try!(self.add_bytes(&bytes[..whole]));
+        } else {
+            for &byte in &bytes[..whole] {
+                try!(self.add_bits(byte as u32, 8));
+            }
+        }
+        if bits % 8 > 0 {
+            try!(self.add_bits(bytes[whole] as u32, (bits % 8) as u32));
+        }
+        Ok(())
+    }
+
+    pub fn get_mut(&mut self) -> &mut W {
+        &mut self.out
+    }
+
+    /// Returns the wrapped writer. Partial bits that weren't finished are lost.
+    pub fn into_inner(self) -> W {
+        self.out
+    }
+
     fn bytes_written(&self) -> usize {
         self.len + if self.bp > 0 { 1 } else { 0 }
     }
@@ -965,7 +1123,7 @@ impl<W> BitwiseWriter<W>
         }
     }
 
-    fn add_bits(&mut self, symbol: u32, length: u32) -> io::Result<()> {
+    pub fn add_bits(&mut self, symbol: u32, length: u32) -> io::Result<()> {
         // TODO: make more efficient (add more bits at once)
         for i in 0..length {
             let bit = ((symbol >> i) & 1) as u8;
@@ -977,7 +1135,7 @@ impl<W> BitwiseWriter<W>
 
     /// Adds bits, like `add_bits`, but the order is inverted. The deflate specification
     /// uses both orders in one standard.
-    fn add_huffman_bits(&mut self, symbol: u32, length: u32) -> io::Result<()> {
+    pub fn add_huffman_bits(&mut self, symbol: u32, length: u32) -> io::Result<()> {
         // TODO: make more efficient (add more bits at once)
         for i in 0..length {
             let bit = ((symbol >> (length - i - 1)) & 1) as u8;
@@ -987,7 +1145,7 @@ impl<W> BitwiseWriter<W>
         Ok(())
     }
 
-    fn finish_partial_bits(&mut self) -> io::Result<()> {
+    pub fn finish_partial_bits(&mut self) -> io::Result<()> {
         if self.bp != 0 {
             let bytes = &[self.bit];
             try!(self.add_bytes(bytes));
@@ -1007,6 +1165,7 @@ fn set_counts_to_count(counts: &mut [usize], count: usize, i: usize, stride: usi
 #[cfg(test)]
 mod test {
     use super::*;
+    use util::ZOPFLI_MASTER_BLOCK_SIZE;
 
     #[test]
     fn test_set_counts_to_count() {
@@ -1022,4 +1181,33 @@ mod test {
             vec![0, 1, 2, 100, 100, 100, 100, 100, 8, 9]
         )
     }
+
+    #[test]
+    fn executor_does_not_change_the_output() {
+        use std::sync::Arc;
+        use ThreadExecutor;
+
+        /* Enough for three master blocks, of which the last is short. */
+        let js = include_bytes!("../test/data/codetriage.js");
+        let in_data: Vec<u8> = js.iter().cycle().take(2 * ZOPFLI_MASTER_BLOCK_SIZE + 12345).cloned().collect();
+        let mut options = Options::default();
+        options.numiterations = 1;
+
+        let mut single = vec![];
+        deflate(&options, BlockType::Dynamic, &in_data, &mut single).unwrap();
+
+        options.executor = Some(Arc::new(ThreadExecutor::with_threads(2)));
+        let mut parallel = vec![];
+        deflate(&options, BlockType::Dynamic, &in_data, &mut parallel).unwrap();
+        assert_eq!(single, parallel);
+
+        /* And with a single master block, whose blocks are squeezed in parallel. */
+        let mut single = vec![];
+        options.executor = None;
+        deflate(&options, BlockType::Dynamic, js, &mut single).unwrap();
+        options.executor = Some(Arc::new(ThreadExecutor::with_threads(3)));
+        let mut parallel = vec![];
+        deflate(&options, BlockType::Dynamic, js, &mut parallel).unwrap();
+        assert_eq!(single, parallel);
+    }
 }
@@ -0,0 +1,112 @@
+//! Where the independent pieces of work of a compression run. Without an
+//! executor in the options everything runs on the calling thread, in order, so
+//! the library never starts threads of its own. Since every piece of work is
+//! deterministic, the output is the same whichever executor runs it.
+
+use std::sync::{Arc, Mutex};
+use std::thread;
+
+/// A piece of work handed to an executor.
+pub type Task<'a> = Box<dyn FnOnce() + Send + 'a>;
+
+/// Runs tasks for the parallel stages of the compressor: master blocks, the
+/// squeeze of the blocks they are split into, and the samples of a prediction.
+pub trait Executor: Send + Sync {
+    /// Spawns every task of `tasks` and joins them: it must not return before
+    /// all of them have finished. Tasks may borrow from the caller, which is why
+    /// spawning and joining are one call. Running some of them on the calling
+    /// thread, for example to not block a thread of a fixed size pool, is fine.
+    fn run_all<'a>(&self, tasks: Vec<Task<'a>>);
+
+    /// How many tasks are worth running at the same time. Stages use this to
+    /// decide how much work to start at once, which also bounds their memory.
+    fn parallelism(&self) -> usize;
+}
+
+/// Runs tasks on scoped std threads, at most `threads` at a time.
+pub struct ThreadExecutor {
+    threads: usize,
+}
+
+impl ThreadExecutor {
+    /// An executor with a thread for every CPU.
+    pub fn new() -> ThreadExecutor {
+        ThreadExecutor::with_threads(thread::available_parallelism().map(|n| n.get()).unwrap_or(1))
+    }
+
+    pub fn with_threads(threads: usize) -> ThreadExecutor {
+        ThreadExecutor {
+            threads: threads.max(1),
+        }
+    }
+}
+
+impl Executor for ThreadExecutor {
+    fn run_all<'a>(&self, tasks: Vec<Task<'a>>) {
+        let threads = self.threads.min(tasks.len());
+        if threads <= 1 {
+            for task in tasks {
+                task();
+            }
+            return;
+        }
+
+        let queue = Mutex::new(tasks.into_iter());
+        thread::scope(|scope| {
+            for _ in 0..threads {
+                scope.spawn(|| loop {
+                    let task = queue.lock().unwrap().next();
+                    match task {
+                        Some(task) => task(),
+                        None => break,
+                    }
+                });
+            }
+        });
+    }
+
+    fn parallelism(&self) -> usize {
+        self.threads
+    }
+}
+
+/// Runs `jobs` on `executor`, or one after another on this thread if there is
+/// none, and returns their results in the order of `jobs`.
+pub fn run_jobs<'a, T, F>(executor: Option<&Arc<dyn Executor>>, jobs: Vec<F>) -> Vec<T>
+    where T: Send + 'a,
+          F: FnOnce() -> T + Send + 'a
+{
+    let executor = match executor {
+        Some(executor) if jobs.len() > 1 => executor,
+        _ => return jobs.into_iter().map(|job| job()).collect(),
+    };
+
+    let mut results: Vec<Option<T>> = jobs.iter().map(|_| None).collect();
+    {
+        let tasks = results.iter_mut().zip(jobs).map(|(result, job)| {
+            let task: Task = Box::new(move || *result = Some(job()));
+            task
+        }).collect();
+        executor.run_all(tasks);
+    }
+    results.into_iter().map(|result| result.expect("executor did not run every task")).collect()
+}
+
+/// How many jobs a stage should run at once with `executor`.
+pub fn parallelism(executor: Option<&Arc<dyn Executor>>) -> usize {
+    executor.map_or(1, |executor| executor.parallelism().max(1))
+}
+
+#[cfg(test)]
+mod test {
+    use super::*;
+
+    #[test]
+    fn results_keep_the_order_of_the_jobs() {
+        let executor: Arc<dyn Executor> = Arc::new(ThreadExecutor::with_threads(3));
+        let data: Vec<u64> = (0..1000).collect();
+        let jobs: Vec<_> = data.chunks(7).map(|chunk| move || chunk.iter().sum::<u64>()).collect();
+        let expected: Vec<u64> = data.chunks(7).map(|chunk| chunk.iter().sum()).collect();
+        assert_eq!(run_jobs(Some(&executor), jobs), expected);
+    }
+}
@@ -0,0 +1,410 @@
+//! Compressing one input on several machines. A coordinator cuts it into master
+//! blocks and sends each, with the 32KB before it that its matches may refer
+//! to, to a worker over TCP. Workers return the deflate blocks as a string of
+//! bits that doesn't have to end at a byte boundary, and the checksums of the
+//! block's input. Since a master block only depends on its window, the stitched
+//! output is the same as that of `compress`.
+//!
+//! A job is the line `block <numiterations> <blocksplittingmax> <max_chain_hits>
+//! <cache_length> <final> <window size> <size>`, followed by the window and the
+//! block. It is answered by
+//! `fragment <bits> <crc32> <adler32> <size>` and the bits, padded to bytes, or
+//! by `error <message>`.
+
+use std::cmp;
+use std::io::{self, BufRead, BufReader, Read, Write};
+use std::net::{SocketAddr, TcpListener, TcpStream, ToSocketAddrs};
+use std::sync::Mutex;
+use std::thread;
+
+use adler32::adler32;
+use crc::crc32;
+
+use cancel::memory_plan;
+use deflate::{deflate_part, BitwiseWriter, BlockType};
+use gzip::{gzip_header, gzip_trailer};
+use util::{ZOPFLI_MASTER_BLOCK_SIZE, ZOPFLI_WINDOW_SIZE};
+use zlib::{zlib_header, zlib_trailer};
+use {compress, resolve_options, Format, Options};
+
+/// Compresses master blocks for coordinators that connect to it.
+pub struct BlockWorker {
+    listener: TcpListener,
+    options: Options,
+}
+
+impl BlockWorker {
+    /// Listens on `addr`. The numbers in jobs override those of `options`.
+    pub fn bind<A: ToSocketAddrs>(addr: A, options: &Options) -> io::Result<BlockWorker> {
+        Ok(BlockWorker {
+            listener: try!(TcpListener::bind(addr)),
+            options: options.clone(),
+        })
+    }
+
+    pub fn local_addr(&self) -> io::Result<SocketAddr> {
+        self.listener.local_addr()
+    }
+
+    /// Accepts connections until the listener fails, running the jobs of each
+    /// connection one after another.
+    pub fn run(&self) -> io::Result<()> {
+        for stream in self.listener.incoming() {
+            let stream = try!(stream);
+            let options = self.options.clone();
+            thread::spawn(move || {
+                /* A coordinator that goes away only ends its connection. */
+                let _ = serve(&options, stream);
+            });
+        }
+        Ok(())
+    }
+}
+
+fn serve(options: &Options, stream: TcpStream) -> io::Result<()> {
+    let mut reader = BufReader::new(try!(stream.try_clone()));
+    let mut writer = stream;
+    let mut line = String::new();
+    let mut data = vec![];
+    loop {
+        line.clear();
+        if try!(reader.read_line(&mut line)) == 0 {
+            return Ok(());
+        }
+        let words: Vec<&str> = line.split_whitespace().collect();
+        /* The window and the block are read even when the other numbers are
+        wrong, so the coordinator gets to read the error when it's done sending
+        them. Only a job that can't be framed ends the connection. */
+        let sizes = match words.as_slice() {
+            ["block", _, _, _, _, _, window, size] => {
+                match (window.parse::<usize>(), size.parse::<usize>()) {
+                    (Ok(window), Ok(size)) if window <= ZOPFLI_WINDOW_SIZE && size <= ZOPFLI_MASTER_BLOCK_SIZE => Some((window, size)),
+                    _ => None,
+                }
+            }
+            _ => None,
+        };
+        let (window, size) = match sizes {
+            Some(sizes) => sizes,
+            None => return write!(writer, "error invalid job\n"),
+        };
+        data.resize(window + size, 0);
+        try!(reader.read_exact(&mut data));
+
+        let job = match words.as_slice() {
+            ["block", numiterations, blocksplittingmax, max_chain_hits, cache_length, final_block, _, _] => {
+                match (numiterations.parse::<i32>(), blocksplittingmax.parse::<i32>(), max_chain_hits.parse(), cache_length.parse::<usize>(), final_block.parse::<u8>()) {
+                    (Ok(numiterations), Ok(blocksplittingmax), Ok(max_chain_hits), Ok(cache_length), Ok(final_block))
+                        if numiterations >= 0 && blocksplittingmax >= 0 && cache_length >= 1 && cache_length <= 256 => Some((numiterations, blocksplittingmax, max_chain_hits, cache_length, final_block != 0)),
+                    _ => None,
+                }
+            }
+            _ => None,
+        };
+        let (numiterations, blocksplittingmax, max_chain_hits, cache_length, final_block) = match job {
+            Some(job) => job,
+            None => {
+                try!(write!(writer, "error invalid job\n"));
+                continue;
+            }
+        };
+
+        let mut options = options.clone();
+        options.numiterations = numiterations;
+        options.blocksplittingmax = blocksplittingmax;
+        options.max_chain_hits = max_chain_hits;
+        options.cache_length = cache_length;
+        match compress_block(&options, &data, window, final_block) {
+            Ok((bytes, bits)) => {
+                let block = &data[window..];
+                let adler = adler32(block).expect("Error with adler32");
+                try!(write!(writer, "fragment {} {} {} {}\n", bits, crc32::checksum_ieee(block), adler, bytes.len()));
+                try!(writer.write_all(&bytes));
+            }
+            Err(err) => try!(write!(writer, "error {}\n", err.to_string().replace('\n', " "))),
+        }
+    }
+}
+
+/// The deflate blocks of `data[window..]`, padded to bytes, and how many of
+/// their bits count.
+fn compress_block(options: &Options, data: &[u8], window: usize, final_block: bool) -> io::Result<(Vec<u8>, usize)> {
+    let mut bitwise_writer = BitwiseWriter::new(vec![]);
+    try!(deflate_part(options, BlockType::Dynamic, final_block, data, window, data.len(), None, &mut bitwise_writer));
+    let (bit, bp) = bitwise_writer.partial_bits();
+    let mut bytes = bitwise_writer.into_inner();
+    let mut bits = bytes.len() * 8;
+    if bp > 0 {
+        bytes.push(bit);
+        bits += bp as usize;
+    }
+    Ok((bytes, bits))
+}
+
+struct Fragment {
+    bytes: Vec<u8>,
+    bits: usize,
+    crc: u32,
+    adler: u32,
+}
+
+/// Compresses `in_data` like `compress`, but has its master blocks compressed
+/// by the `BlockWorker`s listening on `workers`. Jobs of workers that can't be
+/// reached or that disconnect are given to the others, and the compression
+/// fails only if none is left. The result cache of `options` isn't used.
+pub fn compress_distributed<A, W>(options: &Options, output_type: &Format, in_data: &[u8], workers: &[A], mut out: W) -> io::Result<()>
+    where A: ToSocketAddrs + Sync,
+          W: Write
+{
+    if in_data.is_empty() {
+        return compress(options, output_type, in_data, out);
+    }
+    /* The master blocks and the cache length the jobs ask for follow the memory
+    plan, like in compress. */
+    let mut options = resolve_options(options, in_data);
+    let plan = memory_plan(&options, in_data.len());
+    options.cache_length = plan.cache_length;
+    let options = &options;
+    let mut parts = vec![];
+    let mut i = 0;
+    while i < in_data.len() {
+        let size = cmp::min(plan.master_block_size, in_data.len() - i);
+        parts.push((i, i + size));
+        i += size;
+    }
+
+    let mut fragments: Vec<Option<Fragment>> = parts.iter().map(|_| None).collect();
+    let mut last_error = None;
+    loop {
+        let pending: Vec<usize> = (0..parts.len()).rev().filter(|&i| fragments[i].is_none()).collect();
+        if pending.is_empty() {
+            break;
+        }
+        /* Workers that failed are tried again as long as some job is done. */
+        let (done, error) = dispatch(options, in_data, &parts, pending, workers);
+        if let Some(err) = error {
+            last_error = Some(err);
+        }
+        if done.is_empty() {
+            return Err(last_error.unwrap_or_else(|| io::Error::new(io::ErrorKind::NotConnected, "there are no workers")));
+        }
+        for (i, fragment) in done {
+            fragments[i] = Some(try!(fragment));
+        }
+    }
+
+    match *output_type {
+        Format::Gzip => try!(gzip_header(&mut out)),
+        Format::Zlib => try!(zlib_header(&mut out)),
+        Format::Deflate => {},
+    }
+    let mut bitwise_writer = BitwiseWriter::new(&mut out);
+    let mut crc = 0;
+    let mut adler = 1;
+    for (fragment, &(instart, inend)) in fragments.iter().zip(&parts) {
+        let fragment = fragment.as_ref().unwrap();
+        try!(bitwise_writer.append_bits(&fragment.bytes, fragment.bits));
+        crc = crc32_combine(crc, fragment.crc, (inend - instart) as u64);
+        adler = adler32_combine(adler, fragment.adler, (inend - instart) as u64);
+    }
+    try!(bitwise_writer.finish_partial_bits());
+    match *output_type {
+        Format::Gzip => gzip_trailer(crc, in_data.len() as u32, out),
+        Format::Zlib => zlib_trailer(adler, out),
+        Format::Deflate => Ok(()),
+    }
+}
+
+/// Runs the jobs of `pending`, the last first, on all `workers` at once until
+/// none is left or every worker failed. Returns the fragments that came back,
+/// or the errors the workers reported, and the last connection error.
+fn dispatch<A>(options: &Options, in_data: &[u8], parts: &[(usize, usize)], pending: Vec<usize>, workers: &[A]) -> (Vec<(usize, io::Result<Fragment>)>, Option<io::Error>)
+    where A: ToSocketAddrs + Sync
+{
+    let pending = Mutex::new(pending);
+    let done = Mutex::new(vec![]);
+    let error = Mutex::new(None);
+    thread::scope(|scope| {
+        for worker in workers {
+            let (pending, done, error) = (&pending, &done, &error);
+            scope.spawn(move || {
+                let failed = TcpStream::connect(worker).and_then(|stream| {
+                    let mut reader = BufReader::new(try!(stream.try_clone()));
+                    let mut writer = stream;
+                    loop {
+                        try!(options.check_cancelled());
+                        let i = match pending.lock().unwrap().pop() {
+                            Some(i) => i,
+                            None => return Ok(()),
+                        };
+                        match run_job(options, in_data, parts[i], &mut reader, &mut writer) {
+                            Ok(fragment) => done.lock().unwrap().push((i, fragment)),
+                            Err(err) => {
+                                pending.lock().unwrap().push(i);
+                                return Err(err);
+                            }
+                        }
+                    }
+                });
+                if let Err(err) = failed {
+                    *error.lock().unwrap() = Some(err);
+                }
+            });
+        }
+    });
+    (done.into_inner().unwrap(), error.into_inner().unwrap())
+}
+
+/// Sends the master block from `instart` to `inend` to a worker. The outer error
+/// is of the connection, the inner one is reported by the worker.
+fn run_job(options: &Options, in_data: &[u8], (instart, inend): (usize, usize), reader: &mut BufReader<TcpStream>, writer: &mut TcpStream) -> io::Result<io::Result<Fragment>> {
+    let windowstart = instart.saturating_sub(ZOPFLI_WINDOW_SIZE);
+    let final_block = if inend == in_data.len() { 1 } else { 0 };
+    try!(write!(writer, "block {} {} {} {} {} {} {}\n", options.numiterations, options.blocksplittingmax, options.max_chain_hits, options.cache_length, final_block, instart - windowstart, inend - instart));
+    try!(writer.write_all(&in_data[windowstart..inend]));
+
+    let mut line = String::new();
+    try!(reader.read_line(&mut line));
+    let words: Vec<&str> = line.split_whitespace().collect();
+    match words.as_slice() {
+        ["fragment", bits, crc, adler, size] => match (bits.parse::<usize>(), crc.parse(), adler.parse(), size.parse::<usize>()) {
+            (Ok(bits), Ok(crc), Ok(adler), Ok(size)) if (bits + 7) / 8 == size => {
+                let mut bytes = vec![0; size];
+                try!(reader.read_exact(&mut bytes));
+                Ok(Ok(Fragment {
+                    bytes: bytes,
+                    bits: bits,
+                    crc: crc,
+                    adler: adler,
+                }))
+            }
+            _ => Err(io::Error::new(io::ErrorKind::InvalidData, "invalid response")),
+        },
+        ["error", ..] => Ok(Err(io::Error::new(io::ErrorKind::Other, line["error".len()..].trim().to_string()))),
+        _ => Err(io::Error::new(io::ErrorKind::InvalidData, "invalid response")),
+    }
+}
+
+/// The CRC-32 of two pieces of data from the CRC-32 of each and the size of
+/// the second, as zlib's crc32_combine.
+fn crc32_combine(crc1: u32, crc2: u32, mut len2: u64) -> u32 {
+    fn times(matrix: &[u32; 32], mut vector: u32) -> u32 {
+        let mut sum = 0;
+        let mut i = 0;
+        while vector != 0 {
+            if vector & 1 != 0 {
+                sum ^= matrix[i];
+            }
+            vector >>= 1;
+            i += 1;
+        }
+        sum
+    }
+    fn square(matrix: &[u32; 32]) -> [u32; 32] {
+        let mut square = [0; 32];
+        for n in 0..32 {
+            square[n] = times(matrix, matrix[n]);
+        }
+        square
+    }
+
+    if len2 == 0 {
+        return crc1;
+    }
+    /* The operator for one zero bit, then for two and four. */
+    let mut odd = [0; 32];
+    odd[0] = 0xedb88320;
+    for n in 1..32 {
+        odd[n] = 1 << (n - 1);
+    }
+    let mut even = square(&odd);
+    odd = square(&even);
+
+    /* Applies len2 zero bytes to crc1. */
+    let mut crc1 = crc1;
+    loop {
+        even = square(&odd);
+        if len2 & 1 != 0 {
+            crc1 = times(&even, crc1);
+        }
+        len2 >>= 1;
+        if len2 == 0 {
+            break;
+        }
+        odd = square(&even);
+        if len2 & 1 != 0 {
+            crc1 = times(&odd, crc1);
+        }
+        len2 >>= 1;
+        if len2 == 0 {
+            break;
+        }
+    }
+    crc1 ^ crc2
+}
+
+/// The Adler-32 of two pieces of data from the Adler-32 of each and the size
+/// of the second, as zlib's adler32_combine.
+fn adler32_combine(adler1: u32, adler2: u32, len2: u64) -> u32 {
+    const BASE: u64 = 65521;
+    let rem = len2 % BASE;
+    let mut sum1 = adler1 as u64 & 0xffff;
+    let mut sum2 = rem * sum1 % BASE;
+    sum1 += (adler2 as u64 & 0xffff) + BASE - 1;
+    sum2 += (adler1 as u64 >> 16) + (adler2 as u64 >> 16) + BASE - rem;
+    if sum1 >= BASE {
+        sum1 -= BASE;
+    }
+    if sum1 >= BASE {
+        sum1 -= BASE;
+    }
+    if sum2 >= BASE << 1 {
+        sum2 -= BASE << 1;
+    }
+    if sum2 >= BASE {
+        sum2 -= BASE;
+    }
+    (sum1 | sum2 << 16) as u32
+}
+
+#[cfg(test)]
+mod test {
+    use super::*;
+
+    #[test]
+    fn combines_checksums() {
+        let data = b"the checksums of two pieces combined are those of the whole";
+        let (a, b) = data.split_at(21);
+        assert_eq!(crc32_combine(crc32::checksum_ieee(a), crc32::checksum_ieee(b), b.len() as u64), crc32::checksum_ieee(data));
+        assert_eq!(adler32_combine(adler32(&a[..]).unwrap(), adler32(&b[..]).unwrap(), b.len() as u64), adler32(&data[..]).unwrap());
+    }
+
+    #[test]
+    fn stitches_the_blocks_of_workers() {
+        let js = include_bytes!("../test/data/codetriage.js");
+        let in_data: Vec<u8> = js.iter().cycle().take(2 * ZOPFLI_MASTER_BLOCK_SIZE + 12345).cloned().collect();
+        let mut options = Options::default();
+        options.numiterations = 1;
+
+        let mut workers = vec![];
+        for _ in 0..2 {
+            let worker = BlockWorker::bind("127.0.0.1:0", &options).unwrap();
+            workers.push(worker.local_addr().unwrap());
+            thread::spawn(move || worker.run());
+        }
+        /* Nothing listens on the last one, so its jobs go to the others. */
+        let unused = TcpListener::bind("127.0.0.1:0").unwrap();
+        workers.push(unused.local_addr().unwrap());
+        drop(unused);
+
+        let mut expected = vec![];
+        compress(&options, &Format::Gzip, &in_data, &mut expected).unwrap();
+        let mut out = vec![];
+        compress_distributed(&options, &Format::Gzip, &in_data, &workers, &mut out).unwrap();
+        assert_eq!(out, expected);
+
+        options.blocksplittingmax = -1;
+        let err = compress_distributed(&options, &Format::Gzip, &in_data, &workers, &mut vec![]).unwrap_err();
+        assert_eq!(err.to_string(), "invalid job");
+    }
+}
@@ -21,13 +21,35 @@ static HEADER: &'static [u8] = &[
 ];
 
 /// Compresses the data according to the gzip specification, RFC 1952.
-pub fn gzip_compress<W>(options: &Options, in_data: &[u8], mut out: W) -> io::Result<()>
+pub fn gzip_compress<W>(options: &Options, in_data: &[u8], out: W) -> io::Result<()>
     where W: Write
 {
-    try!(out.by_ref().write_all(HEADER));
+    gzip_wrap(in_data, out, |out| deflate(options, BlockType::Dynamic, in_data, out))
+}
+
+/// Writes the gzip header and trailer for `in_data` around the deflate stream
+/// that `body` writes.
+pub fn gzip_wrap<W, F>(in_data: &[u8], mut out: W, body: F) -> io::Result<()>
+    where W: Write,
+          F: FnOnce(&mut W) -> io::Result<()>
+{
+    try!(gzip_header(&mut out));
 
-    try!(deflate(options, BlockType::Dynamic, in_data, out.by_ref()));
+    try!(body(&mut out));
 
-    try!(out.by_ref().write_u32::<LittleEndian>(crc32::checksum_ieee(in_data)));
-    out.write_u32::<LittleEndian>(in_data.len() as u32)
+    gzip_trailer(crc32::checksum_ieee(in_data), in_data.len() as u32, out)
+}
+
+pub fn gzip_header<W>(mut out: W) -> io::Result<()>
+    where W: Write
+{
+    out.write_all(HEADER)
+}
+
+/// Writes the CRC-32 and the size modulo 2^32 of the uncompressed data.
+pub fn gzip_trailer<W>(crc: u32, size: u32, mut out: W) -> io::Result<()>
+    where W: Write
+{
+    try!(out.write_u32::<LittleEndian>(crc));
+    out.write_u32::<LittleEndian>(size)
 }
@@ -0,0 +1,546 @@
+//! A small DEFLATE decoder, RFC 1951, used to turn an existing deflate, zlib or
+//! gzip stream back into its LZ77 symbols so they can be fed into the
+//! compressor again, and to check that what the compressor wrote decodes to its
+//! input.
+
+use std::io;
+
+use adler32::adler32;
+use crc::crc32;
+
+use lz77::Lz77Store;
+use Format;
+
+/// Base lengths for length symbols 257..285.
+const LENGTH_BASE: [u16; 29] = [
+    3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+    35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258
+];
+/// Extra bits for length symbols 257..285.
+const LENGTH_EXTRA: [u8; 29] = [
+    0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+    3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0
+];
+/// Base distances for distance symbols 0..29.
+const DIST_BASE: [u16; 30] = [
+    1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+    257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145,
+    8193, 12289, 16385, 24577
+];
+/// Extra bits for distance symbols 0..29.
+const DIST_EXTRA: [u8; 30] = [
+    0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+    7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13
+];
+/// The order in which code length code lengths are stored in a dynamic block.
+const CLCL_ORDER: [usize; 19] = [
+    16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15
+];
+
+const MAX_BITS: usize = 15;
+/// Codes up to this long are decoded with a single table lookup, longer ones
+/// bit by bit. Nearly all literal/length codes of real data are this short.
+const FAST_BITS: u32 = 9;
+
+fn invalid(msg: &str) -> io::Error {
+    io::Error::new(io::ErrorKind::InvalidData, msg)
+}
+
+/// The result of decoding a compressed stream: the uncompressed bytes and the
+/// LZ77 symbols the encoder chose for them.
+pub struct Decoded {
+    pub data: Vec<u8>,
+    pub lz77: Lz77Store,
+}
+
+/// Guesses the container from the first bytes of the stream. Anything that is
+/// neither a gzip nor a valid zlib header is treated as a raw deflate stream.
+pub fn detect_format(compressed: &[u8]) -> Format {
+    if compressed.len() >= 2 && compressed[0] == 31 && compressed[1] == 139 {
+        Format::Gzip
+    } else if compressed.len() >= 2 && compressed[0] & 15 == 8 && compressed[0] >> 4 <= 7
+        && (compressed[0] as u32 * 256 + compressed[1] as u32) % 31 == 0 {
+        Format::Zlib
+    } else {
+        Format::Deflate
+    }
+}
+
+/// Decodes a gzip, zlib or raw deflate stream, detecting which one it is, and
+/// checks the trailing checksum if the container has one.
+pub fn decode(compressed: &[u8]) -> io::Result<Decoded> {
+    decode_as(compressed, &detect_format(compressed))
+}
+
+/// Like `decode`, for a stream whose format is already known.
+pub fn decode_as(compressed: &[u8], format: &Format) -> io::Result<Decoded> {
+    let mut lz77 = Lz77Store::new();
+    let data = try!(decode_container(compressed, format, Some(&mut lz77)));
+    Ok(Decoded {
+        data: data,
+        lz77: lz77,
+    })
+}
+
+/// Checks that `compressed`, a stream of `output_type`, decodes to `in_data`
+/// and that its checksum matches.
+pub fn verify(output_type: &Format, compressed: &[u8], in_data: &[u8]) -> io::Result<()> {
+    let data = try!(decompress(compressed, output_type));
+    if data.len() != in_data.len() {
+        return Err(invalid(&format!("decodes to {} bytes instead of {}", data.len(), in_data.len())));
+    }
+    match data.iter().zip(in_data).position(|(a, b)| a != b) {
+        Some(pos) => Err(invalid(&format!("decodes to different data at byte {}", pos))),
+        None => Ok(()),
+    }
+}
+
+/// Decodes the data of a stream of `format`, checking its checksum, without
+/// collecting its LZ77 symbols.
+pub fn decompress(compressed: &[u8], format: &Format) -> io::Result<Vec<u8>> {
+    decode_container(compressed, format, None)
+}
+
+/// Decodes the data of a stream of `format`, also collecting its LZ77 symbols
+/// into `lz77` if given.
+fn decode_container(compressed: &[u8], format: &Format, lz77: Option<&mut Lz77Store>) -> io::Result<Vec<u8>> {
+    match *format {
+        Format::Gzip => decode_gzip(compressed, lz77),
+        Format::Zlib => decode_zlib(compressed, lz77),
+        Format::Deflate => inflate_into(compressed, lz77).map(|(data, _)| data),
+    }
+}
+
+fn decode_gzip(compressed: &[u8], lz77: Option<&mut Lz77Store>) -> io::Result<Vec<u8>> {
+    if compressed.len() < 18 || compressed[2] != 8 {
+        return Err(invalid("not a deflate-compressed gzip stream"));
+    }
+    let flg = compressed[3];
+    let mut pos = 10;
+    if flg & 4 != 0 {
+        // FEXTRA
+        if compressed.len() < pos + 2 {
+            return Err(invalid("truncated gzip header"));
+        }
+        pos += 2 + compressed[pos] as usize + 256 * compressed[pos + 1] as usize;
+    }
+    for &flag in &[8, 16] {
+        // FNAME and FCOMMENT are zero terminated.
+        if flg & flag != 0 {
+            match compressed.iter().skip(pos).position(|&b| b == 0) {
+                Some(len) => pos += len + 1,
+                None => return Err(invalid("truncated gzip header")),
+            }
+        }
+    }
+    if flg & 2 != 0 {
+        // FHCRC
+        pos += 2;
+    }
+    if pos > compressed.len() {
+        return Err(invalid("truncated gzip header"));
+    }
+
+    let (data, used) = try!(inflate_into(&compressed[pos..], lz77));
+    let trailer = &compressed[pos + used..];
+    if trailer.len() < 8 {
+        return Err(invalid("truncated gzip trailer"));
+    }
+    let crc = read_u32_le(&trailer[0..4]);
+    let isize = read_u32_le(&trailer[4..8]);
+    if crc != crc32::checksum_ieee(&data) || isize != data.len() as u32 {
+        return Err(invalid("gzip checksum mismatch"));
+    }
+    Ok(data)
+}
+
+fn decode_zlib(compressed: &[u8], lz77: Option<&mut Lz77Store>) -> io::Result<Vec<u8>> {
+    if compressed.len() < 2 {
+        return Err(invalid("truncated zlib header"));
+    }
+    if compressed[1] & 32 != 0 {
+        return Err(invalid("zlib streams with a preset dictionary are not supported"));
+    }
+    let (data, used) = try!(inflate_into(&compressed[2..], lz77));
+    let trailer = &compressed[2 + used..];
+    if trailer.len() < 4 {
+        return Err(invalid("truncated zlib trailer"));
+    }
+    let expected = (trailer[0] as u32) << 24 | (trailer[1] as u32) << 16 | (trailer[2] as u32) << 8 | trailer[3] as u32;
+    let checksum = adler32(io::Cursor::new(&data)).expect("Error with adler32");
+    if checksum != expected {
+        return Err(invalid("zlib checksum mismatch"));
+    }
+    Ok(data)
+}
+
+fn read_u32_le(bytes: &[u8]) -> u32 {
+    bytes[0] as u32 | (bytes[1] as u32) << 8 | (bytes[2] as u32) << 16 | (bytes[3] as u32) << 24
+}
+
+/// Decodes a raw deflate stream, also collecting its LZ77 symbols into `lz77`
+/// if given. Returns the decoded data and the number of input bytes used, so a
+/// container trailer can be found after it.
+fn inflate_into(compressed: &[u8], mut lz77: Option<&mut Lz77Store>) -> io::Result<(Vec<u8>, usize)> {
+    let mut reader = BitReader::new(compressed);
+    /* Most streams the compressor writes are at least this much smaller. */
+    let mut data = Vec::with_capacity(compressed.len() * 3);
+
+    loop {
+        let final_block = try!(reader.bits(1));
+        match try!(reader.bits(2)) {
+            0 => try!(stored_block(&mut reader, &mut data, lz77.as_mut().map(|lz77| &mut **lz77))),
+            1 => {
+                let (lencode, distcode) = fixed_codes();
+                try!(codes_block(&mut reader, &mut data, lz77.as_mut().map(|lz77| &mut **lz77), &lencode, &distcode));
+            },
+            2 => {
+                let (lencode, distcode) = try!(dynamic_codes(&mut reader));
+                try!(codes_block(&mut reader, &mut data, lz77.as_mut().map(|lz77| &mut **lz77), &lencode, &distcode));
+            },
+            _ => return Err(invalid("invalid deflate block type")),
+        }
+        if final_block == 1 {
+            break;
+        }
+    }
+    Ok((data, reader.bytes_used()))
+}
+
+fn stored_block(reader: &mut BitReader, data: &mut Vec<u8>, lz77: Option<&mut Lz77Store>) -> io::Result<()> {
+    reader.align();
+    let header = try!(reader.bytes(4));
+    let len = header[0] as usize | (header[1] as usize) << 8;
+    let nlen = header[2] as usize | (header[3] as usize) << 8;
+    if len != !nlen & 0xffff {
+        return Err(invalid("stored block length mismatch"));
+    }
+    let bytes = try!(reader.bytes(len));
+    if let Some(lz77) = lz77 {
+        for (i, &byte) in bytes.iter().enumerate() {
+            lz77.lit_len_dist(byte as u16, 0, data.len() + i);
+        }
+    }
+    data.extend_from_slice(bytes);
+    Ok(())
+}
+
+fn codes_block(reader: &mut BitReader, data: &mut Vec<u8>, mut lz77: Option<&mut Lz77Store>, lencode: &Huffman, distcode: &Huffman) -> io::Result<()> {
+    loop {
+        let symbol = try!(lencode.decode(reader));
+        if symbol < 256 {
+            if let Some(ref mut lz77) = lz77 {
+                lz77.lit_len_dist(symbol, 0, data.len());
+            }
+            data.push(symbol as u8);
+        } else if symbol == 256 {
+            return Ok(());
+        } else {
+            let symbol = symbol as usize - 257;
+            if symbol >= 29 {
+                return Err(invalid("invalid length symbol"));
+            }
+            let length = LENGTH_BASE[symbol] as usize + try!(reader.bits(LENGTH_EXTRA[symbol] as u32)) as usize;
+
+            let dsymbol = try!(distcode.decode(reader)) as usize;
+            if dsymbol >= 30 {
+                return Err(invalid("invalid distance symbol"));
+            }
+            let dist = DIST_BASE[dsymbol] as usize + try!(reader.bits(DIST_EXTRA[dsymbol] as u32)) as usize;
+            let pos = data.len();
+            if dist > pos {
+                return Err(invalid("distance too far back"));
+            }
+
+            if let Some(ref mut lz77) = lz77 {
+                lz77.lit_len_dist(length as u16, dist as u16, pos);
+            }
+            if dist >= length {
+                data.extend_from_within(pos - dist..pos - dist + length);
+            } else {
+                /* The copy overlaps what it writes. */
+                for i in 0..length {
+                    let byte = data[pos - dist + i];
+                    data.push(byte);
+                }
+            }
+        }
+    }
+}
+
+fn fixed_codes() -> (Huffman, Huffman) {
+    let mut lengths = [0; 288];
+    for (i, length) in lengths.iter_mut().enumerate() {
+        *length = match i {
+            0...143 => 8,
+            144...255 => 9,
+            256...279 => 7,
+            _ => 8,
+        };
+    }
+    (Huffman::new(&lengths).unwrap(), Huffman::new(&[5; 30]).unwrap())
+}
+
+fn dynamic_codes(reader: &mut BitReader) -> io::Result<(Huffman, Huffman)> {
+    let nlen = try!(reader.bits(5)) as usize + 257;
+    let ndist = try!(reader.bits(5)) as usize + 1;
+    let ncode = try!(reader.bits(4)) as usize + 4;
+    if nlen > 286 || ndist > 30 {
+        return Err(invalid("too many length or distance codes"));
+    }
+
+    let mut clcl = [0; 19];
+    for &index in CLCL_ORDER.iter().take(ncode) {
+        clcl[index] = try!(reader.bits(3)) as u8;
+    }
+    let clcode = try!(Huffman::new(&clcl));
+
+    let mut lengths = vec![0; nlen + ndist];
+    let mut index = 0;
+    while index < nlen + ndist {
+        let symbol = try!(clcode.decode(reader));
+        if symbol < 16 {
+            lengths[index] = symbol as u8;
+            index += 1;
+            continue;
+        }
+        let (value, repeat) = match symbol {
+            16 => {
+                if index == 0 {
+                    return Err(invalid("repeat with no previous length"));
+                }
+                (lengths[index - 1], 3 + try!(reader.bits(2)) as usize)
+            },
+            17 => (0, 3 + try!(reader.bits(3)) as usize),
+            _ => (0, 11 + try!(reader.bits(7)) as usize),
+        };
+        if index + repeat > nlen + ndist {
+            return Err(invalid("too many code lengths"));
+        }
+        for length in &mut lengths[index..(index + repeat)] {
+            *length = value;
+        }
+        index += repeat;
+    }
+    if lengths[256] == 0 {
+        return Err(invalid("missing end-of-block code"));
+    }
+
+    let lencode = try!(Huffman::new(&lengths[..nlen]));
+    let distcode = try!(Huffman::new(&lengths[nlen..]));
+    Ok((lencode, distcode))
+}
+
+/// Canonical Huffman decoding tables: the number of codes of each length, the
+/// symbols ordered by code, and a table that decodes the short codes at once.
+struct Huffman {
+    counts: [u16; MAX_BITS + 1],
+    symbols: Vec<u16>,
+    /* Indexed by the next FAST_BITS bits of input: the symbol whose code they
+    start with, shifted left by 4, or'd with the code length. 0 where the code
+    is longer. */
+    fast: Vec<u16>,
+}
+
+impl Huffman {
+    fn new(lengths: &[u8]) -> io::Result<Huffman> {
+        let mut counts = [0; MAX_BITS + 1];
+        for &length in lengths {
+            counts[length as usize] += 1;
+        }
+
+        // Reject over-subscribed codes. Incomplete codes are allowed, as the
+        // spec permits a single distance code.
+        let mut left: i32 = 1;
+        for &count in counts.iter().skip(1) {
+            left <<= 1;
+            left -= count as i32;
+            if left < 0 {
+                return Err(invalid("over-subscribed Huffman code"));
+            }
+        }
+
+        let mut offsets = [0; MAX_BITS + 1];
+        for length in 1..MAX_BITS {
+            offsets[length + 1] = offsets[length] + counts[length];
+        }
+        let mut symbols = vec![0; lengths.len()];
+        for (symbol, &length) in lengths.iter().enumerate() {
+            if length != 0 {
+                symbols[offsets[length as usize] as usize] = symbol as u16;
+                offsets[length as usize] += 1;
+            }
+        }
+        counts[0] = 0;
+
+        /* Codes are assigned in the order of the symbols, and are stored most
+        significant bit first, so the table is indexed by them reversed. */
+        let mut fast = vec![0; 1 << FAST_BITS];
+        let mut code = 0;
+        let mut index = 0;
+        for length in 1..(FAST_BITS as usize + 1) {
+            for &symbol in &symbols[index..index + counts[length] as usize] {
+                let reversed = (code as u32).reverse_bits() >> (32 - length);
+                for fill in 0..(1 << (FAST_BITS as usize - length)) {
+                    fast[reversed as usize | fill << length] = symbol << 4 | length as u16;
+                }
+                code += 1;
+            }
+            index += counts[length] as usize;
+            code <<= 1;
+        }
+        Ok(Huffman {
+            counts: counts,
+            symbols: symbols,
+            fast: fast,
+        })
+    }
+
+    fn decode(&self, reader: &mut BitReader) -> io::Result<u16> {
+        let entry = self.fast[reader.peek(FAST_BITS) as usize];
+        if entry != 0 {
+            try!(reader.consume(entry as u32 & 15));
+            return Ok(entry >> 4);
+        }
+        self.decode_slow(reader)
+    }
+
+    /// Decodes one symbol, reading the code bit by bit.
+    fn decode_slow(&self, reader: &mut BitReader) -> io::Result<u16> {
+        let mut code: i32 = 0;
+        let mut first: i32 = 0;
+        let mut index: i32 = 0;
+        for length in 1..(MAX_BITS + 1) {
+            code |= try!(reader.bits(1)) as i32;
+            let count = self.counts[length] as i32;
+            if code - count < first {
+                return Ok(self.symbols[(index + code - first) as usize]);
+            }
+            index += count;
+            first += count;
+            first <<= 1;
+            code <<= 1;
+        }
+        Err(invalid("invalid Huffman code"))
+    }
+}
+
+/// Reads bits from a byte slice, least significant bit first. Whole bytes are
+/// read ahead into a 64 bit buffer.
+struct BitReader<'a> {
+    data: &'a [u8],
+    pos: usize,
+    bit: u64,
+    bitcount: u32,
+}
+
+impl<'a> BitReader<'a> {
+    fn new(data: &'a [u8]) -> BitReader<'a> {
+        BitReader {
+            data: data,
+            pos: 0,
+            bit: 0,
+            bitcount: 0,
+        }
+    }
+
+    fn refill(&mut self) {
+        while self.bitcount <= 56 && self.pos < self.data.len() {
+            self.bit |= (self.data[self.pos] as u64) << self.bitcount;
+            self.pos += 1;
+            self.bitcount += 8;
+        }
+    }
+
+    /// The next `need` bits without consuming them, with zeros past the end of
+    /// the input.
+    fn peek(&mut self, need: u32) -> u32 {
+        if self.bitcount < need {
+            self.refill();
+        }
+        (self.bit & ((1u64 << need) - 1)) as u32
+    }
+
+    fn consume(&mut self, count: u32) -> io::Result<()> {
+        if count > self.bitcount {
+            return Err(invalid("unexpected end of deflate stream"));
+        }
+        self.bit >>= count;
+        self.bitcount -= count;
+        Ok(())
+    }
+
+    fn bits(&mut self, need: u32) -> io::Result<u32> {
+        let val = self.peek(need);
+        try!(self.consume(need));
+        Ok(val)
+    }
+
+    /// Drops the remaining bits of the current byte, and returns whole bytes
+    /// that were read ahead to the input.
+    fn align(&mut self) {
+        self.pos -= (self.bitcount / 8) as usize;
+        self.bit = 0;
+        self.bitcount = 0;
+    }
+
+    fn bytes(&mut self, len: usize) -> io::Result<&'a [u8]> {
+        debug_assert_eq!(self.bitcount, 0);
+        if self.pos + len > self.data.len() {
+            return Err(invalid("unexpected end of deflate stream"));
+        }
+        let bytes = &self.data[self.pos..(self.pos + len)];
+        self.pos += len;
+        Ok(bytes)
+    }
+
+    /// Number of bytes of input consumed, counting a partially read byte.
+    fn bytes_used(&self) -> usize {
+        self.pos - (self.bitcount / 8) as usize
+    }
+}
+
+#[cfg(test)]
+mod test {
+    use super::*;
+    use deflate::{deflate, BlockType};
+    use Options;
+
+    #[test]
+    fn round_trips_each_block_type() {
+        let data: Vec<u8> = b"Ceci n'est pas une pipe. ".iter().cycle().take(5000).cloned().collect();
+        for &btype in &[BlockType::Uncompressed, BlockType::Fixed, BlockType::Dynamic] {
+            let mut compressed = vec![];
+            deflate(&Options::default(), btype, &data, &mut compressed).unwrap();
+            let mut lz77 = Lz77Store::new();
+            let (decoded, used) = inflate_into(&compressed, Some(&mut lz77)).unwrap();
+            assert_eq!(decoded, data);
+            assert_eq!(used, compressed.len());
+            assert_eq!(lz77.get_byte_range(0, lz77.size()), data.len());
+        }
+    }
+
+    #[test]
+    fn verify_catches_corrupted_output() {
+        let data: Vec<u8> = (0..20000u32).map(|i| (i * i / 7) as u8).collect();
+        let mut compressed = vec![];
+        ::compress(&Options::default(), &Format::Gzip, &data, &mut compressed).unwrap();
+        assert!(verify(&Format::Gzip, &compressed, &data).is_ok());
+        assert!(verify(&Format::Gzip, &compressed, &data[1..]).is_err());
+        let middle = compressed.len() / 2;
+        compressed[middle] ^= 4;
+        assert!(verify(&Format::Gzip, &compressed, &data).is_err());
+    }
+
+    #[test]
+    fn rejects_truncated_streams() {
+        let mut compressed = vec![];
+        deflate(&Options::default(), BlockType::Dynamic, b"hello hello hello hello", &mut compressed).unwrap();
+        compressed.pop();
+        assert!(inflate_into(&compressed, None).is_err());
+        for format in &[Format::Gzip, Format::Zlib, Format::Deflate] {
+            assert!(verify(format, &[], b"x").is_err());
+            assert!(verify(format, &[0x78], b"x").is_err());
+        }
+    }
+}
@@ -0,0 +1,140 @@
+//! Entry points into the hot kernels and the stages of the compressor, for the
+//! benchmarks in benches/. Only built with the `bench` feature, and not a stable
+//! interface: each function does one unit of work on the input it is given, and
+//! returns something derived from the result so that it can't be optimized away.
+
+use std::io;
+
+use blocksplitter::blocksplit_lz77;
+use deflate::{self, add_all_blocks, BitwiseWriter};
+use hash::{Which, ZopfliHash};
+use katajainen;
+use lz77::{self as lz77_mod, Lz77Store, ZopfliBlockState};
+use squeeze::{self, get_cost_fixed, lz77_optimal};
+use util::{ZOPFLI_MASTER_BLOCK_SIZE, ZOPFLI_MAX_MATCH};
+use Options;
+
+/// LZ77 data of one master block, as the stages hand it to each other.
+pub struct Lz77 {
+    store: Lz77Store,
+}
+
+impl Lz77 {
+    /// Number of literals and matches.
+    pub fn size(&self) -> usize {
+        self.store.size()
+    }
+}
+
+/// The part of `data` that is compressed as one master block.
+fn master_block(data: &[u8]) -> &[u8] {
+    &data[..data.len().min(ZOPFLI_MASTER_BLOCK_SIZE)]
+}
+
+/// `ZopfliHash::update` at every position of `data`.
+pub fn hash_update(data: &[u8]) -> u16 {
+    let mut h = ZopfliHash::new();
+    h.warmup(data, 0, data.len());
+    for i in 0..data.len() {
+        h.update(data, i);
+    }
+    h.val(Which::Hash1)
+}
+
+/// `find_longest_match` without a cache at every position of `data`. Returns the
+/// sum of the lengths found.
+pub fn find_longest_match(options: &Options, data: &[u8]) -> usize {
+    let data = master_block(data);
+    let mut s = ZopfliBlockState::new_without_cache(options, 0, data.len());
+    let mut h = ZopfliHash::new();
+    h.warmup(data, 0, data.len());
+    let mut total = 0;
+    for i in 0..data.len() {
+        h.update(data, i);
+        total += lz77_mod::find_longest_match(&mut s, &mut h, data, i, data.len(), ZOPFLI_MAX_MATCH, &mut None).length as usize;
+    }
+    total
+}
+
+/// One forward pass of the squeeze, `get_best_lengths`, over `data` with the
+/// fixed tree cost model and a fresh longest match cache. Returns the cost.
+pub fn get_best_lengths(options: &Options, data: &[u8]) -> f64 {
+    let data = master_block(data);
+    let mut s = ZopfliBlockState::new(options, 0, data.len());
+    let mut h = ZopfliHash::new();
+    let mut costs = Vec::with_capacity(data.len() + 1);
+    squeeze::get_best_lengths(&mut s, data, 0, data.len(), get_cost_fixed, &mut h, &mut costs).0
+}
+
+/// `length_limited_code_lengths` of `frequencies`.
+pub fn length_limited_code_lengths(frequencies: &[usize], max_bits: usize) -> Vec<u32> {
+    katajainen::length_limited_code_lengths(frequencies, max_bits)
+}
+
+/// `calculate_tree_size` of the code lengths of a block.
+pub fn calculate_tree_size(ll_lengths: &[u32], d_lengths: &[u32]) -> usize {
+    deflate::calculate_tree_size(ll_lengths, d_lengths)
+}
+
+/// `get_histogram` of every range of `step` symbols of `lz77`. Returns the number
+/// of literals and lengths counted.
+pub fn get_histogram(lz77: &Lz77, step: usize) -> usize {
+    let mut total = 0;
+    let mut start = 0;
+    while start < lz77.size() {
+        let end = (start + step).min(lz77.size());
+        let (ll_counts, _) = lz77.store.get_histogram(start, end);
+        total += ll_counts.iter().sum::<usize>();
+        start = end;
+    }
+    total
+}
+
+/// Adds each `(symbol, length)` with `BitwiseWriter::add_bits` and then with
+/// `add_huffman_bits`. Returns the bytes written.
+pub fn bitwise_writer(symbols: &[(u32, u32)]) -> io::Result<Vec<u8>> {
+    let mut writer = BitwiseWriter::new(Vec::with_capacity(symbols.len() * 2));
+    for &(symbol, length) in symbols {
+        try!(writer.add_bits(symbol, length));
+        try!(writer.add_huffman_bits(symbol, length));
+    }
+    try!(writer.finish_partial_bits());
+    Ok(writer.into_inner())
+}
+
+/// Stage: the greedy LZ77 with lazy matching, as used for block splitting.
+pub fn greedy(options: &Options, data: &[u8]) -> Lz77 {
+    let data = master_block(data);
+    let mut store = Lz77Store::new();
+    let mut s = ZopfliBlockState::new_without_cache(options, 0, data.len());
+    store.greedy(&mut s, data, 0, data.len());
+    Lz77 {
+        store: store,
+    }
+}
+
+/// Stage: the squeeze, `options.numiterations` rounds of `lz77_optimal` on
+/// `data` as a single block.
+pub fn squeeze(options: &Options, data: &[u8]) -> Lz77 {
+    let data = master_block(data);
+    let mut s = ZopfliBlockState::new(options, 0, data.len());
+    Lz77 {
+        store: lz77_optimal(&mut s, data, 0, data.len(), options.numiterations, None),
+    }
+}
+
+/// Stage: the block split search on LZ77 data. Returns the split points.
+pub fn blocksplit(options: &Options, lz77: &Lz77) -> Vec<usize> {
+    let mut splitpoints = Vec::with_capacity(options.blocksplittingmax as usize);
+    blocksplit_lz77(options, &lz77.store, options.blocksplittingmax as usize, &mut splitpoints);
+    splitpoints
+}
+
+/// Stage: choosing the block types, building the trees and writing the blocks of
+/// LZ77 data of `data`. Returns the deflate stream.
+pub fn emit(options: &Options, data: &[u8], lz77: &Lz77, splitpoints: &[usize]) -> io::Result<Vec<u8>> {
+    let mut writer = BitwiseWriter::new(vec![]);
+    try!(add_all_blocks(splitpoints, &lz77.store, options, true, master_block(data), &mut writer));
+    try!(writer.finish_partial_bits());
+    Ok(writer.into_inner())
+}
@@ -5,43 +5,148 @@ extern crate byteorder;
 extern crate crc;
 extern crate typed_arena;
 
+#[macro_use]
+mod trace;
 mod iter;
 mod blocksplitter;
 mod cache;
+mod cancel;
+mod capi;
+mod checkpoint;
+#[cfg(unix)]
+mod daemon;
 mod deflate;
+mod executor;
+mod farm;
 mod gzip;
 mod hash;
+mod inflate;
 mod katajainen;
+#[cfg(feature = "bench")]
+#[doc(hidden)]
+pub mod kernels;
 mod lz77;
+mod png;
+mod predict;
+mod prior;
+mod recompress;
+mod refine;
+mod result_cache;
+mod sha256;
 mod squeeze;
+mod stream;
 mod symbols;
 mod tree;
+mod tune;
 mod util;
 mod zlib;
+#[cfg(feature = "zlib-shim")]
+mod zlib_shim;
 
 use std::io::{self, Write};
+use std::sync::Arc;
 
 use deflate::{deflate, BlockType};
-use gzip::gzip_compress;
-use zlib::zlib_compress;
+use gzip::{gzip_compress, gzip_wrap};
+use util::{ZOPFLI_CACHE_LENGTH, ZOPFLI_MASTER_BLOCK_SIZE, ZOPFLI_MAX_CHAIN_HITS};
+use zlib::{zlib_compress, zlib_wrap};
+
+pub use cancel::{is_cancelled, memory_plan, CancelToken, Cancelled, MemoryPlan};
+pub use checkpoint::{compress_incremental, compress_resumable};
+#[cfg(unix)]
+pub use daemon::{Daemon, DaemonClient, DaemonStats, Job, JobInput};
+pub use executor::{Executor, Task, ThreadExecutor};
+pub use inflate::verify;
+pub use farm::{compress_distributed, BlockWorker};
+pub use png::{optimize_png, FilterStrategy, PngOptions};
+pub use predict::{predict, Prediction};
+pub use prior::{ContentClass, PriorSet, StatsPrior};
+pub use recompress::{recompress, reoptimize};
+pub use refine::{refine_progressively, Refiner};
+pub use result_cache::{CacheKey, CacheStats, ResultCache};
+pub use stream::Encoder;
+#[cfg(feature = "trace")]
+pub use trace::write_chrome_trace;
+pub use tune::{autotune, Profile, ProfileSet, Trial, Tuning};
 
 /// Options used throughout the program.
+#[derive(Clone)]
 pub struct Options {
-  /* Whether to print output */
+  /* Whether to print output, to stderr */
   pub verbose: bool,
   /* Whether to print more detailed output */
-  verbose_more: bool,
+  pub verbose_more: bool,
   /*
   Maximum amount of times to rerun forward and backward pass to optimize LZ77
   compression cost. Good values: 10, 15 for small files, 5 for files over
-  several MB in size or it will be too slow.
+  several MB in size or it will be too slow. 0 skips the optimization and keeps
+  the fast greedy LZ77.
   */
-  numiterations: i32,
+  pub numiterations: i32,
   /*
   Maximum amount of blocks to split into (0 for unlimited, but this can give
   extreme results that hurt compression on some files). Default value: 15.
   */
-  blocksplittingmax: i32,
+  pub blocksplittingmax: i32,
+  /*
+  Most positions with the same hash that are tried when looking for the longest
+  match. Lower is faster on files where the same hash occurs very often, but
+  compresses worse there. Default value: 8192.
+  */
+  pub max_chain_hits: usize,
+  /*
+  Distances kept per position of a block in the longest match cache, at three
+  bytes each. More makes the squeeze faster, but takes more memory. Between 1
+  and 256. Default value: 8.
+  */
+  pub cache_length: usize,
+  /*
+  Recommended options per content class, as made by `autotune`. The one for the
+  class of the input, guessed when not given, replaces the numbers above.
+  */
+  pub profiles: Option<Arc<ProfileSet>>,
+  /*
+  Learned symbol statistics per content class, blended into the initial cost
+  model of every block to make it converge in fewer iterations.
+  */
+  pub priors: Option<Arc<PriorSet>>,
+  /*
+  Which of the priors to use. Guessed from the data when not given.
+  */
+  pub content_class: Option<ContentClass>,
+  /*
+  Skip the squeeze, keeping the greedy LZ77, if it is predicted to save less
+  than this fraction compared to zlib at level 9. 0.0 always squeezes.
+  */
+  pub min_predicted_gain: f64,
+  /*
+  Runs the parallel stages: master blocks, the blocks they are split into and
+  the samples of a prediction. None runs everything on the calling thread. The
+  output is the same either way.
+  */
+  pub executor: Option<Arc<dyn Executor>>,
+  /*
+  Cancelling this token makes the compression stop soon with an error for which
+  is_cancelled() is true. The output written until then is incomplete.
+  */
+  pub cancel: Option<CancelToken>,
+  /*
+  Stop squeezing once this many squeeze iterations ran in total, over all
+  blocks, keeping the best LZ77 found so far. They are counted on the cancel
+  token, so a token shared by several compressions limits them together.
+  */
+  pub max_iterations: Option<usize>,
+  /*
+  Estimated working memory in bytes to stay below. Fewer master blocks are
+  compressed at once, then the cache length and then the master blocks are made
+  smaller to fit, see memory_plan(). Only the last changes the output.
+  */
+  pub max_memory: Option<usize>,
+  /*
+  Outputs of earlier compressions, returned instead of compressing an input
+  again with the same options. New outputs are added to it.
+  */
+  pub cache: Option<Arc<ResultCache>>,
 }
 
 impl Default for Options {
@@ -51,22 +156,131 @@ impl Default for Options {
             verbose_more: false,
             numiterations: 15,
             blocksplittingmax: 15,
+            max_chain_hits: ZOPFLI_MAX_CHAIN_HITS,
+            cache_length: ZOPFLI_CACHE_LENGTH,
+            profiles: None,
+            priors: None,
+            content_class: None,
+            min_predicted_gain: 0.0,
+            executor: None,
+            cancel: None,
+            max_iterations: None,
+            max_memory: None,
+            cache: None,
         }
     }
 }
 
+impl Options {
+    /// The prior for this input's content class and its weight, if there is one.
+    fn prior(&self) -> Option<(&StatsPrior, f64)> {
+        match (self.priors.as_ref(), self.content_class) {
+            (Some(priors), Some(class)) => priors.get(class).map(|prior| (prior, priors.weight)),
+            _ => None,
+        }
+    }
+
+    /// These options with the content class of `in_data` guessed, if priors or
+    /// profiles need it, and its profile applied.
+    fn for_input(&self, in_data: &[u8]) -> Options {
+        let mut options = self.clone();
+        if (options.priors.is_some() || options.profiles.is_some()) && options.content_class.is_none() {
+            options.content_class = ContentClass::sniff(in_data);
+        }
+        if let Some(profiles) = self.profiles.as_ref() {
+            if let Some(profile) = profiles.get(options.content_class) {
+                profile.apply(&mut options);
+            }
+        }
+        options
+    }
+
+    fn is_cancelled(&self) -> bool {
+        self.cancel.as_ref().map_or(false, |cancel| cancel.is_cancelled())
+    }
+
+    fn check_cancelled(&self) -> io::Result<()> {
+        if self.is_cancelled() {
+            Err(cancel::cancelled_error())
+        } else {
+            Ok(())
+        }
+    }
+
+    /// Whether another squeeze iteration may run, counting it if so.
+    fn take_iteration(&self) -> bool {
+        match self.cancel {
+            Some(ref cancel) => !cancel.is_cancelled() && cancel.take_iteration(self.max_iterations),
+            None => true,
+        }
+    }
+}
+
+#[derive(Copy, Clone, Debug, PartialEq)]
 pub enum Format {
     Gzip,
     Zlib,
     Deflate,
 }
 
-pub fn compress<W>(options: &Options, output_type: &Format, in_data: &[u8], out: W) -> io::Result<()>
+pub fn compress<W>(options: &Options, output_type: &Format, in_data: &[u8], mut out: W) -> io::Result<()>
     where W: Write
 {
+    if let Some(ref cache) = options.cache {
+        let key = CacheKey::new(options, output_type, in_data);
+        if let Some(compressed) = cache.get(&key) {
+            return out.write_all(&compressed);
+        }
+        let mut uncached = options.clone();
+        uncached.cache = None;
+        let mut compressed = vec![];
+        try!(compress(&uncached, output_type, in_data, &mut compressed));
+        // Not being able to store it doesn't make the output wrong
+        if let Err(why) = cache.put(&key, &compressed) {
+            if options.verbose {
+                eprintln!("couldn't store {} in the cache: {}", key, why);
+            }
+        }
+        return out.write_all(&compressed);
+    }
+
+    let options = &resolve_options(options, in_data);
     match *output_type {
         Format::Gzip => gzip_compress(options, in_data, out),
         Format::Zlib => zlib_compress(options, in_data, out),
         Format::Deflate => deflate(options, BlockType::Dynamic, in_data, out),
     }
 }
+
+/// The options `compress` uses for `in_data`: with its content class guessed and
+/// profile applied, a cancel token to count the iterations on, and without the
+/// squeeze if that isn't predicted to be worth it.
+fn resolve_options(options: &Options, in_data: &[u8]) -> Options {
+    let mut options = options.for_input(in_data);
+    if options.max_iterations.is_some() && options.cancel.is_none() {
+        options.cancel = Some(CancelToken::new());
+    }
+    if options.min_predicted_gain > 0.0 && options.numiterations > 0 {
+        let prediction = predict(&options, in_data, Some(ZOPFLI_MASTER_BLOCK_SIZE));
+        if prediction.expected_gain() < options.min_predicted_gain {
+            if options.verbose {
+                eprintln!("predicted gain {:.4}, not squeezing", prediction.expected_gain());
+            }
+            options.numiterations = 0;
+        }
+    }
+    options
+}
+
+/// Writes the header and trailer of `output_type` for `in_data` around the
+/// deflate stream that `body` writes.
+fn wrap_container<W, F>(output_type: &Format, in_data: &[u8], mut out: W, body: F) -> io::Result<()>
+    where W: Write,
+          F: FnOnce(&mut W) -> io::Result<()>
+{
+    match *output_type {
+        Format::Gzip => gzip_wrap(in_data, out, body),
+        Format::Zlib => zlib_wrap(in_data, out, body),
+        Format::Deflate => body(&mut out),
+    }
+}
@@ -3,7 +3,7 @@ use std::cmp;
 use cache::{ZopfliLongestMatchCache, Cache, NoCache};
 use hash::{ZopfliHash, Which};
 use symbols::{get_dist_symbol, get_length_symbol};
-use util::{ZOPFLI_NUM_LL, ZOPFLI_NUM_D, ZOPFLI_MAX_MATCH, ZOPFLI_MIN_MATCH, ZOPFLI_WINDOW_MASK, ZOPFLI_MAX_CHAIN_HITS, ZOPFLI_WINDOW_SIZE};
+use util::{ZOPFLI_NUM_LL, ZOPFLI_NUM_D, ZOPFLI_MAX_MATCH, ZOPFLI_MIN_MATCH, ZOPFLI_WINDOW_MASK, ZOPFLI_WINDOW_SIZE};
 use Options;
 
 #[derive(Clone, Debug, Copy)]
@@ -338,6 +338,42 @@ impl Lz77Store {
         let l = lend - 1;
         self.pos[l] + self.litlens[l].size() - self.pos[lstart]
     }
+
+    /// Returns the symbols covering the input bytes from `instart` to `inend` (not
+    /// inclusive). Matches that straddle either end are cut short, and become
+    /// literals if fewer than `ZOPFLI_MIN_MATCH` bytes of them are left.
+    pub fn slice_bytes(&self, in_data: &[u8], instart: usize, inend: usize) -> Lz77Store {
+        let mut store = Lz77Store::new();
+
+        // The first symbol that ends after instart.
+        let first = match self.pos.binary_search(&instart) {
+            Ok(i) => i,
+            Err(i) => i.saturating_sub(1),
+        };
+
+        for (&litlen, &pos) in self.litlens.iter().zip(self.pos.iter()).skip(first) {
+            if pos >= inend {
+                break;
+            }
+            let start = cmp::max(pos, instart);
+            let end = cmp::min(pos + litlen.size(), inend);
+            if start >= end {
+                continue;
+            }
+            match litlen {
+                LitLen::LengthDist(_, dist) if end - start >= ZOPFLI_MIN_MATCH => {
+                    store.lit_len_dist((end - start) as u16, dist, start);
+                },
+                LitLen::LengthDist(_, _) => {
+                    for i in start..end {
+                        store.lit_len_dist(in_data[i] as u16, 0, i);
+                    }
+                },
+                LitLen::Literal(_) => store.append_store_item(litlen, pos),
+            }
+        }
+        store
+    }
 }
 
 /// Some state information for compressing a block.
@@ -358,7 +394,7 @@ impl<'a> ZopfliBlockState<'a, ZopfliLongestMatchCache> {
             options: options,
             blockstart: blockstart,
             blockend: blockend,
-            lmc: ZopfliLongestMatchCache::new(blockend - blockstart),
+            lmc: ZopfliLongestMatchCache::new(blockend - blockstart, options.cache_length),
         }
     }
 }
@@ -465,7 +501,7 @@ pub fn find_longest_match<C>(s: &mut ZopfliBlockState<C>, h: &mut ZopfliHash, ar
         limit = size - pos;
     }
 
-    let (bestdist, bestlength) = find_longest_match_loop(h, array, pos, size, limit, sublen);
+    let (bestdist, bestlength) = find_longest_match_loop(h, array, pos, size, limit, s.options.max_chain_hits, sublen);
 
     s.store_in_longest_match_cache(pos, limit, sublen, bestdist as u16, bestlength as u16);
 
@@ -479,7 +515,7 @@ pub fn find_longest_match<C>(s: &mut ZopfliBlockState<C>, h: &mut ZopfliHash, ar
     longest_match
 }
 
-fn find_longest_match_loop(h: &mut ZopfliHash, array: &[u8], pos: usize, size: usize, limit: usize, sublen: &mut Option<&mut [u16]>) -> (i32, usize) {
+fn find_longest_match_loop(h: &mut ZopfliHash, array: &[u8], pos: usize, size: usize, limit: usize, max_chain_hits: usize, sublen: &mut Option<&mut [u16]>) -> (i32, usize) {
     let mut which_hash = Which::Hash1;
     let mut pp = h.head_at(h.val(which_hash) as usize, which_hash);  /* During the whole loop, p == hprev[pp]. */
     let mut p = h.prev_at(pp as usize, which_hash);
@@ -495,7 +531,7 @@ fn find_longest_match_loop(h: &mut ZopfliHash, array: &[u8], pos: usize, size: u
 
     let mut bestlength = 1;
     let mut bestdist = 0;
-    let mut chain_counter = ZOPFLI_MAX_CHAIN_HITS;  /* For quitting early. */
+    let mut chain_counter = max_chain_hits.max(1);  /* For quitting early. */
     let arrayend = pos + limit;
     let mut scan_offset;
     let mut match_offset;
@@ -1,16 +1,110 @@
+use std::collections::HashMap;
 use std::env;
 use std::io::prelude::*;
 use std::io::{self, BufWriter};
-use std::fs::File;
+use std::fs::{self, File};
+use std::process;
+use std::sync::Arc;
 
 extern crate zopfli;
 
+mod batch;
+mod bench;
+mod mmap;
+#[cfg(target_os = "linux")]
+mod uring;
+
+use batch::{BatchIo, Input};
+use mmap::Mmap;
+
 fn main() {
-    let options = zopfli::Options::default();
+    if env::args().nth(1).map_or(false, |arg| arg == "bench") {
+        bench::main(env::args().skip(2));
+        return;
+    }
+
+    let mut options = zopfli::Options::default();
+    options.executor = Some(Arc::new(zopfli::ThreadExecutor::new()));
     let output_type = zopfli::Format::Gzip;
 
-    // TODO: CLI arguments
-    // TODO: Allow specifying output to STDOUT
+    // TODO: More CLI arguments
+
+    let mut to_stdout = false;
+    let mut resumable = false;
+    let mut incremental = false;
+    let mut verify = false;
+    let mut png = None;
+    let mut workers = vec![];
+    let mut autotune = None;
+    let mut filenames = vec![];
+    #[cfg(feature = "trace")]
+    let mut _trace = None;
+    for arg in env::args().skip(1) {
+        match &arg[..] {
+            "-c" => to_stdout = true,
+            "-v" => options.verbose = true,
+            "--resumable" => resumable = true,
+            "--incremental" => incremental = true,
+            "--verify" => verify = true,
+            "--png" => png = Some(png.unwrap_or_else(zopfli::PngOptions::default)),
+            "--png-strip" => {
+                let mut png_options = png.unwrap_or_else(zopfli::PngOptions::default);
+                png_options.strip_ancillary = true;
+                png = Some(png_options);
+            }
+            "-h" => {
+                usage();
+                return;
+            }
+            "-" => filenames.push(arg),
+            _ if arg.starts_with("--daemon=") => {
+                serve(&options, &arg["--daemon=".len()..]);
+                return;
+            }
+            _ if arg.starts_with("--worker=") => {
+                let worker = zopfli::BlockWorker::bind(&arg["--worker=".len()..], &options)
+                    .unwrap_or_else(|why| panic!("couldn't listen on {}: {}", &arg["--worker=".len()..], why));
+                worker.run().unwrap_or_else(|why| panic!("couldn't accept connections: {}", why));
+                return;
+            }
+            _ if arg.starts_with("--workers=") => {
+                workers = arg["--workers=".len()..].split(',').map(|worker| worker.to_string()).collect();
+            }
+            "--autotune" => autotune = Some(AUTOTUNE_RATE),
+            _ if arg.starts_with("--autotune=") => {
+                autotune = Some(arg["--autotune=".len()..].parse().unwrap_or_else(|_| {
+                    eprintln!("invalid rate in {}", arg);
+                    process::exit(1);
+                }));
+            }
+            _ if arg.starts_with("--profiles=") => {
+                let path = &arg["--profiles=".len()..];
+                let profiles = fs::read_to_string(path)
+                    .and_then(|text| zopfli::ProfileSet::parse(&text))
+                    .unwrap_or_else(|why| panic!("couldn't load the profiles {}: {}", path, why));
+                options.profiles = Some(Arc::new(profiles));
+            }
+            _ if arg.starts_with("--max-memory=") => {
+                options.max_memory = Some(parse_size(&arg["--max-memory=".len()..]).unwrap_or_else(|| {
+                    eprintln!("invalid size in {}", arg);
+                    process::exit(1);
+                }));
+            }
+            _ if arg.starts_with("--cache=") => {
+                let cache = zopfli::ResultCache::open(&arg["--cache=".len()..], CACHE_SIZE)
+                    .unwrap_or_else(|why| panic!("couldn't open the cache {}: {}", &arg["--cache=".len()..], why));
+                options.cache = Some(Arc::new(cache));
+            }
+            #[cfg(feature = "trace")]
+            _ if arg.starts_with("--trace=") => _trace = Some(TraceFile(arg["--trace=".len()..].to_string())),
+            _ if arg.starts_with('-') => {
+                eprintln!("unknown option {}", arg);
+                usage();
+                process::exit(1);
+            }
+            _ => filenames.push(arg),
+        }
+    }
 
     let extension = match output_type {
         zopfli::Format::Gzip => ".gz",
@@ -18,15 +112,61 @@ fn main() {
         zopfli::Format::Deflate => ".deflate",
     };
 
-    for filename in env::args().skip(1) {
-        let mut file = File::open(&filename)
+    if let Some(png_options) = png {
+        optimize_pngs(&options, &png_options, filenames, to_stdout);
+        print_memory_statistics(&options);
+        return;
+    }
+
+    if let Some(min_rate) = autotune {
+        print_autotune(&options, &filenames, min_rate);
+        return;
+    }
+
+    if !workers.is_empty() && !to_stdout && filenames.iter().all(|filename| filename != "-") {
+        compress_files_distributed(&options, output_type, extension, filenames, &workers, verify);
+        print_memory_statistics(&options);
+        return;
+    }
+
+    if (resumable || incremental) && !to_stdout && filenames.iter().all(|filename| filename != "-") {
+        compress_files_checkpointed(&options, output_type, extension, filenames, incremental, verify);
+        print_memory_statistics(&options);
+        return;
+    }
+
+    // Many files are read and written in the background
+    if !to_stdout && filenames.iter().all(|filename| filename != "-") {
+        compress_files(&options, output_type, extension, filenames, verify);
+        print_cache_statistics(&options);
+        print_memory_statistics(&options);
+        return;
+    }
+
+    for filename in filenames {
+        // Standard input is always compressed to standard output
+        if filename == "-" {
+            let stdin = io::stdin();
+            let stdout = io::stdout();
+            let mut out = WriteStatistics::new(BufWriter::new(stdout.lock()));
+            let filesize = compress_input(&options, output_type, None, stdin.lock(), &mut out, verify)
+                .unwrap_or_else(|why| panic!("couldn't compress standard input: {}", why));
+            print_statistics(&options, filesize, out.count);
+            continue;
+        }
+
+        let file = File::open(&filename)
             .unwrap_or_else(|why| panic!("couldn't open {}: {}", filename, why));
-        let filesize = file.metadata().map(|x| x.len()).unwrap_or(0) as usize;
+        let mapped = Mmap::open(&file);
 
-        let mut data = Vec::with_capacity(filesize);
-        // Read the contents of the file into in_data; panic if the file could not be read
-        file.read_to_end(&mut data)
-            .unwrap_or_else(|why| panic!("couldn't read {}: {}", filename, why));
+        if to_stdout {
+            let stdout = io::stdout();
+            let mut out = WriteStatistics::new(BufWriter::new(stdout.lock()));
+            let filesize = compress_input(&options, output_type, mapped, file, &mut out, verify)
+                .unwrap_or_else(|why| panic!("couldn't compress {}: {}", filename, why));
+            print_statistics(&options, filesize, out.count);
+            continue;
+        }
 
         let out_filename = format!("{}{}", filename, extension);
 
@@ -35,13 +175,344 @@ fn main() {
             .unwrap_or_else(|why| panic!("couldn't create output file {}: {}", out_filename, why));
         let mut out_file = WriteStatistics::new(BufWriter::new(out_file));
 
-        zopfli::compress(&options, &output_type, &data, &mut out_file)
-            .unwrap_or_else(|why| panic!("couldn't write to output file {}: {}", out_filename, why));
+        let filesize = compress_input(&options, output_type, mapped, file, &mut out_file, verify)
+            .unwrap_or_else(|why| {
+                // Don't leave an incomplete stream behind
+                let _ = fs::remove_file(&out_filename);
+                panic!("couldn't compress {} to {}: {}", filename, out_filename, why)
+            });
+        print_statistics(&options, filesize, out_file.count);
+    }
+    print_cache_statistics(&options);
+    print_memory_statistics(&options);
+}
+
+/// Writes the spans recorded by the library to a file for `--trace` when dropped,
+/// at the end of main.
+#[cfg(feature = "trace")]
+struct TraceFile(String);
+
+#[cfg(feature = "trace")]
+impl Drop for TraceFile {
+    fn drop(&mut self) {
+        let file = File::create(&self.0)
+            .unwrap_or_else(|why| panic!("couldn't create the trace {}: {}", self.0, why));
+        zopfli::write_chrome_trace(BufWriter::new(file))
+            .unwrap_or_else(|why| panic!("couldn't write the trace {}: {}", self.0, why));
+    }
+}
+
+/// Bytes that one more CPU second must save for `--autotune` to spend it.
+const AUTOTUNE_RATE: f64 = 100.0;
+/// Largest size of the cache in bytes.
+const CACHE_SIZE: u64 = 1 << 30;
+/// Most bytes of outputs kept to be reused for duplicate inputs.
+const DUPLICATES_SIZE: usize = 64 * 1024 * 1024;
+
+fn usage() {
+    eprintln!("Usage: zopfli [OPTION]... FILE...");
+    eprintln!("       zopfli bench [OPTION]... PATH...");
+    eprintln!("Compresses each FILE to FILE.gz, or standard input to standard output if FILE is -.");
+    eprintln!("See zopfli bench -h for benchmarking.");
+    eprintln!("  -c             write the result to standard output instead of to files");
+    eprintln!("  -v             print statistics");
+    eprintln!("  --verify       decode each output and check it against its FILE");
+    eprintln!("  --png          optimize each PNG FILE to FILE.zopfli.png instead, trying");
+    eprintln!("                 several filters and compressing the best with Zopfli");
+    eprintln!("  --png-strip    like --png, and drop the chunks that don't change the pixels");
+    eprintln!("  --max-memory=SIZE");
+    eprintln!("                 keep the estimated working memory below SIZE bytes, or");
+    eprintln!("                 with a K, M or G suffix, by compressing less at once");
+    eprintln!("  --cache=DIR    reuse the output of inputs compressed before, kept in DIR");
+    eprintln!("  --profiles=FILE");
+    eprintln!("                 use the options recommended in FILE for the content of each");
+    eprintln!("                 FILE");
+    eprintln!("  --autotune[=RATE]");
+    eprintln!("                 instead of compressing, try options on samples of the FILEs");
+    eprintln!("                 and print profiles of those that save RATE bytes per CPU");
+    eprintln!("                 second or more (default 100), for --profiles");
+    eprintln!("  --resumable    keep FILE.gz.checkpoint while compressing, and continue from");
+    eprintln!("                 it if an earlier run was interrupted");
+    eprintln!("  --incremental  keep FILE.gz.index, to only compress what was appended to");
+    eprintln!("                 FILE since the last run");
+    eprintln!("  --daemon=SOCK  compress the jobs of zopfli-client sent to the socket SOCK,");
+    eprintln!("                 with the options given before it");
+    eprintln!("  --worker=ADDR  compress the master blocks that zopfli --workers=ADDR sends to");
+    eprintln!("                 the TCP address ADDR");
+    eprintln!("  --workers=ADDR,...");
+    eprintln!("                 have the master blocks of each FILE compressed by the");
+    eprintln!("                 workers at these addresses");
+    #[cfg(feature = "trace")]
+    eprintln!("  --trace=FILE   write the spans of the compression stages to FILE, in the");
+    #[cfg(feature = "trace")]
+    eprintln!("                 Chrome trace event format");
+    eprintln!("  -h             show this help");
+}
+
+#[cfg(unix)]
+fn serve(options: &zopfli::Options, socket: &str) {
+    let threads = std::thread::available_parallelism().map_or(1, |n| n.get());
+    let daemon = zopfli::Daemon::bind(socket, options, threads)
+        .unwrap_or_else(|why| panic!("couldn't listen on {}: {}", socket, why));
+    daemon.run().unwrap_or_else(|why| panic!("couldn't accept connections on {}: {}", socket, why));
+}
+
+#[cfg(not(unix))]
+fn serve(_: &zopfli::Options, _: &str) {
+    eprintln!("--daemon needs Unix domain sockets");
+    process::exit(1);
+}
+
+/// Compresses each file to one of its own, while a `BatchIo` thread reads the
+/// next files and writes the finished ones.
+///
+/// With `verify`, each output is decoded and checked before it is handed to
+/// the thread, while it still writes the ones before.
+fn compress_files(options: &zopfli::Options, output_type: zopfli::Format, extension: &str, filenames: Vec<String>, verify: bool) {
+    let batch = BatchIo::start(filenames.clone());
+    let mut duplicates = Duplicates::default();
+    for filename in filenames {
+        let input = batch.next_input()
+            .unwrap_or_else(|why| panic!("couldn't open {}: {}", filename, why));
+        let out_filename = format!("{}{}", filename, extension);
+
+        let compressed = match input {
+            Input::Data(data) => duplicates.compress(options, output_type, &data).map(|out| {
+                if verify {
+                    check_output(output_type, &out, &data, &out_filename);
+                }
+                (data.len(), out)
+            }),
+            Input::Mapped(data) => duplicates.compress(options, output_type, &data).map(|out| {
+                if verify {
+                    check_output(output_type, &out, &data, &out_filename);
+                }
+                (data.len(), out)
+            }),
+            Input::Stream(file) => {
+                // Could be endless, so it is written as it is compressed
+                let out_file = File::create(&out_filename)
+                    .unwrap_or_else(|why| panic!("couldn't create output file {}: {}", out_filename, why));
+                let mut out_file = WriteStatistics::new(BufWriter::new(out_file));
+                let filesize = compress_input(options, output_type, None, file, &mut out_file, verify)
+                    .unwrap_or_else(|why| {
+                        let _ = fs::remove_file(&out_filename);
+                        panic!("couldn't compress {} to {}: {}", filename, out_filename, why)
+                    });
+                print_statistics(options, filesize, out_file.count);
+                continue;
+            }
+        };
+        let (filesize, out) = compressed
+            .unwrap_or_else(|why| panic!("couldn't compress {} to {}: {}", filename, out_filename, why));
+        print_statistics(options, filesize, out.len());
+        batch.write(out_filename, out);
+    }
+    batch.finish()
+        .unwrap_or_else(|why| panic!("{}", why));
+}
+
+/// Compresses the input straight from its memory map if it could be mapped.
+/// Anything else, like a pipe, is streamed through the encoder a master block at
+/// a time, so memory use doesn't grow with its size. Returns the input size.
+/// With `verify`, the output of a mapped input is checked before it is written;
+/// that of a stream is not, as neither can be kept whole.
+fn compress_input<R, W>(options: &zopfli::Options, output_type: zopfli::Format, mapped: Option<Mmap>, mut input: R, mut out: W, verify: bool) -> io::Result<usize>
+    where R: Read,
+          W: Write
+{
+    let size = match mapped {
+        Some(ref data) if verify => {
+            let mut compressed = vec![];
+            try!(zopfli::compress(options, &output_type, data, &mut compressed));
+            try!(zopfli::verify(&output_type, &compressed, data));
+            try!(out.write_all(&compressed));
+            data.len()
+        }
+        Some(data) => {
+            try!(zopfli::compress(options, &output_type, &data, &mut out));
+            data.len()
+        }
+        None => {
+            if verify {
+                eprintln!("The output of a stream can't be verified");
+            }
+            let mut encoder = try!(zopfli::Encoder::new(options, output_type, &mut out));
+            let size = try!(io::copy(&mut input, &mut encoder));
+            try!(encoder.finish());
+            size as usize
+        }
+    };
+    try!(out.flush());
+    Ok(size)
+}
+
+/// Compresses each file to one of its own one after another, checkpointing
+/// after every master block so that an interrupted run can be continued. If
+/// `incremental`, all the checkpoints are kept, so that the next run only has
+/// to compress what was appended.
+fn compress_files_checkpointed(options: &zopfli::Options, output_type: zopfli::Format, extension: &str, filenames: Vec<String>, incremental: bool, verify: bool) {
+    for filename in filenames {
+        let file = File::open(&filename)
+            .unwrap_or_else(|why| panic!("couldn't open {}: {}", filename, why));
+        let mapped = Mmap::open(&file);
+        let mut contents = vec![];
+        let data = match mapped {
+            Some(ref data) => &data[..],
+            None => {
+                (&file).read_to_end(&mut contents)
+                    .unwrap_or_else(|why| panic!("couldn't read {}: {}", filename, why));
+                &contents[..]
+            }
+        };
+        let out_filename = format!("{}{}", filename, extension);
+        let compressed = if incremental {
+            let index = format!("{}.index", out_filename);
+            zopfli::compress_incremental(options, output_type, data, &out_filename, &index).map(|reused| {
+                if options.verbose {
+                    eprintln!("Reused the output of {} bytes", reused);
+                }
+            })
+        } else {
+            let checkpoint = format!("{}.checkpoint", out_filename);
+            zopfli::compress_resumable(options, output_type, data, &out_filename, &checkpoint)
+        };
+        compressed
+            .unwrap_or_else(|why| panic!("couldn't compress {} to {}: {}", filename, out_filename, why));
+        if verify {
+            // Parts of it may come from earlier runs, so it is read back whole
+            let out = fs::read(&out_filename)
+                .unwrap_or_else(|why| panic!("couldn't read {}: {}", out_filename, why));
+            check_output(output_type, &out, data, &out_filename);
+        }
+        let out_size = fs::metadata(&out_filename).map(|metadata| metadata.len() as usize).unwrap_or(0);
+        print_statistics(options, data.len(), out_size);
+    }
+}
 
+/// Prints the profiles `autotune` recommends for the files, and with -v what
+/// each trial cost and saved.
+fn print_autotune(options: &zopfli::Options, filenames: &[String], min_rate: f64) {
+    let inputs: Vec<Vec<u8>> = filenames.iter().map(|filename| {
+        fs::read(filename).unwrap_or_else(|why| panic!("couldn't read {}: {}", filename, why))
+    }).collect();
+    let tunings = zopfli::autotune(options, inputs.iter().map(|input| &input[..]), min_rate);
+    let mut profiles = zopfli::ProfileSet::new();
+    for tuning in tunings {
         if options.verbose {
-            let out_size = out_file.count;
-            println!("Original Size: {}, Compressed: {}, Compression: {}% Removed", filesize, out_size, 100.0 * (filesize - out_size) as f64 / filesize as f64);
+            eprintln!("{}: {} bytes of samples", tuning.class.map_or("other", |class| class.name()), tuning.sample_size);
+            for trial in &tuning.trials {
+                let p = trial.profile;
+                eprintln!("  i{} b{} chain {} cache {}: {} bytes in {:.3}s", p.numiterations, p.blocksplittingmax, p.max_chain_hits, p.cache_length, trial.size, trial.seconds);
+            }
+        }
+        profiles.insert(tuning.class, tuning.profile);
+    }
+    print!("{}", profiles.serialize());
+}
+
+/// Optimizes each PNG file with `optimize_png`, to NAME.zopfli.png for NAME.png.
+fn optimize_pngs(options: &zopfli::Options, png_options: &zopfli::PngOptions, filenames: Vec<String>, to_stdout: bool) {
+    for filename in filenames {
+        let png = fs::read(&filename)
+            .unwrap_or_else(|why| panic!("couldn't read {}: {}", filename, why));
+        let mut out = vec![];
+        zopfli::optimize_png(options, png_options, &png, &mut out)
+            .unwrap_or_else(|why| panic!("couldn't optimize {}: {}", filename, why));
+        if to_stdout {
+            let stdout = io::stdout();
+            stdout.lock().write_all(&out)
+                .unwrap_or_else(|why| panic!("couldn't write {}: {}", filename, why));
+        } else {
+            let stem = filename.strip_suffix(".png").unwrap_or(&filename);
+            let out_filename = format!("{}.zopfli.png", stem);
+            fs::write(&out_filename, &out)
+                .unwrap_or_else(|why| panic!("couldn't write output file {}: {}", out_filename, why));
         }
+        print_statistics(options, png.len(), out.len());
+    }
+}
+
+/// Compresses each file with `compress_distributed`, one after another.
+fn compress_files_distributed(options: &zopfli::Options, output_type: zopfli::Format, extension: &str, filenames: Vec<String>, workers: &[String], verify: bool) {
+    for filename in filenames {
+        let data = fs::read(&filename)
+            .unwrap_or_else(|why| panic!("couldn't read {}: {}", filename, why));
+        let mut out = vec![];
+        zopfli::compress_distributed(options, &output_type, &data, workers, &mut out)
+            .unwrap_or_else(|why| panic!("couldn't compress {}: {}", filename, why));
+        let out_filename = format!("{}{}", filename, extension);
+        if verify {
+            check_output(output_type, &out, &data, &out_filename);
+        }
+        fs::write(&out_filename, &out)
+            .unwrap_or_else(|why| panic!("couldn't write output file {}: {}", out_filename, why));
+        print_statistics(options, data.len(), out.len());
+    }
+}
+
+/// Panics unless `out` decodes to `data`.
+fn check_output(output_type: zopfli::Format, out: &[u8], data: &[u8], out_filename: &str) {
+    zopfli::verify(&output_type, out, data)
+        .unwrap_or_else(|why| panic!("the output {} is wrong: {}", out_filename, why));
+}
+
+/// Outputs of the inputs compressed so far, to compress the same file only
+/// once when it is given several times, up to `DUPLICATES_SIZE` bytes.
+#[derive(Default)]
+struct Duplicates {
+    outputs: HashMap<zopfli::CacheKey, Vec<u8>>,
+    size: usize,
+}
+
+impl Duplicates {
+    fn compress(&mut self, options: &zopfli::Options, output_type: zopfli::Format, data: &[u8]) -> io::Result<Vec<u8>> {
+        let key = zopfli::CacheKey::new(options, &output_type, data);
+        if let Some(out) = self.outputs.get(&key) {
+            return Ok(out.clone());
+        }
+        let mut out = vec![];
+        try!(zopfli::compress(options, &output_type, data, &mut out));
+        if self.size + out.len() <= DUPLICATES_SIZE {
+            self.size += out.len();
+            self.outputs.insert(key, out.clone());
+        }
+        Ok(out)
+    }
+}
+
+fn print_cache_statistics(options: &zopfli::Options) {
+    if let (true, Some(cache)) = (options.verbose, options.cache.as_ref()) {
+        let stats = cache.stats();
+        eprintln!("Cache hits: {}, misses: {}, evictions: {}, size: {}", stats.hits, stats.misses, stats.evictions, stats.size);
+    }
+}
+
+/// With -v and --max-memory, how much memory was used at most.
+fn print_memory_statistics(options: &zopfli::Options) {
+    if let (true, Some(max_memory)) = (options.verbose, options.max_memory) {
+        match bench::peak_rss() {
+            Some(peak) => eprintln!("Peak memory: {} bytes, limit: {}", peak, max_memory),
+            None => eprintln!("Peak memory: unknown, limit: {}", max_memory),
+        }
+    }
+}
+
+/// A number of bytes, optionally followed by K, M or G for binary multiples.
+fn parse_size(size: &str) -> Option<usize> {
+    let (number, shift) = match size.chars().last() {
+        Some('K') | Some('k') => (&size[..size.len() - 1], 10),
+        Some('M') | Some('m') => (&size[..size.len() - 1], 20),
+        Some('G') | Some('g') => (&size[..size.len() - 1], 30),
+        _ => (size, 0),
+    };
+    number.parse::<usize>().ok().and_then(|number| number.checked_mul(1 << shift))
+}
+
+fn print_statistics(options: &zopfli::Options, filesize: usize, out_size: usize) {
+    // Standard error, standard output may have the compressed data
+    if options.verbose {
+        eprintln!("Original Size: {}, Compressed: {}, Compression: {}% Removed", filesize, out_size, 100.0 * (filesize as f64 - out_size as f64) / filesize as f64);
     }
 }
 
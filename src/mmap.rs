@@ -0,0 +1,85 @@
+//! Read-only memory maps of the files the command compresses, so their contents
+//! are read straight from the page cache instead of being copied into memory of
+//! our own first.
+
+use std::fs::File;
+use std::ops::Deref;
+
+pub struct Mmap {
+    ptr: *mut u8,
+    len: usize,
+}
+
+impl Mmap {
+    /// Maps all of `file`, telling the kernel it will be read from start to end.
+    /// Returns `None` for anything that can't be mapped, like pipes, empty
+    /// files or when mapping fails, which has to be read in another way.
+    ///
+    /// The file must not be truncated or changed while it is mapped.
+    #[cfg(unix)]
+    pub fn open(file: &File) -> Option<Mmap> {
+        use std::os::unix::io::AsRawFd;
+        use std::ptr;
+
+        let metadata = match file.metadata() {
+            Ok(metadata) => metadata,
+            Err(_) => return None,
+        };
+        if !metadata.is_file() || metadata.len() == 0 || metadata.len() > usize::max_value() as u64 {
+            return None;
+        }
+        let len = metadata.len() as usize;
+        let ptr = unsafe { sys::mmap(ptr::null_mut(), len, sys::PROT_READ, sys::MAP_PRIVATE, file.as_raw_fd(), 0) };
+        if ptr == sys::MAP_FAILED {
+            return None;
+        }
+        /* Only a hint, failing is harmless. */
+        unsafe { sys::madvise(ptr, len, sys::MADV_SEQUENTIAL) };
+        Some(Mmap {
+            ptr: ptr as *mut u8,
+            len: len,
+        })
+    }
+
+    #[cfg(not(unix))]
+    pub fn open(_file: &File) -> Option<Mmap> {
+        None
+    }
+}
+
+/* The mapping is read only, so it can be read from any thread. */
+unsafe impl Send for Mmap {}
+
+impl Deref for Mmap {
+    type Target = [u8];
+
+    fn deref(&self) -> &[u8] {
+        unsafe { ::std::slice::from_raw_parts(self.ptr, self.len) }
+    }
+}
+
+impl Drop for Mmap {
+    #[cfg(unix)]
+    fn drop(&mut self) {
+        unsafe { sys::munmap(self.ptr as *mut _, self.len) };
+    }
+
+    #[cfg(not(unix))]
+    fn drop(&mut self) {}
+}
+
+#[cfg(unix)]
+mod sys {
+    use std::os::raw::{c_int, c_long, c_void};
+
+    pub const PROT_READ: c_int = 1;
+    pub const MAP_PRIVATE: c_int = 2;
+    pub const MADV_SEQUENTIAL: c_int = 2;
+    pub const MAP_FAILED: *mut c_void = !0usize as *mut c_void;
+
+    extern "C" {
+        pub fn mmap(addr: *mut c_void, len: usize, prot: c_int, flags: c_int, fd: c_int, offset: c_long) -> *mut c_void;
+        pub fn munmap(addr: *mut c_void, len: usize) -> c_int;
+        pub fn madvise(addr: *mut c_void, len: usize, advice: c_int) -> c_int;
+    }
+}
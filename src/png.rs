@@ -0,0 +1,472 @@
+//! Lossless PNG optimization, like zopflipng. The image data of the IDAT chunks
+//! is decoded and unfiltered, filtered again with a few strategies, and the one
+//! that the greedy LZ77 estimates smallest is compressed with the full squeeze.
+//! The pixels and the other chunks are kept as they are, unless ancillary chunks
+//! are stripped.
+
+use std::io::{self, Write};
+
+use crc::{crc32, Hasher32};
+
+use executor::run_jobs;
+use inflate;
+use predict::predict;
+use {compress, Format, Options};
+
+const SIGNATURE: [u8; 8] = [137, 80, 78, 71, 13, 10, 26, 10];
+
+/// Column and row of the first pixel of each Adam7 pass, and the steps between
+/// its pixels.
+const ADAM7: [(usize, usize, usize, usize); 7] = [
+    (0, 0, 8, 8),
+    (4, 0, 8, 8),
+    (0, 4, 4, 8),
+    (2, 0, 4, 4),
+    (0, 2, 2, 4),
+    (1, 0, 2, 2),
+    (0, 1, 1, 2),
+];
+
+/// How the scanlines are filtered before they are compressed.
+#[derive(Copy, Clone, Debug, PartialEq)]
+pub enum FilterStrategy {
+    /// The filters of the input, as they are.
+    Predefined,
+    /// The same filter type, 0 to 4, on every scanline.
+    Fixed(u8),
+    /// On each scanline the filter whose output has the smallest sum of absolute
+    /// values as signed bytes, the heuristic of libpng.
+    MinSum,
+    /// On each scanline the filter whose output has the least entropy.
+    Entropy,
+}
+
+/// Options for `optimize_png`, on top of those of the compressor.
+#[derive(Clone, Debug)]
+pub struct PngOptions {
+    /* Tried on every image, each estimated with the greedy LZ77 only. */
+    pub strategies: Vec<FilterStrategy>,
+    /* Drops the ancillary chunks, except tRNS, which is part of the pixels. */
+    pub strip_ancillary: bool,
+}
+
+impl Default for PngOptions {
+    fn default() -> PngOptions {
+        PngOptions {
+            strategies: vec![
+                FilterStrategy::Predefined,
+                FilterStrategy::Fixed(0),
+                FilterStrategy::Fixed(1),
+                FilterStrategy::Fixed(2),
+                FilterStrategy::Fixed(3),
+                FilterStrategy::Fixed(4),
+                FilterStrategy::MinSum,
+                FilterStrategy::Entropy,
+            ],
+            strip_ancillary: false,
+        }
+    }
+}
+
+/// Writes `png` to `out` with its image data filtered and compressed again. The
+/// original image data is kept if that doesn't make it smaller.
+pub fn optimize_png<W>(options: &Options, png_options: &PngOptions, png: &[u8], mut out: W) -> io::Result<()>
+    where W: Write
+{
+    let chunks = try!(parse_chunks(png));
+    let header = try!(Header::parse(&chunks[0]));
+    if png_options.strategies.iter().any(|&strategy| match strategy {
+        FilterStrategy::Fixed(filter) => filter > 4,
+        _ => false,
+    }) {
+        return Err(io::Error::new(io::ErrorKind::InvalidInput, "filter types go from 0 to 4"));
+    }
+
+    let mut idat = vec![];
+    for chunk in chunks.iter().filter(|chunk| &chunk.kind == b"IDAT") {
+        idat.extend_from_slice(chunk.data);
+    }
+    if idat.is_empty() {
+        return Err(invalid("no IDAT chunk"));
+    }
+    let filtered = try!(inflate::decompress(&idat, &Format::Zlib));
+    /* The width and height can be up to 2^32 - 1, so the sizes are checked. */
+    let sized = header.images().and_then(|images| {
+        images.iter().try_fold(0usize, |size, &(rowbytes, rows)| {
+            rowbytes.checked_add(1).and_then(|row| row.checked_mul(rows)).and_then(|bytes| size.checked_add(bytes))
+        }).map(|size| (images, size))
+    });
+    let images = match sized {
+        Some((images, size)) if size == filtered.len() => images,
+        _ => return Err(invalid("image data of the wrong size")),
+    };
+    let bpp = header.bytes_per_pixel();
+    let pixels = try!(unfilter(&filtered, &images, bpp));
+
+    // The candidates are estimated in parallel, each on a single thread
+    let mut single = options.clone();
+    single.executor = None;
+    single.cache = None;
+    single.verbose = false;
+    single.verbose_more = false;
+    let jobs = png_options.strategies.iter().map(|&strategy| {
+        let (single, filtered, pixels, images) = (&single, &filtered, &pixels, &images);
+        move || {
+            let candidate = match strategy {
+                FilterStrategy::Predefined => filtered.clone(),
+                _ => filter(pixels, images, bpp, strategy),
+            };
+            (predict(single, &candidate, None).greedy_size, candidate)
+        }
+    }).collect();
+    let candidates = run_jobs(options.executor.as_ref(), jobs);
+    if options.verbose {
+        for (strategy, &(estimate, _)) in png_options.strategies.iter().zip(&candidates) {
+            eprintln!("{:?}: estimated {} bytes", strategy, estimate);
+        }
+    }
+    let best = candidates.into_iter()
+        .enumerate()
+        .min_by_key(|&(i, (estimate, _))| (estimate, i))
+        .map_or(filtered, |(_, (_, candidate))| candidate);
+
+    let mut recompressed = vec![];
+    try!(compress(options, &Format::Zlib, &best, &mut recompressed));
+    if recompressed.len() >= idat.len() {
+        recompressed = idat;
+    }
+
+    try!(out.write_all(&SIGNATURE));
+    let mut idat_written = false;
+    for chunk in &chunks {
+        if &chunk.kind == b"IDAT" {
+            if !idat_written {
+                try!(write_chunk(&mut out, b"IDAT", &recompressed));
+                idat_written = true;
+            }
+        } else if !(png_options.strip_ancillary && chunk.is_ancillary() && &chunk.kind != b"tRNS") {
+            try!(write_chunk(&mut out, &chunk.kind, chunk.data));
+        }
+    }
+    Ok(())
+}
+
+struct Chunk<'a> {
+    kind: [u8; 4],
+    data: &'a [u8],
+}
+
+impl<'a> Chunk<'a> {
+    /// Ancillary chunks are those with a lowercase first letter, which decoders
+    /// may ignore.
+    fn is_ancillary(&self) -> bool {
+        self.kind[0] & 32 != 0
+    }
+}
+
+/// The chunks of `png` up to IEND, each with a valid CRC, starting with IHDR.
+fn parse_chunks(png: &[u8]) -> io::Result<Vec<Chunk<'_>>> {
+    if png.len() < 8 || png[..8] != SIGNATURE {
+        return Err(invalid("not a PNG file"));
+    }
+    let mut chunks = vec![];
+    let mut pos = 8;
+    loop {
+        if png.len() < pos + 12 {
+            return Err(invalid("truncated PNG chunk"));
+        }
+        let length = read_u32_be(&png[pos..]) as usize;
+        if png.len() - pos - 12 < length {
+            return Err(invalid("truncated PNG chunk"));
+        }
+        let typed = &png[(pos + 4)..(pos + 8 + length)];
+        if read_u32_be(&png[(pos + 8 + length)..]) != crc32::checksum_ieee(typed) {
+            return Err(invalid("PNG chunk CRC mismatch"));
+        }
+        let chunk = Chunk {
+            kind: [typed[0], typed[1], typed[2], typed[3]],
+            data: &typed[4..],
+        };
+        pos += 12 + length;
+        if chunks.is_empty() && &chunk.kind != b"IHDR" {
+            return Err(invalid("PNG file doesn't start with IHDR"));
+        }
+        let end = &chunk.kind == b"IEND";
+        chunks.push(chunk);
+        if end {
+            return Ok(chunks);
+        }
+    }
+}
+
+fn write_chunk<W>(out: &mut W, kind: &[u8; 4], data: &[u8]) -> io::Result<()>
+    where W: Write
+{
+    if data.len() > 0x7fffffff {
+        return Err(io::Error::new(io::ErrorKind::InvalidInput, "PNG chunk too large"));
+    }
+    let mut crc = crc32::Digest::new(crc32::IEEE);
+    crc.write(kind);
+    crc.write(data);
+    try!(out.write_all(&(data.len() as u32).to_be_bytes()));
+    try!(out.write_all(kind));
+    try!(out.write_all(data));
+    out.write_all(&crc.sum32().to_be_bytes())
+}
+
+fn read_u32_be(bytes: &[u8]) -> u32 {
+    (bytes[0] as u32) << 24 | (bytes[1] as u32) << 16 | (bytes[2] as u32) << 8 | bytes[3] as u32
+}
+
+struct Header {
+    width: usize,
+    height: usize,
+    bits_per_pixel: usize,
+    interlaced: bool,
+}
+
+impl Header {
+    fn parse(ihdr: &Chunk) -> io::Result<Header> {
+        let data = ihdr.data;
+        if data.len() != 13 {
+            return Err(invalid("IHDR of the wrong size"));
+        }
+        let depth = data[8] as usize;
+        let channels = match (data[9], depth) {
+            (0, 1) | (0, 2) | (0, 4) | (0, 8) | (0, 16) => 1,
+            (2, 8) | (2, 16) => 3,
+            (3, 1) | (3, 2) | (3, 4) | (3, 8) => 1,
+            (4, 8) | (4, 16) => 2,
+            (6, 8) | (6, 16) => 4,
+            _ => return Err(invalid("invalid PNG color type and bit depth")),
+        };
+        if data[10] != 0 || data[11] != 0 || data[12] > 1 {
+            return Err(invalid("unknown PNG compression, filter or interlace method"));
+        }
+        Ok(Header {
+            width: read_u32_be(&data[0..4]) as usize,
+            height: read_u32_be(&data[4..8]) as usize,
+            bits_per_pixel: channels * depth,
+            interlaced: data[12] == 1,
+        })
+    }
+
+    /// The distance in bytes to the pixel on the left that filters use, at
+    /// least 1.
+    fn bytes_per_pixel(&self) -> usize {
+        (self.bits_per_pixel / 8).max(1)
+    }
+
+    /// The bytes per row, not counting the filter type, and the rows of each
+    /// image that is filtered on its own: the whole image, or the nonempty
+    /// Adam7 passes. None if a row has more bytes than fit in a usize.
+    fn images(&self) -> Option<Vec<(usize, usize)>> {
+        let rowbytes = |width: usize| width.checked_mul(self.bits_per_pixel).map(|bits| bits / 8 + if bits % 8 == 0 { 0 } else { 1 });
+        if !self.interlaced {
+            return rowbytes(self.width).map(|rowbytes| vec![(rowbytes, self.height)]);
+        }
+        /* Pixels from `start` on, every `step`th. */
+        let pass = |size: usize, start: usize, step: usize| if size <= start { 0 } else { (size - start - 1) / step + 1 };
+        ADAM7.iter().filter_map(|&(x, y, dx, dy)| {
+            let (width, height) = (pass(self.width, x, dx), pass(self.height, y, dy));
+            if width == 0 || height == 0 {
+                None
+            } else {
+                Some(rowbytes(width).map(|rowbytes| (rowbytes, height)))
+            }
+        }).collect()
+    }
+}
+
+/// What a filter predicts a byte from: the byte a pixel to the left, the byte
+/// above, and the byte above that on the left.
+fn predictor(filter: u8, a: u8, b: u8, c: u8) -> u8 {
+    match filter {
+        0 => 0,
+        1 => a,
+        2 => b,
+        3 => ((a as u16 + b as u16) / 2) as u8,
+        _ => {
+            let p = a as i16 + b as i16 - c as i16;
+            let (pa, pb, pc) = ((p - a as i16).abs(), (p - b as i16).abs(), (p - c as i16).abs());
+            if pa <= pb && pa <= pc {
+                a
+            } else if pb <= pc {
+                b
+            } else {
+                c
+            }
+        }
+    }
+}
+
+/// Undoes the filters of each scanline, leaving the rows of the images without
+/// their filter types.
+fn unfilter(filtered: &[u8], images: &[(usize, usize)], bpp: usize) -> io::Result<Vec<u8>> {
+    let mut pixels = Vec::with_capacity(filtered.len());
+    let mut pos = 0;
+    for &(rowbytes, rows) in images {
+        for row in 0..rows {
+            let filter = filtered[pos];
+            if filter > 4 {
+                return Err(invalid("invalid PNG filter type"));
+            }
+            let line = &filtered[(pos + 1)..(pos + 1 + rowbytes)];
+            pos += 1 + rowbytes;
+            let start = pixels.len();
+            for i in 0..rowbytes {
+                let a = if i >= bpp { pixels[start + i - bpp] } else { 0 };
+                let (b, c) = if row == 0 {
+                    (0, 0)
+                } else {
+                    let above = &pixels[(start - rowbytes)..start];
+                    (above[i], if i >= bpp { above[i - bpp] } else { 0 })
+                };
+                pixels.push(line[i].wrapping_add(predictor(filter, a, b, c)));
+            }
+        }
+    }
+    Ok(pixels)
+}
+
+/// Filters the rows of the images with `strategy`, which isn't `Predefined`.
+fn filter(pixels: &[u8], images: &[(usize, usize)], bpp: usize, strategy: FilterStrategy) -> Vec<u8> {
+    let mut filtered = Vec::with_capacity(pixels.len() + pixels.len() / 64);
+    let mut trials: Vec<Vec<u8>> = (0..5).map(|_| vec![]).collect();
+    let mut pos = 0;
+    for &(rowbytes, rows) in images {
+        let zeros = vec![0; rowbytes];
+        for row in 0..rows {
+            let line = &pixels[pos..(pos + rowbytes)];
+            let above = if row == 0 { &zeros[..] } else { &pixels[(pos - rowbytes)..pos] };
+            pos += rowbytes;
+            let filters = match strategy {
+                FilterStrategy::Fixed(filter) => filter..(filter + 1),
+                _ => 0..5,
+            };
+            for filter in filters.clone() {
+                let trial = &mut trials[filter as usize];
+                trial.clear();
+                for i in 0..rowbytes {
+                    let a = if i >= bpp { line[i - bpp] } else { 0 };
+                    let c = if i >= bpp { above[i - bpp] } else { 0 };
+                    trial.push(line[i].wrapping_sub(predictor(filter, a, above[i], c)));
+                }
+            }
+            let best = filters.min_by(|&x, &y| {
+                cost(strategy, &trials[x as usize]).partial_cmp(&cost(strategy, &trials[y as usize])).unwrap()
+            }).unwrap();
+            filtered.push(best);
+            filtered.extend_from_slice(&trials[best as usize]);
+        }
+    }
+    filtered
+}
+
+/// How large `strategy` expects a filtered scanline to compress.
+fn cost(strategy: FilterStrategy, line: &[u8]) -> f64 {
+    match strategy {
+        FilterStrategy::Entropy => {
+            let mut counts = [0usize; 256];
+            for &byte in line {
+                counts[byte as usize] += 1;
+            }
+            let total = line.len() as f64;
+            counts.iter().filter(|&&count| count > 0).map(|&count| {
+                let count = count as f64;
+                -count * (count / total).log2()
+            }).sum()
+        }
+        _ => line.iter().map(|&byte| (byte as i8 as i32).abs() as f64).sum(),
+    }
+}
+
+fn invalid(msg: &str) -> io::Error {
+    io::Error::new(io::ErrorKind::InvalidData, msg)
+}
+
+#[cfg(test)]
+mod test {
+    use super::*;
+
+    /// An interlaced RGB image with an ancillary chunk and a tRNS chunk.
+    fn test_png(pixels: &[u8], width: usize, height: usize) -> Vec<u8> {
+        // Picks the pixels of each pass out of the image, unfiltered
+        let mut raw = vec![];
+        for &(x0, y0, dx, dy) in &ADAM7 {
+            for y in (y0..height).step_by(dy) {
+                if x0 >= width {
+                    continue;
+                }
+                raw.push(0);
+                for x in (x0..width).step_by(dx) {
+                    raw.extend_from_slice(&pixels[(3 * (y * width + x))..(3 * (y * width + x) + 3)]);
+                }
+            }
+        }
+        let mut idat = vec![];
+        compress(&Options::default(), &Format::Zlib, &raw, &mut idat).unwrap();
+
+        let mut ihdr = vec![];
+        ihdr.extend_from_slice(&(width as u32).to_be_bytes());
+        ihdr.extend_from_slice(&(height as u32).to_be_bytes());
+        ihdr.extend_from_slice(&[8, 2, 0, 0, 1]);
+        let mut png = SIGNATURE.to_vec();
+        write_chunk(&mut png, b"IHDR", &ihdr).unwrap();
+        write_chunk(&mut png, b"tEXt", b"Comment\0test").unwrap();
+        write_chunk(&mut png, b"tRNS", &[0, 0, 0, 0, 0, 0]).unwrap();
+        let middle = idat.len() / 2;
+        write_chunk(&mut png, b"IDAT", &idat[..middle]).unwrap();
+        write_chunk(&mut png, b"IDAT", &idat[middle..]).unwrap();
+        write_chunk(&mut png, b"IEND", &[]).unwrap();
+        png
+    }
+
+    fn decoded_pixels(png: &[u8]) -> Vec<u8> {
+        let chunks = parse_chunks(png).unwrap();
+        let header = Header::parse(&chunks[0]).unwrap();
+        let mut idat = vec![];
+        for chunk in chunks.iter().filter(|chunk| &chunk.kind == b"IDAT") {
+            idat.extend_from_slice(chunk.data);
+        }
+        let filtered = inflate::decompress(&idat, &Format::Zlib).unwrap();
+        unfilter(&filtered, &header.images().unwrap(), header.bytes_per_pixel()).unwrap()
+    }
+
+    #[test]
+    fn keeps_the_pixels_and_strips_ancillary_chunks() {
+        let (width, height) = (37, 21);
+        let pixels: Vec<u8> = (0..(3 * width * height)).map(|i| (i / 3 % width + i % 3 * (i / 3 / width)) as u8).collect();
+        let png = test_png(&pixels, width, height);
+
+        let png_options = PngOptions {
+            strip_ancillary: true,
+            ..PngOptions::default()
+        };
+        let mut optimized = vec![];
+        optimize_png(&Options::default(), &png_options, &png, &mut optimized).unwrap();
+
+        let kinds: Vec<[u8; 4]> = parse_chunks(&optimized).unwrap().iter().map(|chunk| chunk.kind).collect();
+        assert_eq!(kinds, vec![*b"IHDR", *b"tRNS", *b"IDAT", *b"IEND"]);
+        assert_eq!(decoded_pixels(&optimized), decoded_pixels(&png));
+        assert!(optimized.len() < png.len());
+    }
+
+    #[test]
+    fn rejects_sizes_that_overflow() {
+        let mut idat = vec![];
+        compress(&Options::default(), &Format::Zlib, &[0; 64], &mut idat).unwrap();
+        for &interlace in &[0, 1] {
+            let mut ihdr = vec![];
+            ihdr.extend_from_slice(&0x7fffffffu32.to_be_bytes());
+            ihdr.extend_from_slice(&0x7fffffffu32.to_be_bytes());
+            ihdr.extend_from_slice(&[16, 6, 0, 0, interlace]);
+            let mut png = SIGNATURE.to_vec();
+            write_chunk(&mut png, b"IHDR", &ihdr).unwrap();
+            write_chunk(&mut png, b"IDAT", &idat).unwrap();
+            write_chunk(&mut png, b"IEND", &[]).unwrap();
+            let err = optimize_png(&Options::default(), &PngOptions::default(), &png, vec![]).unwrap_err();
+            assert_eq!(err.to_string(), "image data of the wrong size");
+        }
+    }
+}
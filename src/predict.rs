@@ -0,0 +1,166 @@
+//! Cheap prediction of the compressed size, to decide whether the expensive
+//! squeeze is worth running at all. It only does the greedy LZ77 run and the
+//! block size calculations, which are a small fraction of the total work.
+
+use blocksplitter::blocksplit_lz77;
+use deflate::calculate_block_size_auto_type;
+use executor::run_jobs;
+use lz77::{Lz77Store, ZopfliBlockState};
+use util::ZOPFLI_MASTER_BLOCK_SIZE;
+use Options;
+
+/// zlib flushes a block every time its symbol buffer fills up, which holds this
+/// many symbols at the default memLevel of 8.
+const ZLIB_BLOCK_SYMBOLS: usize = 16383;
+
+/// How much smaller than the greedy estimate a full squeeze gets, as a fraction
+/// of how much the greedy estimate saves. On the files in test/data the squeeze
+/// saved from 0% of the greedy size for an incompressible PNG to 7% for the CSV
+/// file, roughly in proportion to how compressible they are.
+const SQUEEZE_GAIN_LOW: f64 = 0.03;
+const SQUEEZE_GAIN_HIGH: f64 = 0.1;
+/// Even almost incompressible data gains a little from the squeeze.
+const SQUEEZE_GAIN_MIN: f64 = 0.006;
+
+/// Expected sizes in bytes of the deflate data, without container, for an input.
+#[derive(Copy, Clone, Debug, PartialEq)]
+pub struct Prediction {
+    /// Bytes of input the prediction is for.
+    pub input_size: usize,
+    /// Size with greedy LZ77, block splitting and optimized Huffman trees: what
+    /// `numiterations` of 0 gives.
+    pub greedy_size: usize,
+    /// Expected range of the size with the full squeeze.
+    pub zopfli_low: usize,
+    pub zopfli_high: usize,
+    /// Expected size from zlib at level 9.
+    pub zlib9_size: usize,
+}
+
+impl Prediction {
+    /// The expected fraction saved by the full squeeze compared to zlib at level
+    /// 9, using the middle of the predicted range.
+    pub fn expected_gain(&self) -> f64 {
+        if self.zlib9_size == 0 {
+            return 0.0;
+        }
+        let zopfli = (self.zopfli_low + self.zopfli_high) as f64 / 2.0;
+        1.0 - zopfli / self.zlib9_size as f64
+    }
+}
+
+/// Predicts the compressed size of `in_data`. With `sample_size`, only that many
+/// bytes, taken from a few places spread over the input, are looked at and the
+/// result is scaled up to the whole input.
+pub fn predict(options: &Options, in_data: &[u8], sample_size: Option<usize>) -> Prediction {
+    const SAMPLE_PARTS: usize = 4;
+    let insize = in_data.len();
+    let ranges = match sample_size {
+        Some(sample_size) if sample_size < insize => {
+            let part = (sample_size / SAMPLE_PARTS).max(1);
+            let stride = insize / SAMPLE_PARTS;
+            (0..SAMPLE_PARTS).map(|i| (i * stride, i * stride + part)).collect()
+        },
+        _ => vec![(0, insize)],
+    };
+
+    let jobs = ranges.into_iter().map(|(start, end)| {
+        move || {
+            let mut sampled = 0;
+            let mut greedy_bits = 0.0;
+            let mut zlib9_bits = 0.0;
+            let mut i = start;
+            while i < end {
+                let block_end = (i + ZOPFLI_MASTER_BLOCK_SIZE).min(end);
+                let mut store = Lz77Store::new();
+                {
+                    let mut s = ZopfliBlockState::new_without_cache(options, i, block_end);
+                    store.greedy(&mut s, in_data, i, block_end);
+                }
+                greedy_bits += split_size(options, &store);
+                zlib9_bits += zlib_block_size(&store);
+                sampled += block_end - i;
+                i = block_end;
+            }
+            (sampled, greedy_bits, zlib9_bits)
+        }
+    }).collect();
+
+    let mut sampled = 0;
+    let mut greedy_bits = 0.0;
+    let mut zlib9_bits = 0.0;
+    for (part_sampled, part_greedy_bits, part_zlib9_bits) in run_jobs(options.executor.as_ref(), jobs) {
+        sampled += part_sampled;
+        greedy_bits += part_greedy_bits;
+        zlib9_bits += part_zlib9_bits;
+    }
+
+    let scale = if sampled == 0 { 0.0 } else { insize as f64 / sampled as f64 };
+    let greedy_size = greedy_bits * scale / 8.0;
+    let saved = if insize == 0 { 0.0 } else { (1.0 - greedy_size / insize as f64).max(0.0) };
+    Prediction {
+        input_size: insize,
+        greedy_size: greedy_size.ceil() as usize,
+        zopfli_low: (greedy_size * (1.0 - SQUEEZE_GAIN_MIN - SQUEEZE_GAIN_HIGH * saved)).ceil() as usize,
+        zopfli_high: (greedy_size * (1.0 - SQUEEZE_GAIN_LOW * saved)).ceil() as usize,
+        zlib9_size: (zlib9_bits * scale / 8.0).ceil() as usize,
+    }
+}
+
+/// Size in bits of the LZ77 data when split into blocks like the compressor does.
+fn split_size(options: &Options, store: &Lz77Store) -> f64 {
+    let mut splitpoints = Vec::with_capacity(options.blocksplittingmax as usize);
+    blocksplit_lz77(options, store, options.blocksplittingmax as usize, &mut splitpoints);
+
+    let mut bits = 0.0;
+    let mut last = 0;
+    for &item in &splitpoints {
+        bits += calculate_block_size_auto_type(store, last, item);
+        last = item;
+    }
+    bits + calculate_block_size_auto_type(store, last, store.size())
+}
+
+/// Size in bits of the LZ77 data when cut into blocks the way zlib does, a new
+/// block every time its symbol buffer is full.
+fn zlib_block_size(store: &Lz77Store) -> f64 {
+    let mut bits = 0.0;
+    let mut start = 0;
+    while start < store.size() {
+        let end = (start + ZLIB_BLOCK_SYMBOLS).min(store.size());
+        bits += calculate_block_size_auto_type(store, start, end);
+        start = end;
+    }
+    bits
+}
+
+#[cfg(test)]
+mod test {
+    use super::*;
+    use {compress, Format};
+
+    #[test]
+    fn sampled_prediction_is_close_to_full() {
+        let data = include_bytes!("../test/data/codetriage.js");
+        let full = predict(&Options::default(), data, None);
+        let sampled = predict(&Options::default(), data, Some(40000));
+        assert!(full.zopfli_low <= full.zopfli_high && full.zopfli_high <= full.greedy_size);
+        let ratio = sampled.greedy_size as f64 / full.greedy_size as f64;
+        assert!(ratio > 0.8 && ratio < 1.25);
+    }
+
+    #[test]
+    fn gate_skips_the_squeeze_for_small_gains() {
+        let data: Vec<u8> = (0..5000u32).map(|i| (i.wrapping_mul(2654435761) >> 13) as u8).collect();
+        let mut options = Options::default();
+        options.min_predicted_gain = 0.5;
+        let mut gated = vec![];
+        compress(&options, &Format::Deflate, &data, &mut gated).unwrap();
+
+        options.min_predicted_gain = 0.0;
+        options.numiterations = 0;
+        let mut greedy = vec![];
+        compress(&options, &Format::Deflate, &data, &mut greedy).unwrap();
+        assert_eq!(gated, greedy);
+    }
+}
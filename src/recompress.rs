@@ -0,0 +1,73 @@
+//! Recompression of data that is already deflate compressed, by gzip, zlib or an
+//! earlier run of this program with fewer iterations. The existing stream is
+//! decoded back into its LZ77 symbols, which give the squeeze a much better
+//! starting point than the greedy LZ77 run it would start from otherwise, or
+//! which can be kept as they are with only the blocks and Huffman trees redone.
+
+use std::io::{self, Write};
+
+use deflate::{deflate_lz77, deflate_seeded, BlockType};
+use inflate;
+use {wrap_container, Format, Options};
+
+/// Decodes `compressed`, a gzip, zlib or raw deflate stream, and compresses its
+/// contents again into `out` as `output_type`, seeding each block's squeeze with
+/// the LZ77 symbols found in the existing stream.
+pub fn recompress<W>(options: &Options, output_type: &Format, compressed: &[u8], out: W) -> io::Result<()>
+    where W: Write
+{
+    let decoded = try!(inflate::decode(compressed));
+    let data = &decoded.data;
+    let lz77 = &decoded.lz77;
+    wrap_container(output_type, data, out, |out| {
+        deflate_seeded(options, BlockType::Dynamic, data, Some(lz77), out)
+    })
+}
+
+/// Decodes `compressed`, a gzip, zlib or raw deflate stream, and writes the same
+/// LZ77 symbols again into `out` as `output_type`, with new block splits and
+/// optimized Huffman trees. No matching is done, so this is only a small fraction
+/// of the work of `recompress`, for a smaller gain.
+pub fn reoptimize<W>(options: &Options, output_type: &Format, compressed: &[u8], out: W) -> io::Result<()>
+    where W: Write
+{
+    let decoded = try!(inflate::decode(compressed));
+    let data = &decoded.data;
+    let lz77 = &decoded.lz77;
+    wrap_container(output_type, data, out, |out| deflate_lz77(options, data, lz77, out))
+}
+
+#[cfg(test)]
+mod test {
+    use super::*;
+    use compress;
+    use deflate::deflate;
+
+    #[test]
+    fn recompressed_gzip_decodes_to_the_original() {
+        let data: Vec<u8> = (0..20000u32).map(|i| ((i * i) >> 7) as u8 % 11 + b'a').collect();
+        let mut options = Options::default();
+        options.numiterations = 1;
+        let mut first = vec![];
+        compress(&options, &Format::Gzip, &data, &mut first).unwrap();
+
+        options.numiterations = 5;
+        let mut second = vec![];
+        recompress(&options, &Format::Zlib, &first, &mut second).unwrap();
+
+        assert_eq!(inflate::decode(&second).unwrap().data, data);
+    }
+
+    #[test]
+    fn reoptimized_fixed_blocks_get_smaller() {
+        let data: Vec<u8> = (0..50000u32).map(|i| ((i * 7) % 251 ^ (i >> 9)) as u8).collect();
+        let mut fixed = vec![];
+        deflate(&Options::default(), BlockType::Fixed, &data, &mut fixed).unwrap();
+
+        let mut reoptimized = vec![];
+        reoptimize(&Options::default(), &Format::Deflate, &fixed, &mut reoptimized).unwrap();
+
+        assert!(reoptimized.len() < fixed.len());
+        assert_eq!(inflate::decode(&reoptimized).unwrap().data, data);
+    }
+}
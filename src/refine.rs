@@ -0,0 +1,152 @@
+//! Progressive refinement: a fast, valid encoding first, then successively more
+//! expensive ones, keeping whichever is smallest so far. This lets a caller
+//! publish something right away and upgrade it in the background for as long as
+//! it cares to.
+
+use std::io;
+
+use deflate::{deflate_seeded, BlockType};
+use inflate;
+use {compress, resolve_options, wrap_container, Format, Options};
+
+/// Compresses the same input again and again with more iterations each time.
+/// Each step is seeded with the LZ77 data of the best encoding so far, so it
+/// continues from there rather than starting over.
+pub struct Refiner<'a> {
+    options: Options,
+    output_type: &'a Format,
+    in_data: &'a [u8],
+    best: Vec<u8>,
+    /* Iterations used by the last step, 0 for the initial greedy encoding. */
+    iterations: i32,
+}
+
+impl<'a> Refiner<'a> {
+    /// Makes the initial encoding, using only greedy LZ77, which is available
+    /// from `best` as soon as this returns. The options are resolved like in
+    /// `compress`, and the resolved `numiterations` is the amount of iterations
+    /// the last refinement step uses. All steps share its `max_iterations`.
+    pub fn new(options: &Options, output_type: &'a Format, in_data: &'a [u8]) -> io::Result<Refiner<'a>> {
+        let options = resolve_options(options, in_data);
+        let mut greedy = options.clone();
+        greedy.numiterations = 0;
+        /* The profile is already applied, and would bring the iterations back. */
+        greedy.profiles = None;
+
+        let mut best = vec![];
+        try!(compress(&greedy, output_type, in_data, &mut best));
+
+        Ok(Refiner {
+            options: options,
+            output_type: output_type,
+            in_data: in_data,
+            best: best,
+            iterations: 0,
+        })
+    }
+
+    /// The smallest complete encoding found so far.
+    pub fn best(&self) -> &[u8] {
+        &self.best
+    }
+
+    pub fn into_best(self) -> Vec<u8> {
+        self.best
+    }
+
+    /// Whether the last step already used the full `numiterations`.
+    pub fn is_done(&self) -> bool {
+        self.iterations >= self.options.numiterations
+    }
+
+    /// Runs the next refinement step, doubling the amount of iterations of the
+    /// previous one. Returns the new best encoding if this step found a smaller
+    /// one, `None` if it did not or if refinement is already done.
+    pub fn refine(&mut self) -> io::Result<Option<&[u8]>> {
+        if self.is_done() {
+            return Ok(None);
+        }
+        self.iterations = if self.iterations == 0 { 1 } else { self.iterations * 2 };
+        if self.iterations > self.options.numiterations {
+            self.iterations = self.options.numiterations;
+        }
+
+        let seed = try!(inflate::decode_as(&self.best, self.output_type)).lz77;
+        let mut options = self.options.clone();
+        options.numiterations = self.iterations;
+
+        let in_data = self.in_data;
+        let mut candidate = Vec::with_capacity(self.best.len());
+        try!(wrap_container(self.output_type, in_data, &mut candidate, |out| {
+            deflate_seeded(&options, BlockType::Dynamic, in_data, Some(&seed), out)
+        }));
+
+        if candidate.len() < self.best.len() {
+            self.best = candidate;
+            Ok(Some(&self.best))
+        } else {
+            Ok(None)
+        }
+    }
+}
+
+/// Runs all refinement steps, calling `publish` with the initial encoding and
+/// then with every encoding that is smaller than all before it. Refinement stops
+/// early when `publish` returns `false`. Returns the best encoding found.
+pub fn refine_progressively<F>(options: &Options, output_type: &Format, in_data: &[u8], mut publish: F) -> io::Result<Vec<u8>>
+    where F: FnMut(&[u8]) -> bool
+{
+    let mut refiner = try!(Refiner::new(options, output_type, in_data));
+    if !publish(refiner.best()) {
+        return Ok(refiner.into_best());
+    }
+    while !refiner.is_done() {
+        if let Some(better) = try!(refiner.refine()) {
+            if !publish(better) {
+                break;
+            }
+        }
+    }
+    Ok(refiner.into_best())
+}
+
+#[cfg(test)]
+mod test {
+    use super::*;
+
+    #[test]
+    fn published_encodings_shrink_and_decode() {
+        let data: Vec<u8> = (0..30000u32).map(|i| ((i * i) >> 5) as u8 % 23 + b'A').collect();
+        let mut options = Options::default();
+        options.numiterations = 4;
+
+        let mut sizes = vec![];
+        let best = refine_progressively(&options, &Format::Gzip, &data, |out| {
+            assert_eq!(inflate::decode(out).unwrap().data, data);
+            sizes.push(out.len());
+            true
+        }).unwrap();
+
+        assert!(sizes.windows(2).all(|w| w[1] < w[0]));
+        assert_eq!(*sizes.last().unwrap(), best.len());
+    }
+
+    #[test]
+    fn steps_follow_the_profile() {
+        let data: Vec<u8> = (0..30000u32).map(|i| ((i * i) >> 5) as u8 % 23 + b'A').collect();
+        let mut options = Options::default();
+        let mut profiles = ::ProfileSet::new();
+        let mut profile = ::Profile::of(&options);
+        profile.numiterations = 2;
+        profiles.insert(::ContentClass::sniff(&data), profile);
+        options.profiles = Some(::std::sync::Arc::new(profiles));
+
+        let mut refiner = Refiner::new(&options, &Format::Gzip, &data).unwrap();
+        let mut steps = 0;
+        while !refiner.is_done() {
+            refiner.refine().unwrap();
+            steps += 1;
+        }
+        assert_eq!(steps, 2);
+    }
+}
@@ -0,0 +1,218 @@
+//! Compressed outputs kept on disk, so an input that was compressed before with
+//! the same options is returned right away instead of being compressed again.
+//! Entries are files named after a SHA-256 of the input and of everything else
+//! the output depends on.
+
+use std::fmt;
+use std::fs::{self, File};
+use std::io::{self, Write};
+use std::path::{Path, PathBuf};
+use std::process;
+use std::sync::Mutex;
+use std::sync::atomic::{AtomicUsize, Ordering};
+use std::time::SystemTime;
+
+use cancel::memory_plan;
+use sha256::Sha256;
+use {Format, Options};
+
+/// Identifies the output of compressing an input with some options.
+#[derive(Copy, Clone, Debug, PartialEq, Eq, Hash)]
+pub struct CacheKey([u8; 32]);
+
+impl CacheKey {
+    pub fn new(options: &Options, output_type: &Format, in_data: &[u8]) -> CacheKey {
+        let mut sha = Sha256::new();
+        /* The output of another version may differ. */
+        sha.update(env!("CARGO_PKG_VERSION").as_bytes());
+        let options = options.for_input(in_data);
+        let values = [
+            *output_type as u64,
+            options.numiterations as u64,
+            options.blocksplittingmax as u64,
+            options.max_chain_hits as u64,
+            options.min_predicted_gain.to_bits(),
+            options.max_iterations.map_or(u64::max_value(), |max| max as u64),
+            memory_plan(&options, in_data.len()).master_block_size as u64,
+        ];
+        for value in &values {
+            sha.update(&value.to_le_bytes());
+        }
+        if let Some((prior, weight)) = options.prior() {
+            for &p in [weight].iter().chain(prior.litlens()).chain(prior.dists()) {
+                sha.update(&p.to_bits().to_le_bytes());
+            }
+        }
+        sha.update(&(in_data.len() as u64).to_le_bytes());
+        sha.update(in_data);
+        CacheKey(sha.finish())
+    }
+}
+
+impl fmt::Display for CacheKey {
+    fn fmt(&self, f: &mut fmt::Formatter) -> fmt::Result {
+        for byte in &self.0 {
+            try!(write!(f, "{:02x}", byte));
+        }
+        Ok(())
+    }
+}
+
+/* Makes the names of temporary files unique within the process. */
+static TEMP_FILES: AtomicUsize = AtomicUsize::new(0);
+
+#[derive(Copy, Clone, Debug, Default, PartialEq)]
+pub struct CacheStats {
+    pub hits: usize,
+    pub misses: usize,
+    pub evictions: usize,
+    /* Bytes in the cache. */
+    pub size: u64,
+}
+
+pub struct ResultCache {
+    dir: PathBuf,
+    max_size: u64,
+    stats: Mutex<CacheStats>,
+}
+
+impl ResultCache {
+    /// Keeps the cache in `dir`, which is created if needed and may be shared
+    /// with other processes. When its entries take more than `max_size` bytes,
+    /// the least recently used are removed.
+    pub fn open<P: AsRef<Path>>(dir: P, max_size: u64) -> io::Result<ResultCache> {
+        let dir = dir.as_ref().to_path_buf();
+        try!(fs::create_dir_all(&dir));
+        let size = try!(entries(&dir)).iter().map(|&(_, size, _)| size).sum();
+        Ok(ResultCache {
+            dir: dir,
+            max_size: max_size,
+            stats: Mutex::new(CacheStats {
+                size: size,
+                ..CacheStats::default()
+            }),
+        })
+    }
+
+    /// The output stored for `key`, if there is one.
+    pub fn get(&self, key: &CacheKey) -> Option<Vec<u8>> {
+        let path = self.dir.join(key.to_string());
+        let data = fs::read(&path).ok();
+        if data.is_some() {
+            /* Recently used, only for eviction, so failing is harmless. */
+            let _ = File::options().write(true).open(&path).and_then(|file| file.set_modified(SystemTime::now()));
+        }
+        let mut stats = self.stats.lock().unwrap();
+        match data {
+            Some(_) => stats.hits += 1,
+            None => stats.misses += 1,
+        }
+        data
+    }
+
+    /// Stores `data` as the output for `key`, evicting older entries if the
+    /// cache gets too large. Entries appear whole or not at all, also to other
+    /// processes.
+    pub fn put(&self, key: &CacheKey, data: &[u8]) -> io::Result<()> {
+        if data.len() as u64 > self.max_size {
+            return Ok(());
+        }
+        let path = self.dir.join(key.to_string());
+        let temp = self.dir.join(format!("{}.{}.{}.tmp", key, process::id(), TEMP_FILES.fetch_add(1, Ordering::Relaxed)));
+        let written = File::create(&temp)
+            .and_then(|mut file| file.write_all(data))
+            .and_then(|_| fs::rename(&temp, &path));
+        if let Err(err) = written {
+            let _ = fs::remove_file(&temp);
+            return Err(err);
+        }
+
+        let mut stats = self.stats.lock().unwrap();
+        stats.size += data.len() as u64;
+        if stats.size > self.max_size {
+            try!(self.evict(&mut stats));
+        }
+        Ok(())
+    }
+
+    pub fn stats(&self) -> CacheStats {
+        *self.stats.lock().unwrap()
+    }
+
+    /// Removes the least recently used entries until the cache is at most
+    /// three quarters full, so that it isn't scanned on every put.
+    fn evict(&self, stats: &mut CacheStats) -> io::Result<()> {
+        let mut entries = try!(entries(&self.dir));
+        entries.sort_by_key(|&(_, _, modified)| modified);
+        stats.size = entries.iter().map(|&(_, size, _)| size).sum();
+        for (path, size, _) in entries {
+            if stats.size <= self.max_size / 4 * 3 {
+                break;
+            }
+            if fs::remove_file(&path).is_ok() {
+                stats.size -= size;
+                stats.evictions += 1;
+            }
+        }
+        Ok(())
+    }
+}
+
+/// The entries in `dir`, with their sizes and when they were last used.
+fn entries(dir: &Path) -> io::Result<Vec<(PathBuf, u64, SystemTime)>> {
+    let mut entries = vec![];
+    for entry in try!(fs::read_dir(dir)) {
+        let entry = try!(entry);
+        let is_entry = entry.file_name().to_str().map_or(false, |name| name.len() == 64 && name.bytes().all(|b| b.is_ascii_hexdigit()));
+        if !is_entry {
+            continue;
+        }
+        /* Another process may have removed it. */
+        if let Ok(metadata) = entry.metadata() {
+            entries.push((entry.path(), metadata.len(), metadata.modified().unwrap_or(SystemTime::UNIX_EPOCH)));
+        }
+    }
+    Ok(entries)
+}
+
+#[cfg(test)]
+mod test {
+    use std::env;
+    use std::fs;
+    use std::process;
+    use std::sync::Arc;
+
+    use super::*;
+    use {compress, Format, Options};
+
+    #[test]
+    fn compresses_once_and_evicts() {
+        let dir = env::temp_dir().join(format!("zopfli-cache-{}", process::id()));
+        let cache = Arc::new(ResultCache::open(&dir, 200).unwrap());
+        let mut options = Options::default();
+        options.numiterations = 1;
+        options.cache = Some(cache.clone());
+        let data = b"hello hello hello hello";
+
+        let mut first = vec![];
+        compress(&options, &Format::Gzip, data, &mut first).unwrap();
+        let mut second = vec![];
+        compress(&options, &Format::Gzip, data, &mut second).unwrap();
+        assert_eq!(first, second);
+        assert_eq!(cache.stats().hits, 1);
+        assert_eq!(cache.stats().misses, 1);
+
+        /* Other options are another entry. */
+        options.numiterations = 2;
+        compress(&options, &Format::Gzip, data, &mut vec![]).unwrap();
+        assert_eq!(cache.stats().misses, 2);
+
+        for i in 0..10u8 {
+            compress(&options, &Format::Gzip, &[i; 100], &mut vec![]).unwrap();
+        }
+        let stats = cache.stats();
+        assert!(stats.evictions > 0);
+        assert!(stats.size <= 200);
+        fs::remove_dir_all(&dir).unwrap();
+    }
+}
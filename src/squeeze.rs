@@ -13,13 +13,14 @@ use cache::Cache;
 use deflate::{calculate_block_size, BlockType};
 use hash::ZopfliHash;
 use lz77::{Lz77Store, ZopfliBlockState, find_longest_match, LitLen};
+use prior::StatsPrior;
 use symbols::{get_dist_extra_bits, get_dist_symbol, get_length_extra_bits, get_length_symbol};
 use util::{ZOPFLI_NUM_LL, ZOPFLI_NUM_D, ZOPFLI_WINDOW_SIZE, ZOPFLI_WINDOW_MASK, ZOPFLI_MAX_MATCH};
 
 const K_INV_LOG2: f64 = f64::consts::LOG2_E;  // 1.0 / log(2.0)
 
 /// Cost model which should exactly match fixed tree.
-fn get_cost_fixed(litlen: u32, dist: u32) -> f64 {
+pub fn get_cost_fixed(litlen: u32, dist: u32) -> f64 {
     let result = if dist == 0 {
         if litlen <= 143 {
             8
@@ -186,6 +187,22 @@ impl SymbolStats {
         self.litlens = [0; ZOPFLI_NUM_LL];
         self.dists = [0; ZOPFLI_NUM_D];
     }
+
+    /// Blends learned symbol probabilities into the counts, as if `weight` times
+    /// as many symbols as already counted were drawn from the prior.
+    fn add_prior(&mut self, prior: &StatsPrior, weight: f64) {
+        fn add_prior_freqs(freqs: &mut [usize], probs: &[f64], weight: f64) {
+            let total = freqs.iter().fold(0, |acc, &x| acc + x) as f64 * weight;
+            for (freq, &prob) in freqs.iter_mut().zip(probs.iter()) {
+                *freq += (prob * total).round() as usize;
+            }
+        }
+        add_prior_freqs(&mut self.litlens, prior.litlens(), weight);
+        add_prior_freqs(&mut self.dists, prior.dists(), weight);
+        self.litlens[256] = 1; // End symbol.
+
+        self.calculate_entropy();
+    }
 }
 
 fn add_weighed_stat_freqs(stats1: &SymbolStats, w1: f64, stats2: &SymbolStats, w2: f64) -> SymbolStats {
@@ -249,7 +266,7 @@ fn get_cost_model_min_cost<F>(costmodel: F) -> f64
 /// `length_array`: output array of size `(inend - instart)` which will receive the best
 ///     length to reach this byte from a previous byte.
 /// returns the cost that was, according to the `costmodel`, needed to get to the end.
-fn get_best_lengths<F, C>(s: &mut ZopfliBlockState<C>, in_data: &[u8], instart: usize, inend: usize, costmodel: F, h: &mut ZopfliHash, costs: &mut Vec<f32>) -> (f64, Vec<u16>)
+pub fn get_best_lengths<F, C>(s: &mut ZopfliBlockState<C>, in_data: &[u8], instart: usize, inend: usize, costmodel: F, h: &mut ZopfliHash, costs: &mut Vec<f32>) -> (f64, Vec<u16>)
     where F: Fn(u32, u32) -> f64,
           C: Cache,
 {
@@ -403,17 +420,24 @@ fn lz77_optimal_run<F, C>(s: &mut ZopfliBlockState<C>, in_data: &[u8], instart:
 pub fn lz77_optimal_fixed<C>(s: &mut ZopfliBlockState<C>, in_data: &[u8], instart: usize, inend: usize, store: &mut Lz77Store)
     where C: Cache,
 {
+    let mut span = trace_span!("lz77_optimal_fixed", instart = instart, inend = inend);
     s.blockstart = instart;
     s.blockend = inend;
     let mut h = ZopfliHash::new();
     let mut costs = Vec::with_capacity(inend - instart - 1);
     lz77_optimal_run(s, in_data, instart, inend, get_cost_fixed, store, &mut h, &mut costs);
+    span.arg("symbols", store.size() as u64);
 }
 
 /// Calculates lit/len and dist pairs for given data.
 /// If `instart` is larger than 0, it uses values before `instart` as starting
 /// dictionary.
-pub fn lz77_optimal<C>(s: &mut ZopfliBlockState<C>, in_data: &[u8], instart: usize, inend: usize, numiterations: i32) -> Lz77Store
+/// With `numiterations` of 0 or less, the initial greedy (or seed) LZ77 data is
+/// returned as is.
+/// `seed`: LZ77 data already known for exactly this range, for example decoded
+///     from an earlier compression of it. It replaces the initial greedy run and
+///     is kept as the result unless an iteration beats it.
+pub fn lz77_optimal<C>(s: &mut ZopfliBlockState<C>, in_data: &[u8], instart: usize, inend: usize, numiterations: i32, seed: Option<&Lz77Store>) -> Lz77Store
     where C: Cache,
 {
     /* Dist to get to here with smallest cost. */
@@ -421,9 +445,24 @@ pub fn lz77_optimal<C>(s: &mut ZopfliBlockState<C>, in_data: &[u8], instart: usi
     let mut outputstore = currentstore.clone();
 
     /* Initial run. */
-    currentstore.greedy(s, in_data, instart, inend);
+    match seed {
+        Some(seed) => currentstore = seed.clone(),
+        None => {
+            let _span = trace_span!("squeeze_greedy", instart = instart, inend = inend);
+            currentstore.greedy(s, in_data, instart, inend);
+        }
+    }
+    if numiterations <= 0 {
+        /* No squeeze runs asked for, the initial run is the result. */
+        return currentstore;
+    }
     let mut stats = SymbolStats::default();
     stats.get_statistics(&currentstore);
+    if seed.is_none() {
+        if let Some((prior, weight)) = s.options.prior() {
+            stats.add_prior(prior, weight);
+        }
+    }
 
     let mut h = ZopfliHash::new();
     let mut costs = Vec::with_capacity(inend - instart + 1);
@@ -431,6 +470,11 @@ pub fn lz77_optimal<C>(s: &mut ZopfliBlockState<C>, in_data: &[u8], instart: usi
     let mut beststats = SymbolStats::default();
 
     let mut bestcost = f64::MAX;
+    if seed.is_some() {
+        bestcost = calculate_block_size(&currentstore, 0, currentstore.size(), BlockType::Dynamic);
+        outputstore = currentstore.clone();
+        beststats = stats;
+    }
     let mut lastcost = 0.0;
     /* Try randomizing the costs a bit once the size stabilizes. */
     let mut ran_state = RanState::new();
@@ -441,12 +485,18 @@ pub fn lz77_optimal<C>(s: &mut ZopfliBlockState<C>, in_data: &[u8], instart: usi
     /* Repeat statistics with each time the cost model from the previous stat
     run. */
     for i in 0..numiterations {
+        if !s.options.take_iteration() {
+            break;
+        }
+        let mut span = trace_span!("squeeze_iteration", iteration = i, instart = instart, inend = inend);
         currentstore.reset();
         lz77_optimal_run(s, in_data, instart, inend, |a, b| get_cost_stat(a, b, &stats), &mut currentstore, &mut h, &mut costs);
         let cost = calculate_block_size(&currentstore, 0, currentstore.size(), BlockType::Dynamic);
+        span.arg("bits", cost as u64);
+        drop(span);
 
         if s.options.verbose_more || (s.options.verbose && cost < bestcost) {
-              println!("Iteration {}: {} bit", i, cost);
+              eprintln!("Iteration {}: {} bit", i, cost);
         }
         if cost < bestcost {
             /* Copy to the output store. */
@@ -472,5 +522,9 @@ pub fn lz77_optimal<C>(s: &mut ZopfliBlockState<C>, in_data: &[u8], instart: usi
         }
         lastcost = cost;
     }
+    if bestcost == f64::MAX {
+        /* Stopped before the first iteration, keep the initial run. */
+        return currentstore;
+    }
     outputstore
 }
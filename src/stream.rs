@@ -0,0 +1,275 @@
+//! Compression of data that arrives piece by piece. Input is collected until there
+//! is more than a master block of it, which is then compressed with the 32K
+//! before it as the window, exactly like `compress` would. The output is
+//! byte-for-byte the same as that of `compress` on all the input at once, while
+//! only a master block and a window of input are kept in memory. Master blocks
+//! are sized by `memory_plan` like in `compress`, so they may be smaller under
+//! `Options::max_memory`.
+//!
+//! The options are resolved like in `compress`, with the profile of the content
+//! class and the iteration budget, from the input buffered when the first master
+//! block is compressed. On input of more than a master block, that is only its
+//! start, so `min_predicted_gain` may decide differently than `compress`, which
+//! samples all of it.
+
+use std::cmp;
+use std::io::{self, Write};
+
+use adler32::RollingAdler32;
+use crc::{crc32, Hasher32};
+
+use cancel::{memory_plan, MemoryPlan};
+use deflate::{add_empty_final_block, add_empty_stored_block, deflate_part, BitwiseWriter, BlockType};
+use gzip::{gzip_header, gzip_trailer};
+use util::{ZOPFLI_MASTER_BLOCK_SIZE, ZOPFLI_WINDOW_SIZE};
+use zlib::{zlib_header, zlib_trailer};
+use {resolve_options, Format, Options};
+
+/// Compresses everything written to it into `out`. Call `finish` at the end,
+/// dropping it without that leaves an incomplete stream.
+pub struct Encoder<W>
+    where W: Write
+{
+    options: Options,
+    /* The options resolved for the input, once a master block is compressed. */
+    resolved: Option<Options>,
+    output_type: Format,
+    /* The last bytes already compressed, up to a window of them, followed by
+    the bytes that weren't compressed yet. */
+    buffer: Vec<u8>,
+    /* How many bytes at the start of buffer were already compressed. */
+    window: usize,
+    /* Whether more than a master block was written, after which the master
+    blocks are as big as those of compress on any longer input. */
+    long: bool,
+    crc: crc32::Digest,
+    adler: RollingAdler32,
+    size: u32,
+    bitwise_writer: BitwiseWriter<W>,
+}
+
+impl<W> Encoder<W>
+    where W: Write
+{
+    /// Starts a stream of `output_type` on `out`, writing its header.
+    pub fn new(options: &Options, output_type: Format, mut out: W) -> io::Result<Encoder<W>> {
+        match output_type {
+            Format::Gzip => try!(gzip_header(&mut out)),
+            Format::Zlib => try!(zlib_header(&mut out)),
+            Format::Deflate => {},
+        }
+        Ok(Encoder {
+            options: options.clone(),
+            resolved: None,
+            output_type: output_type,
+            buffer: vec![],
+            window: 0,
+            long: false,
+            crc: crc32::Digest::new(crc32::IEEE),
+            adler: RollingAdler32::new(),
+            size: 0,
+            bitwise_writer: BitwiseWriter::new(out),
+        })
+    }
+
+    /// Compresses what is left, ending the stream, and returns the writer.
+    pub fn finish(mut self) -> io::Result<W> {
+        if self.buffer.len() > self.window {
+            let plan = self.plan();
+            while self.buffer.len() - self.window > plan.master_block_size {
+                try!(self.compress_block(&plan, false));
+            }
+            try!(self.compress_block(&plan, true));
+        } else {
+            /* There was no input, or the blocks so far ended at a flush and
+            aren't final, so one more is needed. */
+            try!(add_empty_final_block(&mut self.bitwise_writer));
+        }
+        try!(self.bitwise_writer.finish_partial_bits());
+
+        let mut out = self.bitwise_writer.into_inner();
+        match self.output_type {
+            Format::Gzip => try!(gzip_trailer(self.crc.sum32(), self.size, &mut out)),
+            Format::Zlib => try!(zlib_trailer(self.adler.hash(), &mut out)),
+            Format::Deflate => {},
+        }
+        Ok(out)
+    }
+
+    /// Compresses the input so far and ends the output at a byte boundary with an
+    /// empty stored block, like a sync flush of zlib, so a decoder can decode
+    /// everything written so far. This makes the output differ from that of
+    /// `compress`, and costs a bit of compression every time.
+    pub fn sync_flush(&mut self) -> io::Result<()> {
+        let plan = self.plan();
+        while self.buffer.len() > self.window {
+            try!(self.compress_block(&plan, false));
+        }
+        try!(add_empty_stored_block(&mut self.bitwise_writer));
+        self.bitwise_writer.get_mut().flush()
+    }
+
+    /// Like `sync_flush`, but also forgets the window, so decoding can start over
+    /// from here.
+    pub fn full_flush(&mut self) -> io::Result<()> {
+        try!(self.sync_flush());
+        self.buffer.clear();
+        self.window = 0;
+        Ok(())
+    }
+
+    /// The checksum of the input so far that the trailer will have: CRC-32 for
+    /// gzip, Adler-32 otherwise.
+    pub fn checksum(&self) -> u32 {
+        match self.output_type {
+            Format::Gzip => self.crc.sum32(),
+            _ => self.adler.hash(),
+        }
+    }
+
+    /// Changes the options for the master blocks compressed from now on, which
+    /// includes the input written so far that wasn't compressed yet. They are
+    /// resolved again from that input.
+    pub fn set_options(&mut self, options: &Options) {
+        self.options = options.clone();
+        self.resolved = None;
+    }
+
+    pub fn get_mut(&mut self) -> &mut W {
+        self.bitwise_writer.get_mut()
+    }
+
+    /// The plan `compress` would have for the input, judged by what is buffered
+    /// until there was more than a master block of it. Resolves the options
+    /// first if that wasn't done yet.
+    fn plan(&mut self) -> MemoryPlan {
+        if self.resolved.is_none() {
+            self.resolved = Some(resolve_options(&self.options, &self.buffer[self.window..]));
+        }
+        let insize = if self.long { ZOPFLI_MASTER_BLOCK_SIZE + 1 } else { self.buffer.len() - self.window };
+        memory_plan(self.resolved.as_ref().unwrap(), insize)
+    }
+
+    /// Compresses the next master block of the buffer, or all that's left if
+    /// there is less than a master block.
+    fn compress_block(&mut self, plan: &MemoryPlan, final_block: bool) -> io::Result<()> {
+        let mut options = self.resolved.clone().expect("compressing before planning");
+        try!(options.check_cancelled());
+        let instart = self.window;
+        let inend = cmp::min(self.buffer.len(), instart + plan.master_block_size);
+        debug_assert!(!final_block || inend == self.buffer.len());
+        options.cache_length = plan.cache_length;
+        try!(deflate_part(&options, BlockType::Dynamic, final_block, &self.buffer, instart, inend, None, &mut self.bitwise_writer));
+
+        let keep_from = inend - cmp::min(inend, ZOPFLI_WINDOW_SIZE);
+        self.buffer.drain(..keep_from);
+        self.window = inend - keep_from;
+        Ok(())
+    }
+}
+
+impl<W> Write for Encoder<W>
+    where W: Write
+{
+    fn write(&mut self, buf: &[u8]) -> io::Result<usize> {
+        self.buffer.extend_from_slice(buf);
+        self.crc.write(buf);
+        self.adler.update_buffer(buf);
+        self.size = self.size.wrapping_add(buf.len() as u32);
+
+        /* Only compress a master block when more input follows it, so the last
+        one can be marked final just like compress does. */
+        if self.buffer.len() - self.window > ZOPFLI_MASTER_BLOCK_SIZE {
+            self.long = true;
+        }
+        if self.long {
+            let plan = self.plan();
+            while self.buffer.len() - self.window > plan.master_block_size {
+                try!(self.compress_block(&plan, false));
+            }
+        }
+        Ok(buf.len())
+    }
+
+    /// Input can't be compressed before the master block it is in is complete,
+    /// so this only flushes the output that is already there.
+    fn flush(&mut self) -> io::Result<()> {
+        self.bitwise_writer.get_mut().flush()
+    }
+}
+
+#[cfg(test)]
+mod test {
+    use super::*;
+    use compress;
+
+    #[test]
+    fn streamed_output_matches_compress() {
+        let js = include_bytes!("../test/data/codetriage.js");
+        let in_data: Vec<u8> = js.iter().cycle().take(ZOPFLI_MASTER_BLOCK_SIZE + 54321).cloned().collect();
+        let mut options = Options::default();
+        options.numiterations = 1;
+
+        for output_type in &[Format::Gzip, Format::Zlib, Format::Deflate] {
+            let mut expected = vec![];
+            compress(&options, output_type, &in_data, &mut expected).unwrap();
+
+            let mut encoder = Encoder::new(&options, *output_type, vec![]).unwrap();
+            for chunk in in_data.chunks(300007) {
+                encoder.write_all(chunk).unwrap();
+            }
+            assert_eq!(encoder.finish().unwrap(), expected);
+        }
+
+        /* A memory budget makes the master blocks smaller in both. */
+        options.max_memory = Some(1 << 20);
+        let mut expected = vec![];
+        compress(&options, &Format::Gzip, &in_data, &mut expected).unwrap();
+        let mut encoder = Encoder::new(&options, Format::Gzip, vec![]).unwrap();
+        for chunk in in_data.chunks(300007) {
+            encoder.write_all(chunk).unwrap();
+        }
+        assert_eq!(encoder.finish().unwrap(), expected);
+    }
+
+    #[test]
+    fn profiles_apply_like_in_compress() {
+        let data = include_bytes!("../test/data/codetriage.js");
+        let mut options = Options::default();
+        let profiles = "profile js numiterations 1 blocksplittingmax 3 max_chain_hits 8192 cache_length 8";
+        options.profiles = Some(::std::sync::Arc::new(::ProfileSet::parse(profiles).unwrap()));
+
+        let mut expected = vec![];
+        compress(&options, &Format::Gzip, data, &mut expected).unwrap();
+        let mut encoder = Encoder::new(&options, Format::Gzip, vec![]).unwrap();
+        encoder.write_all(data).unwrap();
+        assert_eq!(encoder.finish().unwrap(), expected);
+    }
+
+    #[test]
+    fn flushed_output_decodes() {
+        let data = include_bytes!("../test/data/30-min.csv");
+        let options = Options::default();
+        let mut encoder = Encoder::new(&options, Format::Zlib, vec![]).unwrap();
+        encoder.write_all(&data[..500]).unwrap();
+        encoder.sync_flush().unwrap();
+        assert!(encoder.get_mut().ends_with(&[0, 0, 0xff, 0xff]));
+        encoder.write_all(&data[500..]).unwrap();
+        encoder.full_flush().unwrap();
+        let out = encoder.finish().unwrap();
+        assert_eq!(&::inflate::decode(&out).unwrap().data[..], &data[..]);
+    }
+
+    #[test]
+    fn empty_input_gives_a_valid_stream() {
+        let options = Options::default();
+        for output_type in &[Format::Gzip, Format::Zlib, Format::Deflate] {
+            let mut expected = vec![];
+            compress(&options, output_type, &[], &mut expected).unwrap();
+            ::inflate::verify(output_type, &expected, &[]).unwrap();
+
+            let encoder = Encoder::new(&options, *output_type, vec![]).unwrap();
+            assert_eq!(encoder.finish().unwrap(), expected);
+        }
+    }
+}
@@ -0,0 +1,164 @@
+//! Spans of the stages of a compression, for seeing where its time goes.
+//!
+//! `trace_span!("name", key = value, ...)` starts a span that ends when the
+//! returned guard is dropped. With the `trace` feature, it is recorded with its
+//! thread and arguments, and `write_chrome_trace` writes everything recorded so
+//! far in the Chrome trace event format, which chrome://tracing and Perfetto
+//! open. Without the feature the guard is an empty struct and the arguments
+//! aren't even evaluated, so the spans cost nothing.
+
+#[cfg(feature = "trace")]
+use std::cell::Cell;
+#[cfg(feature = "trace")]
+use std::io::{self, Write};
+#[cfg(feature = "trace")]
+use std::sync::atomic::{AtomicUsize, Ordering};
+#[cfg(feature = "trace")]
+use std::sync::{Mutex, OnceLock};
+#[cfg(feature = "trace")]
+use std::time::Instant;
+
+#[cfg(feature = "trace")]
+macro_rules! trace_span {
+    ($name:expr $(, $key:ident = $value:expr)*) => {
+        ::trace::Span::new($name, vec![$((stringify!($key), $value as u64)),*])
+    };
+}
+
+#[cfg(not(feature = "trace"))]
+macro_rules! trace_span {
+    ($name:expr $(, $key:ident = $value:expr)*) => {
+        ::trace::Span
+    };
+}
+
+/// A finished span.
+#[cfg(feature = "trace")]
+struct Event {
+    name: &'static str,
+    args: Vec<(&'static str, u64)>,
+    thread: usize,
+    /* Microseconds since the first span started. */
+    start: f64,
+    duration: f64,
+}
+
+#[cfg(feature = "trace")]
+static EVENTS: Mutex<Vec<Event>> = Mutex::new(Vec::new());
+#[cfg(feature = "trace")]
+static EPOCH: OnceLock<Instant> = OnceLock::new();
+#[cfg(feature = "trace")]
+static THREADS: AtomicUsize = AtomicUsize::new(0);
+
+#[cfg(feature = "trace")]
+thread_local! {
+    /* Small ids in the order threads first record a span, as the trace viewers
+    show them. */
+    static THREAD: Cell<usize> = Cell::new(0);
+}
+
+#[cfg(feature = "trace")]
+fn thread_id() -> usize {
+    THREAD.with(|thread| {
+        if thread.get() == 0 {
+            thread.set(THREADS.fetch_add(1, Ordering::Relaxed) + 1);
+        }
+        thread.get()
+    })
+}
+
+/// Guard of a span started by `trace_span!`, recorded when dropped.
+#[cfg(feature = "trace")]
+pub struct Span {
+    name: &'static str,
+    args: Vec<(&'static str, u64)>,
+    start: Instant,
+}
+
+#[cfg(not(feature = "trace"))]
+pub struct Span;
+
+#[cfg(feature = "trace")]
+impl Span {
+    pub fn new(name: &'static str, args: Vec<(&'static str, u64)>) -> Span {
+        let start = Instant::now();
+        EPOCH.get_or_init(|| start);
+        Span {
+            name: name,
+            args: args,
+            start: start,
+        }
+    }
+
+    /// Adds an argument only known by the end of the span, like its result.
+    pub fn arg(&mut self, key: &'static str, value: u64) {
+        self.args.push((key, value));
+    }
+}
+
+#[cfg(not(feature = "trace"))]
+impl Span {
+    #[inline(always)]
+    pub fn arg(&mut self, _key: &'static str, _value: u64) {}
+}
+
+#[cfg(feature = "trace")]
+impl Drop for Span {
+    fn drop(&mut self) {
+        let epoch = *EPOCH.get().unwrap();
+        let event = Event {
+            name: self.name,
+            args: ::std::mem::replace(&mut self.args, vec![]),
+            thread: thread_id(),
+            start: micros(self.start.duration_since(epoch)),
+            duration: micros(self.start.elapsed()),
+        };
+        EVENTS.lock().unwrap().push(event);
+    }
+}
+
+#[cfg(feature = "trace")]
+fn micros(duration: ::std::time::Duration) -> f64 {
+    duration.as_secs() as f64 * 1e6 + duration.subsec_nanos() as f64 / 1e3
+}
+
+/// Writes the spans recorded since the last call as a Chrome trace event JSON
+/// object, one complete ("X") event per span, and forgets them.
+#[cfg(feature = "trace")]
+pub fn write_chrome_trace<W>(mut out: W) -> io::Result<()>
+    where W: Write
+{
+    let events = ::std::mem::replace(&mut *EVENTS.lock().unwrap(), vec![]);
+    try!(writeln!(out, "{{\"traceEvents\": ["));
+    for (i, event) in events.iter().enumerate() {
+        let args: Vec<String> = event.args.iter().map(|&(key, value)| format!("\"{}\": {}", key, value)).collect();
+        try!(writeln!(out, "  {{\"name\": \"{}\", \"cat\": \"zopfli\", \"ph\": \"X\", \"pid\": 1, \"tid\": {}, \"ts\": {:.3}, \"dur\": {:.3}, \"args\": {{{}}}}}{}",
+                      event.name, event.thread, event.start, event.duration, args.join(", "),
+                      if i + 1 < events.len() { "," } else { "" }));
+    }
+    writeln!(out, "], \"displayTimeUnit\": \"ms\"}}")
+}
+
+#[cfg(all(test, feature = "trace"))]
+mod test {
+    use super::*;
+
+    #[test]
+    fn records_nested_spans() {
+        {
+            let mut outer = trace_span!("outer", instart = 0usize, inend = 100usize);
+            {
+                let _inner = trace_span!("inner", iteration = 1i32);
+            }
+            outer.arg("bits", 42);
+        }
+        let mut json = vec![];
+        write_chrome_trace(&mut json).unwrap();
+        let json = String::from_utf8(json).unwrap();
+        // Spans are recorded when they end, so the inner one comes first
+        let inner = json.find("\"name\": \"inner\"").unwrap();
+        let outer = json.find("\"name\": \"outer\"").unwrap();
+        assert!(inner < outer);
+        assert!(json.contains("\"args\": {\"instart\": 0, \"inend\": 100, \"bits\": 42}"));
+    }
+}
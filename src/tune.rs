@@ -0,0 +1,331 @@
+//! Choosing the numbers in the options per content class. Which iteration
+//! count, block split limit, chain limit and cache length are worth their time
+//! differs a lot between kinds of files, so `autotune` tries a few of each on
+//! samples of a corpus and measures what every step costs in CPU time and saves
+//! in bytes. The profiles it recommends can be saved and loaded into
+//! `Options::profiles`.
+
+use std::io;
+use std::str::FromStr;
+use std::time::Instant;
+
+use {compress, ContentClass, Format, Options};
+
+/// The numbers of the options that a profile sets.
+#[derive(Copy, Clone, Debug, PartialEq)]
+pub struct Profile {
+    pub numiterations: i32,
+    pub blocksplittingmax: i32,
+    pub max_chain_hits: usize,
+    pub cache_length: usize,
+}
+
+impl Profile {
+    /// The numbers in `options`.
+    pub fn of(options: &Options) -> Profile {
+        Profile {
+            numiterations: options.numiterations,
+            blocksplittingmax: options.blocksplittingmax,
+            max_chain_hits: options.max_chain_hits,
+            cache_length: options.cache_length,
+        }
+    }
+
+    pub fn apply(&self, options: &mut Options) {
+        options.numiterations = self.numiterations;
+        options.blocksplittingmax = self.blocksplittingmax;
+        options.max_chain_hits = self.max_chain_hits;
+        options.cache_length = self.cache_length;
+    }
+}
+
+/// Profiles per content class, and for inputs of no known class.
+#[derive(Clone, Debug, Default)]
+pub struct ProfileSet {
+    profiles: Vec<(Option<ContentClass>, Profile)>,
+}
+
+impl ProfileSet {
+    pub fn new() -> ProfileSet {
+        ProfileSet::default()
+    }
+
+    pub fn insert(&mut self, class: Option<ContentClass>, profile: Profile) {
+        self.profiles.retain(|&(c, _)| c != class);
+        self.profiles.push((class, profile));
+    }
+
+    pub fn get(&self, class: Option<ContentClass>) -> Option<&Profile> {
+        self.profiles.iter().find(|&&(c, _)| c == class).map(|&(_, ref profile)| profile)
+    }
+
+    /// Writes the profiles in the text format `parse` reads, a line per class:
+    /// `profile <class> numiterations <n> blocksplittingmax <n> max_chain_hits
+    /// <n> cache_length <n>`, where the class is `other` for inputs of no known
+    /// class.
+    pub fn serialize(&self) -> String {
+        let mut text = String::new();
+        for &(class, ref profile) in &self.profiles {
+            text.push_str(&format!("profile {} numiterations {} blocksplittingmax {} max_chain_hits {} cache_length {}\n",
+                                   class_name(class), profile.numiterations, profile.blocksplittingmax, profile.max_chain_hits, profile.cache_length));
+        }
+        text
+    }
+
+    /// Reads profiles written by `serialize`.
+    pub fn parse(text: &str) -> io::Result<ProfileSet> {
+        let mut set = ProfileSet::new();
+        for line in text.lines().map(|line| line.trim()).filter(|line| !line.is_empty() && !line.starts_with('#')) {
+            match line.split_whitespace().collect::<Vec<_>>().as_slice() {
+                ["profile", class, "numiterations", numiterations, "blocksplittingmax", blocksplittingmax, "max_chain_hits", max_chain_hits, "cache_length", cache_length] => {
+                    let class = if *class == "other" { None } else { Some(try!(class.parse::<ContentClass>())) };
+                    let profile = match (numiterations.parse::<i32>(), blocksplittingmax.parse::<i32>(), max_chain_hits.parse(), cache_length.parse::<usize>()) {
+                        (Ok(numiterations), Ok(blocksplittingmax), Ok(max_chain_hits), Ok(cache_length))
+                            if numiterations >= 0 && blocksplittingmax >= 0 && cache_length >= 1 && cache_length <= 256 => Profile {
+                            numiterations: numiterations,
+                            blocksplittingmax: blocksplittingmax,
+                            max_chain_hits: max_chain_hits,
+                            cache_length: cache_length,
+                        },
+                        _ => return Err(invalid("invalid profile value")),
+                    };
+                    set.insert(class, profile);
+                }
+                _ => return Err(invalid("expected a profile line")),
+            }
+        }
+        Ok(set)
+    }
+}
+
+impl FromStr for ProfileSet {
+    type Err = io::Error;
+
+    fn from_str(text: &str) -> io::Result<ProfileSet> {
+        ProfileSet::parse(text)
+    }
+}
+
+fn class_name(class: Option<ContentClass>) -> &'static str {
+    class.map_or("other", |class| class.name())
+}
+
+/// How a profile did on the samples of a class.
+#[derive(Copy, Clone, Debug)]
+pub struct Trial {
+    pub profile: Profile,
+    /* Compressed size of the samples. */
+    pub size: usize,
+    /* CPU time it took, in seconds. */
+    pub seconds: f64,
+}
+
+/// The trials of a content class and the profile recommended from them.
+#[derive(Clone, Debug)]
+pub struct Tuning {
+    pub class: Option<ContentClass>,
+    /* Bytes of samples the trials compressed. */
+    pub sample_size: usize,
+    pub trials: Vec<Trial>,
+    pub profile: Profile,
+}
+
+/// Bytes of each input that are sampled, in pieces spread over it.
+const SAMPLE_PER_INPUT: usize = 64 * 1024;
+const SAMPLE_PIECES: usize = 4;
+/// Most bytes of samples per content class.
+const SAMPLE_PER_CLASS: usize = 256 * 1024;
+
+/// The values that are tried for each number, one number after another.
+const NUMITERATIONS: &'static [i32] = &[1, 5, 10, 15, 30];
+const BLOCKSPLITTINGMAX: &'static [i32] = &[5, 15, 30];
+const MAX_CHAIN_HITS: &'static [usize] = &[256, 1024, 8192, 32768];
+const CACHE_LENGTH: &'static [usize] = &[2, 8, 32];
+
+/// Recommends a profile for every content class among `inputs`, starting from
+/// the numbers in `options`. Each number is tuned in turn with the others kept:
+/// of the values tried, the cheapest is taken, and then the next more expensive
+/// one as long as it saves at least `min_rate` bytes per CPU second more.
+/// Everything runs on the calling thread, to measure the CPU time of one.
+pub fn autotune<'a, I>(options: &Options, inputs: I, min_rate: f64) -> Vec<Tuning>
+    where I: IntoIterator<Item = &'a [u8]>
+{
+    let mut samples: Vec<(Option<ContentClass>, Vec<u8>)> = vec![];
+    for input in inputs {
+        let class = options.content_class.or_else(|| ContentClass::sniff(input));
+        let index = match samples.iter().position(|&(c, _)| c == class) {
+            Some(index) => index,
+            None => {
+                samples.push((class, vec![]));
+                samples.len() - 1
+            }
+        };
+        let sample = &mut samples[index].1;
+        if sample.len() < SAMPLE_PER_CLASS {
+            add_sample(sample, input);
+        }
+    }
+
+    let mut options = options.clone();
+    options.verbose = false;
+    options.verbose_more = false;
+    options.executor = None;
+    options.cache = None;
+    options.profiles = None;
+    options.min_predicted_gain = 0.0;
+    samples.into_iter().map(|(class, sample)| {
+        options.content_class = class;
+        tune_class(&options, class, &sample, min_rate)
+    }).collect()
+}
+
+/// Appends pieces from the start, the end and evenly in between of `input`.
+fn add_sample(sample: &mut Vec<u8>, input: &[u8]) {
+    if input.len() <= SAMPLE_PER_INPUT {
+        sample.extend_from_slice(input);
+        return;
+    }
+    let piece = SAMPLE_PER_INPUT / SAMPLE_PIECES;
+    for i in 0..SAMPLE_PIECES {
+        let start = (input.len() - piece) * i / (SAMPLE_PIECES - 1);
+        sample.extend_from_slice(&input[start..start + piece]);
+    }
+}
+
+fn tune_class(options: &Options, class: Option<ContentClass>, sample: &[u8], min_rate: f64) -> Tuning {
+    let mut trials: Vec<Trial> = vec![];
+    let mut best = Profile::of(options);
+    {
+        let mut run = |profile: Profile| -> Trial {
+            if let Some(trial) = trials.iter().find(|trial| trial.profile == profile) {
+                return *trial;
+            }
+            let mut options = options.clone();
+            profile.apply(&mut options);
+            let start = cpu_time();
+            let mut out = vec![];
+            compress(&options, &Format::Deflate, sample, &mut out).expect("compressing to a Vec doesn't fail");
+            let trial = Trial {
+                profile: profile,
+                size: out.len(),
+                seconds: cpu_time() - start,
+            };
+            trials.push(trial);
+            trial
+        };
+
+        let steps: [&dyn Fn(&mut Profile, usize); 4] = [
+            &|profile, i| profile.numiterations = NUMITERATIONS[i],
+            &|profile, i| profile.blocksplittingmax = BLOCKSPLITTINGMAX[i],
+            &|profile, i| profile.max_chain_hits = MAX_CHAIN_HITS[i],
+            &|profile, i| profile.cache_length = CACHE_LENGTH[i],
+        ];
+        let counts = [NUMITERATIONS.len(), BLOCKSPLITTINGMAX.len(), MAX_CHAIN_HITS.len(), CACHE_LENGTH.len()];
+        for (step, &count) in steps.iter().zip(&counts) {
+            let candidates: Vec<Trial> = (0..count).map(|i| {
+                let mut profile = best;
+                step(&mut profile, i);
+                run(profile)
+            }).collect();
+            best = choose(candidates, min_rate).profile;
+        }
+    }
+    Tuning {
+        class: class,
+        sample_size: sample.len(),
+        trials: trials,
+        profile: best,
+    }
+}
+
+/// Walks from the cheapest of `candidates` to more expensive ones while each
+/// step saves at least `min_rate` bytes per extra CPU second, skipping those
+/// that cost more without compressing better.
+fn choose(mut candidates: Vec<Trial>, min_rate: f64) -> Trial {
+    candidates.sort_by(|a, b| a.seconds.partial_cmp(&b.seconds).unwrap());
+    let mut chosen = candidates[0];
+    for &candidate in &candidates[1..] {
+        if candidate.size >= chosen.size {
+            continue;
+        }
+        let rate = (chosen.size - candidate.size) as f64 / (candidate.seconds - chosen.seconds).max(1e-9);
+        if rate < min_rate {
+            break;
+        }
+        chosen = candidate;
+    }
+    chosen
+}
+
+/// CPU time of the calling thread in seconds, or the time since some point in
+/// the past where that isn't available.
+#[cfg(all(target_os = "linux", target_pointer_width = "64"))]
+fn cpu_time() -> f64 {
+    #[repr(C)]
+    struct Timespec {
+        tv_sec: i64,
+        tv_nsec: i64,
+    }
+    extern "C" {
+        fn clock_gettime(clock: i32, time: *mut Timespec) -> i32;
+    }
+    const CLOCK_THREAD_CPUTIME_ID: i32 = 3;
+
+    let mut time = Timespec { tv_sec: 0, tv_nsec: 0 };
+    if unsafe { clock_gettime(CLOCK_THREAD_CPUTIME_ID, &mut time) } != 0 {
+        return wall_time();
+    }
+    time.tv_sec as f64 + time.tv_nsec as f64 / 1e9
+}
+
+#[cfg(not(all(target_os = "linux", target_pointer_width = "64")))]
+fn cpu_time() -> f64 {
+    wall_time()
+}
+
+#[allow(dead_code)]
+fn wall_time() -> f64 {
+    use std::sync::OnceLock;
+    static START: OnceLock<Instant> = OnceLock::new();
+    START.get_or_init(Instant::now).elapsed().as_secs_f64()
+}
+
+fn invalid(msg: &str) -> io::Error {
+    io::Error::new(io::ErrorKind::InvalidData, msg)
+}
+
+#[cfg(test)]
+mod test {
+    use std::sync::Arc;
+
+    use super::*;
+
+    #[test]
+    fn recommends_profiles_that_load() {
+        let js = &include_bytes!("../test/data/codetriage.js")[..16384];
+        let png = include_bytes!("../test/data/heartbleed.png");
+        let tunings = autotune(&Options::default(), vec![js, &png[..]], 0.0);
+        assert_eq!(tunings.iter().map(|tuning| tuning.class).collect::<Vec<_>>(), vec![Some(ContentClass::Js), None]);
+
+        let mut profiles = ProfileSet::new();
+        for tuning in &tunings {
+            /* Free time takes whatever compresses best. */
+            let smallest = tuning.trials.iter().map(|trial| trial.size).min().unwrap();
+            assert_eq!(tuning.trials.iter().find(|trial| trial.profile == tuning.profile).unwrap().size, smallest);
+            profiles.insert(tuning.class, tuning.profile);
+        }
+        let profiles = ProfileSet::parse(&profiles.serialize()).unwrap();
+        assert_eq!(profiles.get(Some(ContentClass::Js)), Some(&tunings[0].profile));
+        assert!(ProfileSet::parse("profile other numiterations 15 blocksplittingmax -1 max_chain_hits 8192 cache_length 8").is_err());
+
+        let mut options = Options::default();
+        options.profiles = Some(Arc::new(profiles));
+        let mut profiled = vec![];
+        compress(&options, &Format::Gzip, js, &mut profiled).unwrap();
+        let mut expected = vec![];
+        let mut tuned = Options::default();
+        tunings[0].profile.apply(&mut tuned);
+        compress(&tuned, &Format::Gzip, js, &mut expected).unwrap();
+        assert_eq!(profiled, expected);
+    }
+}
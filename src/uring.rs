@@ -0,0 +1,318 @@
+//! Just enough of io_uring for batch reads and writes: a submission and a
+//! completion queue, with READ and WRITE operations. The structures and
+//! constants are those of linux/io_uring.h. Rings are only set up where those
+//! operations are supported, which takes Linux 5.6.
+
+use std::io;
+use std::mem;
+use std::os::raw::{c_int, c_long, c_uint, c_void};
+use std::os::unix::io::RawFd;
+use std::ptr;
+use std::sync::atomic::{AtomicU32, Ordering};
+
+/* Setup, enter and register. These numbers are shared by the architectures
+below; others, like MIPS, Alpha and x32, number them differently and go without
+io_uring. */
+#[cfg(any(target_arch = "x86", all(target_arch = "x86_64", target_pointer_width = "64"), target_arch = "arm", target_arch = "aarch64",
+          target_arch = "riscv32", target_arch = "riscv64", target_arch = "powerpc", target_arch = "powerpc64", target_arch = "s390x",
+          target_arch = "loongarch64", target_arch = "sparc64"))]
+const SYSCALLS: Option<(c_long, c_long, c_long)> = Some((425, 426, 427));
+#[cfg(not(any(target_arch = "x86", all(target_arch = "x86_64", target_pointer_width = "64"), target_arch = "arm", target_arch = "aarch64",
+              target_arch = "riscv32", target_arch = "riscv64", target_arch = "powerpc", target_arch = "powerpc64", target_arch = "s390x",
+              target_arch = "loongarch64", target_arch = "sparc64")))]
+const SYSCALLS: Option<(c_long, c_long, c_long)> = None;
+
+const IORING_OFF_SQ_RING: c_long = 0;
+const IORING_OFF_CQ_RING: c_long = 0x8000000;
+const IORING_OFF_SQES: c_long = 0x10000000;
+const IORING_ENTER_GETEVENTS: c_uint = 1;
+const IORING_REGISTER_PROBE: c_uint = 8;
+const IO_URING_OP_SUPPORTED: u16 = 1;
+/* Opcodes a probe asks about. */
+const PROBE_OPS: usize = 64;
+
+const IORING_OP_READ: u8 = 22;
+const IORING_OP_WRITE: u8 = 23;
+
+const PROT_READ: c_int = 1;
+const PROT_WRITE: c_int = 2;
+const MAP_SHARED: c_int = 1;
+const MAP_POPULATE: c_int = 0x8000;
+const MAP_FAILED: *mut c_void = !0usize as *mut c_void;
+
+extern "C" {
+    fn syscall(number: c_long, ...) -> c_long;
+    fn mmap(addr: *mut c_void, len: usize, prot: c_int, flags: c_int, fd: c_int, offset: c_long) -> *mut c_void;
+    fn munmap(addr: *mut c_void, len: usize) -> c_int;
+    fn close(fd: c_int) -> c_int;
+}
+
+#[repr(C)]
+#[derive(Default)]
+struct SqringOffsets {
+    head: u32,
+    tail: u32,
+    ring_mask: u32,
+    ring_entries: u32,
+    flags: u32,
+    dropped: u32,
+    array: u32,
+    resv1: u32,
+    user_addr: u64,
+}
+
+#[repr(C)]
+#[derive(Default)]
+struct CqringOffsets {
+    head: u32,
+    tail: u32,
+    ring_mask: u32,
+    ring_entries: u32,
+    overflow: u32,
+    cqes: u32,
+    flags: u32,
+    resv1: u32,
+    user_addr: u64,
+}
+
+#[repr(C)]
+#[derive(Default)]
+struct Params {
+    sq_entries: u32,
+    cq_entries: u32,
+    flags: u32,
+    sq_thread_cpu: u32,
+    sq_thread_idle: u32,
+    features: u32,
+    wq_fd: u32,
+    resv: [u32; 3],
+    sq_off: SqringOffsets,
+    cq_off: CqringOffsets,
+}
+
+#[repr(C)]
+struct Sqe {
+    opcode: u8,
+    flags: u8,
+    ioprio: u16,
+    fd: i32,
+    off: u64,
+    addr: u64,
+    len: u32,
+    rw_flags: u32,
+    user_data: u64,
+    buf_index: u16,
+    personality: u16,
+    splice_fd_in: i32,
+    addr3: u64,
+    pad: u64,
+}
+
+#[repr(C)]
+struct ProbeOp {
+    op: u8,
+    resv: u8,
+    flags: u16,
+    resv2: u32,
+}
+
+#[repr(C)]
+struct Probe {
+    last_op: u8,
+    ops_len: u8,
+    resv: u16,
+    resv2: [u32; 3],
+    ops: [ProbeOp; PROBE_OPS],
+}
+
+#[repr(C)]
+struct Cqe {
+    user_data: u64,
+    res: i32,
+    flags: u32,
+}
+
+/// A memory mapped region of the ring.
+struct Region {
+    ptr: *mut u8,
+    len: usize,
+}
+
+impl Region {
+    fn map(fd: RawFd, len: usize, offset: c_long) -> io::Result<Region> {
+        let ptr = unsafe { mmap(ptr::null_mut(), len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, offset) };
+        if ptr == MAP_FAILED {
+            return Err(io::Error::last_os_error());
+        }
+        Ok(Region {
+            ptr: ptr as *mut u8,
+            len: len,
+        })
+    }
+
+    unsafe fn at<T>(&self, offset: u32) -> *mut T {
+        self.ptr.add(offset as usize) as *mut T
+    }
+}
+
+impl Drop for Region {
+    fn drop(&mut self) {
+        unsafe { munmap(self.ptr as *mut c_void, self.len) };
+    }
+}
+
+pub struct Ring {
+    fd: RawFd,
+    enter: c_long,
+    sq: Region,
+    cq: Region,
+    sqes: Region,
+    params: Params,
+    /* Submitted to the ring, but not yet to the kernel. */
+    unsubmitted: u32,
+    /* Submitted, not completed yet. */
+    in_flight: usize,
+}
+
+impl Ring {
+    /// Sets up a ring for `entries` operations at a time. Fails on kernels
+    /// without io_uring or where it isn't allowed, like in some containers, and
+    /// on kernels before 5.6, whose io_uring has no READ and WRITE.
+    pub fn new(entries: u32) -> io::Result<Ring> {
+        let (setup, enter, register) = match SYSCALLS {
+            Some(syscalls) => syscalls,
+            None => return Err(io::Error::new(io::ErrorKind::Other, "io_uring isn't supported on this architecture")),
+        };
+        let mut params = Params::default();
+        let fd = unsafe { syscall(setup, entries as c_uint, &mut params as *mut Params) };
+        if fd < 0 {
+            return Err(io::Error::last_os_error());
+        }
+        let fd = fd as RawFd;
+        let regions = Region::map(fd, (params.sq_off.array + params.sq_entries * 4) as usize, IORING_OFF_SQ_RING)
+            .and_then(|sq| Region::map(fd, (params.cq_off.cqes + params.cq_entries * 16) as usize, IORING_OFF_CQ_RING).map(|cq| (sq, cq)))
+            .and_then(|(sq, cq)| Region::map(fd, params.sq_entries as usize * 64, IORING_OFF_SQES).map(|sqes| (sq, cq, sqes)));
+        let (sq, cq, sqes) = match regions {
+            Ok(regions) => regions,
+            Err(err) => {
+                unsafe { close(fd) };
+                return Err(err);
+            }
+        };
+        let ring = Ring {
+            fd: fd,
+            enter: enter,
+            sq: sq,
+            cq: cq,
+            sqes: sqes,
+            params: params,
+            unsubmitted: 0,
+            in_flight: 0,
+        };
+        if !ring.supports(register, &[IORING_OP_READ, IORING_OP_WRITE]) {
+            return Err(io::Error::new(io::ErrorKind::Other, "io_uring has no READ and WRITE"));
+        }
+        Ok(ring)
+    }
+
+    /// Whether the kernel supports all of `opcodes`. Kernels before 5.6 can't be
+    /// probed, and don't have READ and WRITE either.
+    fn supports(&self, register: c_long, opcodes: &[u8]) -> bool {
+        let mut probe: Box<Probe> = Box::new(unsafe { mem::zeroed() });
+        let ret = unsafe { syscall(register, self.fd as c_int, IORING_REGISTER_PROBE, &mut *probe as *mut Probe, PROBE_OPS as c_uint) };
+        if ret < 0 {
+            return false;
+        }
+        opcodes.iter().all(|&op| op <= probe.last_op && probe.ops[op as usize].flags & IO_URING_OP_SUPPORTED != 0)
+    }
+
+    /// Whether another operation can be queued before `submit_and_wait`.
+    pub fn has_room(&self) -> bool {
+        self.in_flight < self.params.sq_entries as usize && self.in_flight < self.params.cq_entries as usize
+    }
+
+    pub fn in_flight(&self) -> usize {
+        self.in_flight
+    }
+
+    /// Queues a read of `len` bytes at `offset` of `fd` into `buf`. The buffer
+    /// must stay where it is until the read completes.
+    pub unsafe fn read(&mut self, fd: RawFd, buf: *mut u8, len: usize, offset: u64, user_data: u64) {
+        self.push(IORING_OP_READ, fd, buf as u64, len, offset, user_data);
+    }
+
+    /// Queues a write, like `read`.
+    pub unsafe fn write(&mut self, fd: RawFd, buf: *const u8, len: usize, offset: u64, user_data: u64) {
+        self.push(IORING_OP_WRITE, fd, buf as u64, len, offset, user_data);
+    }
+
+    unsafe fn push(&mut self, opcode: u8, fd: RawFd, addr: u64, len: usize, offset: u64, user_data: u64) {
+        debug_assert!(self.has_room());
+        let tail_ptr = &*self.sq.at::<AtomicU32>(self.params.sq_off.tail);
+        let mask = *self.sq.at::<u32>(self.params.sq_off.ring_mask);
+        let tail = tail_ptr.load(Ordering::Relaxed);
+        let index = tail & mask;
+
+        ptr::write(self.sqes.at::<Sqe>(index * 64), Sqe {
+            opcode: opcode,
+            flags: 0,
+            ioprio: 0,
+            fd: fd,
+            off: offset,
+            addr: addr,
+            len: len.min(u32::max_value() as usize) as u32,
+            rw_flags: 0,
+            user_data: user_data,
+            buf_index: 0,
+            personality: 0,
+            splice_fd_in: 0,
+            addr3: 0,
+            pad: 0,
+        });
+        *self.sq.at::<u32>(self.params.sq_off.array + index * 4) = index;
+        tail_ptr.store(tail.wrapping_add(1), Ordering::Release);
+        self.unsubmitted += 1;
+        self.in_flight += 1;
+    }
+
+    /// Submits what was queued and waits until at least one operation has
+    /// completed, then returns everything that has: the `user_data` each was
+    /// queued with, and the number of bytes transferred or the error.
+    pub fn submit_and_wait(&mut self) -> io::Result<Vec<(u64, io::Result<usize>)>> {
+        let wait = if self.in_flight > 0 { 1 } else { 0 };
+        loop {
+            let ret = unsafe { syscall(self.enter, self.fd as c_int, self.unsubmitted as c_uint, wait as c_uint, IORING_ENTER_GETEVENTS, ptr::null::<c_void>(), 0usize) };
+            if ret >= 0 {
+                self.unsubmitted -= ret as u32;
+                break;
+            }
+            let err = io::Error::last_os_error();
+            if err.kind() != io::ErrorKind::Interrupted {
+                return Err(err);
+            }
+        }
+
+        let mut completions = vec![];
+        unsafe {
+            let head_ptr = &*self.cq.at::<AtomicU32>(self.params.cq_off.head);
+            let tail = (&*self.cq.at::<AtomicU32>(self.params.cq_off.tail)).load(Ordering::Acquire);
+            let mask = *self.cq.at::<u32>(self.params.cq_off.ring_mask);
+            let mut head = head_ptr.load(Ordering::Relaxed);
+            while head != tail {
+                let cqe = &*self.cq.at::<Cqe>(self.params.cq_off.cqes + (head & mask) * 16);
+                let result = if cqe.res < 0 { Err(io::Error::from_raw_os_error(-cqe.res)) } else { Ok(cqe.res as usize) };
+                completions.push((cqe.user_data, result));
+                head = head.wrapping_add(1);
+            }
+            head_ptr.store(head, Ordering::Release);
+        }
+        self.in_flight -= completions.len();
+        Ok(completions)
+    }
+}
+
+impl Drop for Ring {
+    fn drop(&mut self) {
+        unsafe { close(self.fd) };
+    }
+}
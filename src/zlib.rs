@@ -5,7 +5,27 @@ use byteorder::{BigEndian, WriteBytesExt};
 use deflate::{deflate, BlockType};
 use Options;
 
-pub fn zlib_compress<W>(options: &Options, in_data: &[u8], mut out: W) -> io::Result<()>
+pub fn zlib_compress<W>(options: &Options, in_data: &[u8], out: W) -> io::Result<()>
+    where W: Write
+{
+    zlib_wrap(in_data, out, |out| deflate(options, BlockType::Dynamic, in_data, out))
+}
+
+/// Writes the zlib header and trailer for `in_data` around the deflate stream
+/// that `body` writes.
+pub fn zlib_wrap<W, F>(in_data: &[u8], mut out: W, body: F) -> io::Result<()>
+    where W: Write,
+          F: FnOnce(&mut W) -> io::Result<()>
+{
+    try!(zlib_header(&mut out));
+
+    try!(body(&mut out));
+
+    let checksum = adler32(io::Cursor::new(&in_data)).expect("Error with adler32");
+    zlib_trailer(checksum, out)
+}
+
+pub fn zlib_header<W>(mut out: W) -> io::Result<()>
     where W: Write
 {
     let cmf = 120;  /* CM 8, CINFO 7. See zlib spec.*/
@@ -15,10 +35,12 @@ pub fn zlib_compress<W>(options: &Options, in_data: &[u8], mut out: W) -> io::Re
     let fcheck = 31 - cmfflg % 31;
     cmfflg += fcheck;
 
-    try!(out.by_ref().write_u16::<BigEndian>(cmfflg));
-
-    try!(deflate(options, BlockType::Dynamic, in_data, out.by_ref()));
+    out.write_u16::<BigEndian>(cmfflg)
+}
 
-    let checksum = adler32(io::Cursor::new(&in_data)).expect("Error with adler32");
+/// Writes the Adler-32 checksum of the uncompressed data.
+pub fn zlib_trailer<W>(checksum: u32, mut out: W) -> io::Result<()>
+    where W: Write
+{
     out.write_u32::<BigEndian>(checksum)
 }
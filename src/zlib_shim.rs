@@ -0,0 +1,435 @@
+//! zlib's compression functions, backed by Zopfli, for programs written against
+//! zlib. Built with the `zlib-shim` feature into libzopfli-zlib.so; linking that
+//! before -lz makes `deflate`, `compress2` and friends use Zopfli, while
+//! inflating and everything else still comes from zlib.
+//!
+//! The compression level is the number of Zopfli iterations, so levels above 9
+//! give iteration counts zlib doesn't know, and Z_DEFAULT_COMPRESSION gives the
+//! 15 of the zopfli command. Level 0 keeps the greedy LZ77 instead of storing.
+//! The strategy and memLevel are checked but have no effect, and the window is
+//! always 32K. State is allocated by Rust, not with zalloc.
+//!
+//! Every deflate function of zlib is defined here, so none of them is handed a
+//! stream whose state zlib doesn't know. Preset dictionaries, custom gzip
+//! headers, priming bits and copying a stream aren't supported: those return
+//! Z_STREAM_ERROR, as zlib does for calls that don't fit the stream.
+#![allow(non_camel_case_types)]
+
+use std::ffi::CStr;
+use std::io::Write;
+use std::mem;
+use std::os::raw::{c_char, c_int, c_uint, c_ulong, c_void};
+use std::panic::{self, AssertUnwindSafe};
+use std::ptr;
+use std::slice;
+
+use stream::Encoder;
+use {compress, Format, Options};
+
+const Z_OK: c_int = 0;
+const Z_STREAM_END: c_int = 1;
+const Z_STREAM_ERROR: c_int = -2;
+const Z_MEM_ERROR: c_int = -4;
+const Z_BUF_ERROR: c_int = -5;
+const Z_VERSION_ERROR: c_int = -6;
+
+const Z_NO_FLUSH: c_int = 0;
+const Z_PARTIAL_FLUSH: c_int = 1;
+const Z_SYNC_FLUSH: c_int = 2;
+const Z_FULL_FLUSH: c_int = 3;
+const Z_FINISH: c_int = 4;
+const Z_BLOCK: c_int = 5;
+
+const Z_DEFAULT_COMPRESSION: c_int = -1;
+const Z_FIXED: c_int = 4;
+const Z_DEFLATED: c_int = 8;
+const Z_UNKNOWN: c_int = 2;
+
+/// zlib's z_stream, field for field.
+#[repr(C)]
+pub struct z_stream {
+    next_in: *const u8,
+    avail_in: c_uint,
+    total_in: c_ulong,
+
+    next_out: *mut u8,
+    avail_out: c_uint,
+    total_out: c_ulong,
+
+    msg: *const c_char,
+    state: *mut c_void,
+
+    zalloc: *mut c_void,
+    zfree: *mut c_void,
+    opaque: *mut c_void,
+
+    data_type: c_int,
+    adler: c_ulong,
+    reserved: c_ulong,
+}
+
+struct State {
+    /* None once finished, the rest of the output is then in out. */
+    encoder: Option<Encoder<Vec<u8>>>,
+    out: Vec<u8>,
+    /* Whether there was input since the last flush. A flush call that is
+    repeated to get the rest of the output shouldn't flush again. */
+    unflushed: bool,
+    options: Options,
+    output_type: Format,
+}
+
+impl State {
+    fn new(options: Options, output_type: Format) -> Option<State> {
+        Encoder::new(&options, output_type, vec![]).ok().map(|encoder| State {
+            encoder: Some(encoder),
+            out: vec![],
+            unflushed: false,
+            options: options,
+            output_type: output_type,
+        })
+    }
+
+    fn pending(&mut self) -> &mut Vec<u8> {
+        match self.encoder {
+            Some(ref mut encoder) => encoder.get_mut(),
+            None => &mut self.out,
+        }
+    }
+}
+
+fn guard<F>(f: F) -> c_int
+    where F: FnOnce() -> c_int
+{
+    panic::catch_unwind(AssertUnwindSafe(f)).unwrap_or(Z_STREAM_ERROR)
+}
+
+fn options(level: c_int) -> Option<Options> {
+    let mut options = Options::default();
+    match level {
+        Z_DEFAULT_COMPRESSION => {},
+        level if level >= 0 => options.numiterations = level,
+        _ => return None,
+    }
+    Some(options)
+}
+
+unsafe fn version_ok(version: *const c_char, stream_size: c_int) -> bool {
+    !version.is_null() && CStr::from_ptr(version).to_bytes().first() == Some(&b'1') && stream_size as usize == mem::size_of::<z_stream>()
+}
+
+unsafe fn state<'a>(strm: *mut z_stream) -> Option<(&'a mut z_stream, &'a mut State)> {
+    let strm = match strm.as_mut() {
+        Some(strm) => strm,
+        None => return None,
+    };
+    let state = match (strm.state as *mut State).as_mut() {
+        Some(state) => state,
+        None => return None,
+    };
+    Some((strm, state))
+}
+
+#[export_name = "deflateInit2_"]
+pub unsafe extern "C" fn deflate_init2(strm: *mut z_stream, level: c_int, method: c_int, window_bits: c_int, mem_level: c_int, _strategy: c_int, version: *const c_char, stream_size: c_int) -> c_int {
+    if !version_ok(version, stream_size) {
+        return Z_VERSION_ERROR;
+    }
+    let strm = match strm.as_mut() {
+        Some(strm) => strm,
+        None => return Z_STREAM_ERROR,
+    };
+    let output_type = match window_bits {
+        -15..=-8 => Format::Deflate,
+        8..=15 => Format::Zlib,
+        24..=31 => Format::Gzip,
+        _ => return Z_STREAM_ERROR,
+    };
+    let options = match options(level) {
+        Some(options) if method == Z_DEFLATED && mem_level >= 1 && mem_level <= 9 => options,
+        _ => return Z_STREAM_ERROR,
+    };
+    let state = match State::new(options, output_type) {
+        Some(state) => state,
+        None => return Z_MEM_ERROR,
+    };
+    strm.state = Box::into_raw(Box::new(state)) as *mut c_void;
+    strm.msg = ptr::null();
+    strm.total_in = 0;
+    strm.total_out = 0;
+    strm.data_type = Z_UNKNOWN;
+    strm.adler = if output_type == Format::Gzip { 0 } else { 1 };
+    Z_OK
+}
+
+#[export_name = "deflateInit_"]
+pub unsafe extern "C" fn deflate_init(strm: *mut z_stream, level: c_int, version: *const c_char, stream_size: c_int) -> c_int {
+    deflate_init2(strm, level, Z_DEFLATED, 15, 8, 0, version, stream_size)
+}
+
+/// Takes in all of the input at once, the encoder buffers it until it has a
+/// master block. Output is handed out as far as there is room for it.
+#[export_name = "deflate"]
+pub unsafe extern "C" fn zlib_deflate(strm: *mut z_stream, flush: c_int) -> c_int {
+    let (strm, state) = match state(strm) {
+        Some(stream) => stream,
+        None => return Z_STREAM_ERROR,
+    };
+    if (strm.next_out.is_null() && strm.avail_out > 0) || (strm.next_in.is_null() && strm.avail_in > 0) || flush < Z_NO_FLUSH || flush > Z_BLOCK {
+        return Z_STREAM_ERROR;
+    }
+    guard(|| {
+        let consumed = strm.avail_in > 0;
+        if consumed {
+            let encoder = match state.encoder {
+                Some(ref mut encoder) => encoder,
+                None => return Z_STREAM_ERROR,
+            };
+            let input = slice::from_raw_parts(strm.next_in, strm.avail_in as usize);
+            if encoder.write_all(input).is_err() {
+                return Z_STREAM_ERROR;
+            }
+            strm.next_in = strm.next_in.add(input.len());
+            strm.total_in += input.len() as c_ulong;
+            strm.avail_in = 0;
+            strm.adler = encoder.checksum() as c_ulong;
+            state.unflushed = true;
+        }
+
+        let flush = match flush {
+            Z_PARTIAL_FLUSH | Z_SYNC_FLUSH | Z_FULL_FLUSH if !state.unflushed => Z_NO_FLUSH,
+            flush => flush,
+        };
+        let flushed = match (flush, state.encoder.take()) {
+            (Z_FINISH, Some(encoder)) => encoder.finish().map(|out| state.out = out),
+            (Z_SYNC_FLUSH, Some(mut encoder)) | (Z_PARTIAL_FLUSH, Some(mut encoder)) => {
+                let result = encoder.sync_flush();
+                state.encoder = Some(encoder);
+                result
+            },
+            (Z_FULL_FLUSH, Some(mut encoder)) => {
+                let result = encoder.full_flush();
+                state.encoder = Some(encoder);
+                result
+            },
+            (_, encoder) => {
+                state.encoder = encoder;
+                Ok(())
+            },
+        };
+        if flushed.is_err() {
+            return Z_STREAM_ERROR;
+        }
+        if flush != Z_NO_FLUSH && flush != Z_BLOCK {
+            state.unflushed = false;
+        }
+
+        let pending = state.pending();
+        let n = pending.len().min(strm.avail_out as usize);
+        if n > 0 {
+            ptr::copy_nonoverlapping(pending.as_ptr(), strm.next_out, n);
+            pending.drain(..n);
+            strm.next_out = strm.next_out.add(n);
+            strm.avail_out -= n as c_uint;
+            strm.total_out += n as c_ulong;
+        }
+        let done = pending.is_empty();
+
+        if state.encoder.is_none() {
+            if done { Z_STREAM_END } else { Z_OK }
+        } else if n == 0 && !consumed {
+            /* No progress was possible. */
+            Z_BUF_ERROR
+        } else {
+            Z_OK
+        }
+    })
+}
+
+#[export_name = "deflateReset"]
+pub unsafe extern "C" fn deflate_reset(strm: *mut z_stream) -> c_int {
+    let (strm, state) = match state(strm) {
+        Some(stream) => stream,
+        None => return Z_STREAM_ERROR,
+    };
+    *state = match State::new(state.options.clone(), state.output_type) {
+        Some(state) => state,
+        None => return Z_MEM_ERROR,
+    };
+    strm.total_in = 0;
+    strm.total_out = 0;
+    strm.adler = if state.output_type == Format::Gzip { 0 } else { 1 };
+    Z_OK
+}
+
+#[export_name = "deflateEnd"]
+pub unsafe extern "C" fn deflate_end(strm: *mut z_stream) -> c_int {
+    let strm = match strm.as_mut() {
+        Some(strm) if !strm.state.is_null() => strm,
+        _ => return Z_STREAM_ERROR,
+    };
+    drop(Box::from_raw(strm.state as *mut State));
+    strm.state = ptr::null_mut();
+    Z_OK
+}
+
+#[export_name = "deflateResetKeep"]
+pub unsafe extern "C" fn deflate_reset_keep(strm: *mut z_stream) -> c_int {
+    deflate_reset(strm)
+}
+
+/// Applies to the master blocks compressed from now on, which includes the
+/// input given so far that wasn't compressed yet.
+#[export_name = "deflateParams"]
+pub unsafe extern "C" fn deflate_params(strm: *mut z_stream, level: c_int, strategy: c_int) -> c_int {
+    let state = match state(strm) {
+        Some((_, state)) => state,
+        None => return Z_STREAM_ERROR,
+    };
+    let options = match options(level) {
+        Some(options) if strategy >= 0 && strategy <= Z_FIXED => options,
+        _ => return Z_STREAM_ERROR,
+    };
+    state.options.numiterations = options.numiterations;
+    if let Some(ref mut encoder) = state.encoder {
+        encoder.set_options(&state.options);
+    }
+    Z_OK
+}
+
+/// The match parameters of zlib have no counterpart in Zopfli.
+#[export_name = "deflateTune"]
+pub unsafe extern "C" fn deflate_tune(strm: *mut z_stream, _good_length: c_int, _max_lazy: c_int, _nice_length: c_int, _max_chain: c_int) -> c_int {
+    if state(strm).is_none() {
+        return Z_STREAM_ERROR;
+    }
+    Z_OK
+}
+
+/// Reports the output that `deflate` couldn't hand out yet for lack of room.
+/// Bits of an incomplete byte are kept by the encoder until the next block and
+/// aren't counted.
+#[export_name = "deflatePending"]
+pub unsafe extern "C" fn deflate_pending(strm: *mut z_stream, pending: *mut c_uint, bits: *mut c_int) -> c_int {
+    let state = match state(strm) {
+        Some((_, state)) => state,
+        None => return Z_STREAM_ERROR,
+    };
+    if let Some(pending) = pending.as_mut() {
+        *pending = state.pending().len() as c_uint;
+    }
+    if let Some(bits) = bits.as_mut() {
+        *bits = 0;
+    }
+    Z_OK
+}
+
+#[export_name = "deflateSetDictionary"]
+pub unsafe extern "C" fn deflate_set_dictionary(_strm: *mut z_stream, _dictionary: *const u8, _dict_length: c_uint) -> c_int {
+    Z_STREAM_ERROR
+}
+
+#[export_name = "deflateGetDictionary"]
+pub unsafe extern "C" fn deflate_get_dictionary(_strm: *mut z_stream, _dictionary: *mut u8, _dict_length: *mut c_uint) -> c_int {
+    Z_STREAM_ERROR
+}
+
+#[export_name = "deflateSetHeader"]
+pub unsafe extern "C" fn deflate_set_header(_strm: *mut z_stream, _head: *mut c_void) -> c_int {
+    Z_STREAM_ERROR
+}
+
+#[export_name = "deflatePrime"]
+pub unsafe extern "C" fn deflate_prime(_strm: *mut z_stream, _bits: c_int, _value: c_int) -> c_int {
+    Z_STREAM_ERROR
+}
+
+#[export_name = "deflateCopy"]
+pub unsafe extern "C" fn deflate_copy(_dest: *mut z_stream, _source: *mut z_stream) -> c_int {
+    Z_STREAM_ERROR
+}
+
+#[export_name = "deflateUsed"]
+pub unsafe extern "C" fn deflate_used(_strm: *mut z_stream, _bits: *mut c_int) -> c_int {
+    Z_STREAM_ERROR
+}
+
+#[export_name = "compressBound"]
+pub extern "C" fn compress_bound(source_len: c_ulong) -> c_ulong {
+    /* zlib's bound holds for Zopfli too: it falls back to stored blocks, of at
+    most 5 bytes overhead each, and the bound allows far more than that. */
+    source_len + (source_len >> 12) + (source_len >> 14) + (source_len >> 25) + 13
+}
+
+#[export_name = "deflateBound"]
+pub extern "C" fn deflate_bound(_strm: *mut z_stream, source_len: c_ulong) -> c_ulong {
+    /* Room for a gzip header and trailer instead of zlib's 6 bytes. */
+    compress_bound(source_len) + 12
+}
+
+#[export_name = "compress2"]
+pub unsafe extern "C" fn compress2(dest: *mut u8, dest_len: *mut c_ulong, source: *const u8, source_len: c_ulong, level: c_int) -> c_int {
+    if dest_len.is_null() || (dest.is_null() && *dest_len > 0) || (source.is_null() && source_len > 0) {
+        return Z_STREAM_ERROR;
+    }
+    let options = match options(level) {
+        Some(options) => options,
+        None => return Z_STREAM_ERROR,
+    };
+    guard(|| {
+        let source = if source_len == 0 { &[][..] } else { slice::from_raw_parts(source, source_len as usize) };
+        let mut out = Vec::with_capacity(*dest_len as usize);
+        if compress(&options, &Format::Zlib, source, &mut out).is_err() {
+            return Z_MEM_ERROR;
+        }
+        if out.len() > *dest_len as usize {
+            return Z_BUF_ERROR;
+        }
+        ptr::copy_nonoverlapping(out.as_ptr(), dest, out.len());
+        *dest_len = out.len() as c_ulong;
+        Z_OK
+    })
+}
+
+#[export_name = "compress"]
+pub unsafe extern "C" fn zlib_compress(dest: *mut u8, dest_len: *mut c_ulong, source: *const u8, source_len: c_ulong) -> c_int {
+    compress2(dest, dest_len, source, source_len, Z_DEFAULT_COMPRESSION)
+}
+
+#[cfg(test)]
+mod test {
+    use super::*;
+
+    #[test]
+    fn deflate_with_a_small_output_buffer() {
+        let data = include_bytes!("../test/data/30-min.csv");
+        unsafe {
+            let mut strm: z_stream = mem::zeroed();
+            let version = b"1.2.11\0";
+            assert_eq!(deflate_init2(&mut strm, 1, Z_DEFLATED, 31, 8, 0, version.as_ptr().cast(), mem::size_of::<z_stream>() as c_int), Z_OK);
+            strm.next_in = data.as_ptr();
+            strm.avail_in = data.len() as c_uint;
+
+            let mut out = vec![];
+            let mut chunk = [0u8; 37];
+            loop {
+                strm.next_out = chunk.as_mut_ptr();
+                strm.avail_out = chunk.len() as c_uint;
+                let ret = zlib_deflate(&mut strm, Z_FINISH);
+                out.extend_from_slice(&chunk[..chunk.len() - strm.avail_out as usize]);
+                if ret == Z_STREAM_END {
+                    break;
+                }
+                assert_eq!(ret, Z_OK);
+            }
+            assert_eq!(strm.total_out as usize, out.len());
+            assert_eq!(deflate_end(&mut strm), Z_OK);
+
+            let mut options = Options::default();
+            options.numiterations = 1;
+            let mut expected = vec![];
+            compress(&options, &Format::Gzip, data, &mut expected).unwrap();
+            assert_eq!(out, expected);
+        }
+    }
+}